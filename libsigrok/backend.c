@@ -28,6 +28,10 @@
  */
 SR_API int sr_init(void)
 {
+	/* The threaded session mode needs the glib thread system. */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
 	return SR_OK;
 }
 
@@ -39,6 +43,7 @@ SR_API int sr_init(void)
 SR_API int sr_exit(void)
 {
 	sr_hw_cleanup_all();
+	sr_datastore_pool_free();
 
 	return SR_OK;
 }
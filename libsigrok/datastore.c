@@ -20,11 +20,131 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static gpointer new_chunk(struct sr_datastore **ds);
+/* An entry in the datastore's chunk table. */
+struct ds_chunk {
+	/* The chunk's units, or NULL if the chunk is not resident. */
+	uint8_t *data;
+	/* TRUE if 'data' is mmap()ed from the backing file. */
+	gboolean mapped;
+	/* Run-length encoded units, or NULL if the chunk is not encoded. */
+	uint8_t *rle;
+	/* Number of runs in 'rle'. */
+	guint num_runs;
+	/* Bit-planes, one after the other, or NULL if not enabled. */
+	uint8_t *planes;
+	/* TRUE if 'data' was allocated with huge page alignment. */
+	gboolean huge;
+};
+
+/* A free chunk buffer in the chunk pool. */
+struct pool_chunk {
+	uint8_t *data;
+	uint64_t size;
+	gboolean huge;
+};
+
+/*
+ * Chunk buffers released by datastores are kept in the chunk pool for reuse,
+ * up to pool_max bytes, so that back-to-back captures don't have to get
+ * their memory from the system (and fault it in) all over again.
+ * The pool is shared by all datastores in the process.
+ */
+G_LOCK_DEFINE_STATIC(pool);
+static GSList *pool = NULL;
+static uint64_t pool_size = 0;
+static uint64_t pool_max = DATASTORE_POOL_SIZE;
+
+/* Huge page size, and alignment of chunks backed by huge pages. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#if defined(HAVE_POSIX_MEMALIGN) && defined(HAVE_SYS_MMAN_H) \
+	&& defined(MADV_HUGEPAGE)
+#define HAVE_HUGE_PAGES 1
+#endif
+
+/*
+ * A run-length encoded chunk is a sequence of runs, each consisting of the
+ * run length (uint32_t, host byte order) followed by the unit itself.
+ */
+#define RLE_RUN_SIZE(unitsize) (sizeof(uint32_t) + (unitsize))
+
+/*
+ * The bit-plane of a probe holds one bit per unit in the chunk, LSB first.
+ * Bit n of the units is probe n, starting at 0.
+ */
+#define PLANE_SIZE(ds) ((ds)->chunksize / 8)
+
+/*
+ * The summary pyramid. An entry on level 0 summarizes SUMMARY_BUCKET units,
+ * an entry on level n + 1 summarizes SUMMARY_FANOUT entries on level n.
+ */
+#define SUMMARY_BUCKET 256
+#define SUMMARY_FANOUT 16
+
+/* An entry in the summary pyramid. Bit n is probe n, starting at 0. */
+struct ds_summary {
+	/* Probes which toggled in the bucket, including at its first unit. */
+	uint64_t toggled;
+	/* Value of the last unit in the bucket. */
+	uint64_t last;
+};
+
+/*
+ * The edge index counts the transitions of every probe per block of
+ * EDGE_BLOCK units. Their exact positions are found by scanning the block.
+ */
+#define EDGE_BLOCK 4096
+
+/*
+ * The edge index of a probe. A transition at unit n means that the probe's
+ * value in unit n differs from the one in unit n - 1.
+ */
+struct ds_edges {
+	/* The probe, i.e. the bit number within a unit. */
+	int probe;
+	/* For every block, the number of transitions before it (uint64_t). */
+	GArray *block_rank;
+	/* The number of transitions so far. */
+	uint64_t count;
+};
+
+static struct ds_chunk *new_chunk(struct sr_datastore *ds);
+static uint8_t *chunk_alloc(uint64_t size, gboolean huge);
+static void chunk_release(uint8_t *data, uint64_t size, gboolean huge);
+static void chunk_free(uint8_t *data, gboolean huge);
+static void pool_trim(uint64_t max_size);
+static int chunk_full(struct sr_datastore *ds, guint index);
+static const uint8_t *chunk_data(struct sr_datastore *ds, guint index);
+static int rle_encode(struct sr_datastore *ds, struct ds_chunk *chunk);
+static const uint8_t *rle_decode(struct sr_datastore *ds,
+				 struct ds_chunk *chunk, guint index);
+static void planes_fill(struct sr_datastore *ds, struct ds_chunk *chunk,
+			uint64_t start, uint64_t num_units);
+static void index_add(struct sr_datastore *ds, const uint8_t *data,
+		      uint64_t num_units);
+static int summary_range(struct sr_datastore *ds, uint64_t start,
+			 uint64_t end, uint64_t *toggled, uint64_t *last);
+static void edges_free(struct sr_datastore *ds);
+static struct ds_edges *edges_get(struct sr_datastore *ds, int probe,
+				  const char *func);
+static int edges_rank(struct sr_datastore *ds, struct ds_edges *edges,
+		      uint64_t pos, uint64_t *rank);
+static int edges_position(struct sr_datastore *ds, struct ds_edges *edges,
+			  uint64_t index, uint64_t *edge);
 
 /**
  * Create a new datastore with the specified unit size.
@@ -37,10 +157,13 @@ static gpointer new_chunk(struct sr_datastore **ds);
  * datastore via the sr_datastore_destroy() function, if no longer needed.
  *
  * TODO: Unitsize should probably be unsigned int or uint32_t or similar.
- * TODO: This function should have a 'chunksize' parameter, and
- *       struct sr_datastore a 'chunksize' field.
  *
  * @param unitsize The unit size (>= 1) to be used for this datastore.
+ * @param chunksize The number of units per chunk, or 0 for the default
+ *                  (DATASTORE_CHUNKSIZE). Must be a multiple of 256, and
+ *                  less than 4G. Larger chunks mean fewer allocations and
+ *                  fewer chunk switches when reading; smaller chunks waste
+ *                  less memory at the end of short captures.
  * @param ds Pointer to a variable which will hold the newly created
  *           datastore structure.
  *           
@@ -48,7 +171,8 @@ static gpointer new_chunk(struct sr_datastore **ds);
  *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
  *         is returned, the value of 'ds' is undefined.
  */
-SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
+SR_API int sr_datastore_new(int unitsize, uint64_t chunksize,
+			    struct sr_datastore **ds)
 {
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
@@ -61,23 +185,435 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 		return SR_ERR_ARG;
 	}
 
+	if (chunksize == 0)
+		chunksize = DATASTORE_CHUNKSIZE;
+
+	/* Whole bit-plane bytes and summary buckets, 32-bit run lengths. */
+	if (chunksize % SUMMARY_BUCKET || chunksize > G_MAXUINT32) {
+		sr_err("ds: %s: invalid chunksize %" PRIu64, __func__,
+		       chunksize);
+		return SR_ERR_ARG;
+	}
+
 	if (!(*ds = g_try_malloc(sizeof(struct sr_datastore)))) {
 		sr_err("ds: %s: ds malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
 	(*ds)->ds_unitsize = unitsize;
+	(*ds)->chunksize = chunksize;
 	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	(*ds)->chunks = g_ptr_array_new();
+	(*ds)->fd = -1;
+	(*ds)->filename = NULL;
+	(*ds)->max_resident = 0;
+	(*ds)->resident = 0;
+	(*ds)->resident_chunks = NULL;
+	(*ds)->rle = FALSE;
+	(*ds)->decoded = NULL;
+	(*ds)->decoded_index = G_MAXUINT;
+	(*ds)->bitplanes = FALSE;
+	(*ds)->summary = NULL;
+	(*ds)->summary_toggled = 0;
+	(*ds)->edges = NULL;
+	(*ds)->last_value = 0;
+	(*ds)->hugepages = FALSE;
+
+	return SR_OK;
+}
+
+/**
+ * Make the specified datastore keep its data in a file instead of in memory.
+ *
+ * Once a chunk is full, it is written to the backing file. At most
+ * 'max_resident' bytes of full chunks are kept in memory; beyond that, the
+ * oldest chunks are dropped from memory. Reading a chunk which is not in
+ * memory maps it back in from the file, again within the same budget.
+ * The chunk which is currently being filled is always kept in memory.
+ *
+ * This allows for captures which are much larger than the available RAM,
+ * without changing the way data is put into or read from the datastore.
+ *
+ * This must be called before any data is put into the datastore.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param filename The file to store the data in. It is created (or
+ *                 truncated) and left behind when the datastore is
+ *                 destroyed. If NULL, an anonymous temporary file is used
+ *                 instead, which disappears along with the datastore.
+ * @param max_resident The maximum number of bytes of full chunks to keep
+ *                     in memory. 0 means to only keep the chunk which is
+ *                     currently being filled or read.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR if the
+ *         file could not be created or the platform doesn't support
+ *         file-backed datastores.
+ */
+SR_API int sr_datastore_backing_file_set(struct sr_datastore *ds,
+					 const char *filename,
+					 uint64_t max_resident)
+{
+#ifdef HAVE_SYS_MMAN_H
+	GError *error;
+	char *tmpname;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0 || ds->fd != -1) {
+		sr_err("ds: %s: the backing file must be set before any data "
+		       "is put into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->rle) {
+		sr_err("ds: %s: run-length encoded datastores can't have a "
+		       "backing file", __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Chunks are mapped back in at their offset in the file. */
+	if ((ds->chunksize * ds->ds_unitsize) % sysconf(_SC_PAGESIZE)) {
+		sr_err("ds: %s: chunks of %" PRIu64 " bytes are not a multiple "
+		       "of the page size", __func__,
+		       ds->chunksize * ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (filename) {
+		ds->fd = g_open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (ds->fd == -1) {
+			sr_err("ds: %s: failed to create '%s': %s", __func__,
+			       filename, g_strerror(errno));
+			return SR_ERR;
+		}
+		ds->filename = g_strdup(filename);
+	} else {
+		error = NULL;
+		ds->fd = g_file_open_tmp("sigrok-ds-XXXXXX", &tmpname, &error);
+		if (ds->fd == -1) {
+			sr_err("ds: %s: failed to create temporary file: %s",
+			       __func__, error->message);
+			g_error_free(error);
+			return SR_ERR;
+		}
+		/* The file lives on until the descriptor is closed. */
+		g_unlink(tmpname);
+		g_free(tmpname);
+	}
+
+	/* Only once the file is open, so failing leaves nothing behind. */
+	if (!(ds->resident_chunks = g_queue_new())) {
+		sr_err("ds: %s: resident_chunks malloc failed", __func__);
+		close(ds->fd);
+		ds->fd = -1;
+		g_free(ds->filename);
+		ds->filename = NULL;
+		return SR_ERR_MALLOC;
+	}
+
+	ds->max_resident = max_resident;
+	sr_dbg("ds: %s: backing file %s, at most %" PRIu64 " bytes resident",
+	       __func__, filename ? filename : "(temporary)", max_resident);
+
+	return SR_OK;
+#else
+	(void)filename;
+	(void)max_resident;
+
+	sr_err("ds: %s: file-backed datastores are not supported on this "
+	       "platform", __func__);
+
+	return ds ? SR_ERR : SR_ERR_ARG;
+#endif
+}
+
+/**
+ * Enable or disable run-length encoding of the specified datastore.
+ *
+ * Logic captures mostly consist of long runs of identical units. With
+ * run-length encoding enabled, every chunk is encoded as soon as it is full,
+ * which typically reduces the memory used by the datastore by orders of
+ * magnitude. Reading from the datastore decodes the data transparently.
+ * Use sr_datastore_iter_next_run() to read the runs without decoding them.
+ *
+ * Chunks which would not get smaller by encoding them are kept as they are.
+ *
+ * This must be called before any data is put into the datastore, and
+ * can't be combined with a backing file.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param rle TRUE to enable run-length encoding, FALSE to disable it.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_rle_set(struct sr_datastore *ds, gboolean rle)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0) {
+		sr_err("ds: %s: run-length encoding must be set before any "
+		       "data is put into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle && ds->fd != -1) {
+		sr_err("ds: %s: datastores with a backing file can't be "
+		       "run-length encoded", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ds->rle = rle;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable bit-planes for the specified datastore.
+ *
+ * With bit-planes enabled, the datastore additionally keeps one packed
+ * bitstream per probe for every chunk, which is filled in as data is put
+ * into the datastore. Tools which only look at a few probes of a wide
+ * capture can then use sr_datastore_bitplane_get() to read just the bits
+ * they need, instead of scanning all units.
+ *
+ * Bit-planes are always kept in memory, and take up as much memory as the
+ * raw data, no matter whether the datastore is run-length encoded or has a
+ * backing file.
+ *
+ * This must be called before any data is put into the datastore.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param bitplanes TRUE to enable bit-planes, FALSE to disable them.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_bitplanes_set(struct sr_datastore *ds,
+				      gboolean bitplanes)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0) {
+		sr_err("ds: %s: bit-planes must be set before any data is "
+		       "put into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	ds->bitplanes = bitplanes;
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable the summary pyramid of the specified datastore.
+ *
+ * With the summary pyramid enabled, the datastore keeps track of which
+ * probes toggled in every block of SUMMARY_BUCKET units, and of the value of
+ * the last unit in the block. Every SUMMARY_FANOUT of those entries are in
+ * turn summarized on the next level, and so on. The pyramid is updated as
+ * data is put into the datastore, and costs about 1/16th of a byte of
+ * memory per unit.
+ *
+ * sr_datastore_summary_get() uses it to decimate any range of units to a
+ * given number of pixels, in time proportional to the number of pixels
+ * rather than the number of units.
+ *
+ * This must be called before any data is put into the datastore. Only
+ * datastores with a unit size of up to 8 bytes (64 probes) are supported.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param summary TRUE to enable the summary pyramid, FALSE to disable it.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_summary_set(struct sr_datastore *ds, gboolean summary)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0) {
+		sr_err("ds: %s: the summary must be set before any data is "
+		       "put into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->ds_unitsize > (int)sizeof(uint64_t)) {
+		sr_err("ds: %s: unitsize %d is too large for a summary",
+		       __func__, ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (summary && !ds->summary)
+		ds->summary = g_ptr_array_new();
+	else if (!summary && ds->summary) {
+		g_ptr_array_free(ds->summary, TRUE);
+		ds->summary = NULL;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable the edge index of the specified datastore.
+ *
+ * With the edge index enabled, the datastore counts the transitions of
+ * every probe per block of 4096 units as data is put into it.
+ * sr_datastore_edge_next(), sr_datastore_edge_prev() and
+ * sr_datastore_edge_count() can then jump across idle stretches of a probe
+ * in O(log(n)) time, scanning at most two blocks of units.
+ *
+ * The index takes 8 bytes per probe for every block, however many
+ * transitions there are, and is always kept in memory.
+ *
+ * This must be called before any data is put into the datastore. Only
+ * datastores with a unit size of up to 8 bytes (64 probes) are supported.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param edges TRUE to enable the edge index, FALSE to disable it.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_edges_set(struct sr_datastore *ds, gboolean edges)
+{
+	struct ds_edges *probe_edges;
+	int probe;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0) {
+		sr_err("ds: %s: the edge index must be set before any data is "
+		       "put into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->ds_unitsize > (int)sizeof(uint64_t)) {
+		sr_err("ds: %s: unitsize %d is too large for an edge index",
+		       __func__, ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (edges && !ds->edges) {
+		ds->edges = g_ptr_array_new();
+		for (probe = 0; probe < ds->ds_unitsize * 8; probe++) {
+			if (!(probe_edges = g_try_malloc(sizeof(struct ds_edges)))) {
+				sr_err("ds: %s: edges malloc failed", __func__);
+				edges_free(ds);
+				return SR_ERR_MALLOC;
+			}
+			probe_edges->probe = probe;
+			probe_edges->block_rank = g_array_new(FALSE, FALSE,
+							sizeof(uint64_t));
+			probe_edges->count = 0;
+			g_ptr_array_add(ds->edges, probe_edges);
+		}
+	} else if (!edges && ds->edges) {
+		edges_free(ds);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Enable or disable huge pages for the chunks of the specified datastore.
+ *
+ * With huge pages enabled, chunks are aligned to, and padded to a multiple
+ * of, 2 MiB, and the kernel is asked to back them with transparent huge
+ * pages. This cuts down on TLB misses when scanning through large captures.
+ * Chunks of the backing file, if any, are not affected.
+ *
+ * This must be called before any data is put into the datastore.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param hugepages TRUE to enable huge pages, FALSE to disable them.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if the platform doesn't support huge pages.
+ */
+SR_API int sr_datastore_hugepages_set(struct sr_datastore *ds,
+				      gboolean hugepages)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (ds->num_units > 0) {
+		sr_err("ds: %s: huge pages must be set before any data is put "
+		       "into the datastore", __func__);
+		return SR_ERR_ARG;
+	}
+
+#ifdef HAVE_HUGE_PAGES
+	ds->hugepages = hugepages;
+
+	return SR_OK;
+#else
+	if (!hugepages)
+		return SR_OK;
+
+	sr_err("ds: %s: huge pages are not supported on this platform",
+	       __func__);
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Set the maximum size of the chunk pool.
+ *
+ * Chunks which are no longer needed by a datastore (e.g. because it was
+ * destroyed) are kept in a pool shared by all datastores, and handed out
+ * again to the next datastore which needs a chunk of the same size. This
+ * avoids allocating and faulting in the memory again on every capture.
+ *
+ * The default is DATASTORE_POOL_SIZE. If the pool currently holds more than
+ * the new maximum, the excess chunks are freed.
+ *
+ * @param max_size The maximum number of bytes of free chunks to keep.
+ *                 0 disables the pool.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_datastore_pool_set(uint64_t max_size)
+{
+	G_LOCK(pool);
+	pool_max = max_size;
+	G_UNLOCK(pool);
+
+	pool_trim(max_size);
 
 	return SR_OK;
 }
 
+/**
+ * Free all chunks in the chunk pool.
+ *
+ * This is called by sr_exit(). The pool's maximum size is left alone.
+ */
+SR_PRIV void sr_datastore_pool_free(void)
+{
+	pool_trim(0);
+}
+
 /**
  * Destroy the specified datastore and free the memory used by it.
  *
- * This will free the memory used by the data in the datastore's 'chunklist',
- * by the chunklist data structure itself, and by the datastore struct.
+ * This will free the memory used by the data in the datastore's chunk
+ * table, by the chunk table itself, and by the datastore struct.
  *
  * @param ds The datastore to destroy.
  *
@@ -85,16 +621,43 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
  */
 SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 {
-	GSList *chunk;
+	struct ds_chunk *chunk;
+	guint i;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+	for (i = 0; i < ds->chunks->len; i++) {
+		chunk = g_ptr_array_index(ds->chunks, i);
+#ifdef HAVE_SYS_MMAN_H
+		if (chunk->mapped)
+			munmap(chunk->data, ds->chunksize * ds->ds_unitsize);
+		else
+#endif
+		if (chunk->data)
+			chunk_release(chunk->data,
+				      ds->chunksize * ds->ds_unitsize,
+				      chunk->huge);
+		g_free(chunk->rle);
+		g_free(chunk->planes);
+		g_free(chunk);
+	}
+	g_ptr_array_free(ds->chunks, TRUE);
+	if (ds->summary) {
+		for (i = 0; i < ds->summary->len; i++)
+			g_array_free(g_ptr_array_index(ds->summary, i), TRUE);
+		g_ptr_array_free(ds->summary, TRUE);
+	}
+	if (ds->edges)
+		edges_free(ds);
+	if (ds->resident_chunks)
+		g_queue_free(ds->resident_chunks);
+	if (ds->fd != -1)
+		close(ds->fd);
+	g_free(ds->filename);
+	g_free(ds->decoded);
 	g_free(ds);
 	ds = NULL;
 
@@ -104,10 +667,13 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 /**
  * Append some data to the specified datastore.
  *
- * TODO: More elaborate function description.
+ * The data is copied into the datastore's chunks, allocating new chunks
+ * as needed. Only complete units are stored; if 'length' is not a multiple
+ * of the datastore's unit size, the trailing partial unit is dropped.
+ *
+ * Appending is O(1) per chunk, no matter how much data the datastore
+ * already holds.
  *
- * TODO: This function should use the (not yet available) 'chunksize' field
- *       of struct sr_datastore (instead of hardcoding DATASTORE_CHUNKSIZE).
  * TODO: in_unitsize and probelist are unused?
  * TODO: A few of the parameters can be const.
  * TODO: Ideally, 'ds' should be unmodified upon errors.
@@ -130,9 +696,9 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		unsigned int length, int in_unitsize, const int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
-	gpointer chunk;
+	uint64_t num_units, stored, chunk_offset, chunk_free, size;
+	struct ds_chunk *chunk;
+	int ret;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
@@ -161,83 +727,1552 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		return SR_ERR_ARG;
 	}
 
-	/* Get the last chunk in the list, or create a new one if needed. */
-	if (ds->chunklist == NULL) {
-		if (!(chunk = new_chunk(&ds))) {
-			sr_err("ds: %s: couldn't allocate new chunk", __func__);
-			return SR_ERR_MALLOC;
-		}
-	} else {
-		chunk = g_slist_last(ds->chunklist)->data;
-	}
+	num_units = length / ds->ds_unitsize;
+	if (length % ds->ds_unitsize)
+		sr_dbg("ds: %s: dropping %d trailing bytes of a partial unit",
+		       __func__, length % ds->ds_unitsize);
 
-	/* Get/calculate number of chunks, free space, etc. */
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
+	/* Position of the first free unit in the last chunk (if any). */
+	chunk_offset = ds->num_units % ds->chunksize;
+	if (chunk_offset > 0)
+		chunk = g_ptr_array_index(ds->chunks, ds->chunks->len - 1);
+	else
+		chunk = NULL;
 
 	stored = 0;
-	while (stored < length) {
+	while (stored < num_units) {
 		/* No more free space left, allocate a new chunk. */
-		if (chunk_bytes_free == 0) {
-			if (!(chunk = new_chunk(&ds))) {
+		if (!chunk) {
+			if (!(chunk = new_chunk(ds))) {
 				sr_err("ds: %s: couldn't allocate new chunk",
 				       __func__);
 				return SR_ERR_MALLOC;
 			}
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
 			chunk_offset = 0;
 		}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
-			size = chunk_bytes_free;
-		else
-			/* Last part, won't fill up this chunk. */
-			size = length - stored;
+		chunk_free = ds->chunksize - chunk_offset;
+		size = MIN(num_units - stored, chunk_free);
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
+		memcpy(chunk->data + chunk_offset * ds->ds_unitsize,
+		       (uint8_t *)data + stored * ds->ds_unitsize,
+		       size * ds->ds_unitsize);
+		if (chunk->planes)
+			planes_fill(ds, chunk, chunk_offset, size);
+		if (ds->summary || ds->edges)
+			index_add(ds, chunk->data + chunk_offset * ds->ds_unitsize,
+				  size);
 		stored += size;
-	}
+		ds->num_units += size;
 
-	ds->num_units += stored / ds->ds_unitsize;
+		if (size == chunk_free) {
+			ret = chunk_full(ds, ds->chunks->len - 1);
+			if (ret != SR_OK)
+				return ret;
+			chunk = NULL;
+		} else {
+			chunk_offset += size;
+		}
+	}
 
 	return SR_OK;
 }
 
 /**
- * Allocate a new memory chunk, append it to the datastore's chunklist.
+ * Copy a range of units from the specified datastore into a buffer.
  *
- * The newly allocated chunk is added to the datastore's chunklist by this
- * function, and the return value additionally points to the new chunk.
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param start The index of the first unit to copy.
+ * @param num_units The number of units to copy. The range must be within
+ *                  the units stored in the datastore.
+ * @param buf The buffer to copy the units into. It must be large enough
+ *            to hold num_units * ds->ds_unitsize bytes. Must not be NULL.
  *
- * The allocated memory is guaranteed to be cleared.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_get_range(struct sr_datastore *ds, uint64_t start,
+				  uint64_t num_units, void *buf)
+{
+	struct sr_datastore_iter iter;
+	const void *span;
+	uint64_t span_units, copied;
+	int ret;
+
+	if (!buf) {
+		sr_err("ds: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = sr_datastore_iter_init(&iter, ds, start, num_units)) != SR_OK)
+		return ret;
+
+	copied = 0;
+	while ((ret = sr_datastore_iter_next(&iter, &span, &span_units)) == SR_OK
+	       && span_units > 0) {
+		memcpy((uint8_t *)buf + copied * ds->ds_unitsize, span,
+		       span_units * ds->ds_unitsize);
+		copied += span_units;
+	}
+
+	return ret;
+}
+
+/**
+ * Prepare an iterator over a range of units in the specified datastore.
  *
- * TODO: This function should use the datastore's 'chunksize' field instead
- *       of hardcoding DATASTORE_CHUNKSIZE.
- * TODO: Return int, so we can return SR_OK / SR_ERR_ARG / SR_ERR_MALLOC?
+ * The iterator hands out pointers directly into the datastore's chunks,
+ * so no data is copied. Each span covers a contiguous run of units which
+ * lies within a single chunk.
  *
- * @param ds Pointer to a variable which holds the datastore structure.
- *           Must not be NULL. The contents of 'ds' are modified in-place.
+ * If the datastore has a backing file or is run-length encoded, a span
+ * stays valid only until the next call to sr_datastore_iter_next(),
+ * sr_datastore_get_range() or sr_datastore_put() on the same datastore,
+ * as its chunk may be dropped from memory or decoded over afterwards.
  *
- * @return Pointer to the newly allocated chunk, or NULL upon failure.
+ * The datastore must not be destroyed while an iterator on it is in use.
+ * Appending data to the datastore while iterating is allowed, but the
+ * iterator will not see units beyond the originally requested range.
+ *
+ * @param iter Pointer to the iterator to initialize. Must not be NULL.
+ * @param ds The datastore to iterate over. Must not be NULL.
+ * @param start The index of the first unit to iterate over.
+ * @param num_units The number of units to iterate over. The range must be
+ *                  within the units stored in the datastore.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
  */
-static gpointer new_chunk(struct sr_datastore **ds)
+SR_API int sr_datastore_iter_init(struct sr_datastore_iter *iter,
+				  struct sr_datastore *ds, uint64_t start,
+				  uint64_t num_units)
 {
-	gpointer chunk;
+	if (!iter) {
+		sr_err("ds: %s: iter was NULL", __func__);
+		return SR_ERR_ARG;
+	}
 
-	/* Note: Caller checked that ds != NULL. */
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
 
-	chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize);
-	if (!chunk) {
-		sr_err("ds: %s: chunk malloc failed (ds_unitsize was %u)",
-		       __func__, (*ds)->ds_unitsize);
-		return NULL; /* TODO: SR_ERR_MALLOC later? */
+	if (start > ds->num_units || num_units > ds->num_units - start) {
+		sr_err("ds: %s: range %" PRIu64 "+%" PRIu64 " is beyond the "
+		       "%" PRIu64 " units in the datastore", __func__, start,
+		       num_units, ds->num_units);
+		return SR_ERR_ARG;
 	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	iter->ds = ds;
+	iter->pos = start;
+	iter->end = start + num_units;
+	iter->run_chunk = G_MAXUINT;
+	iter->run_index = 0;
+	iter->run_start = 0;
 
-	return chunk; /* TODO: SR_OK later? */
+	return SR_OK;
+}
+
+/**
+ * Get the next span of units from a datastore iterator.
+ *
+ * @param iter The iterator, as set up by sr_datastore_iter_init().
+ *             Must not be NULL.
+ * @param data Pointer to a variable which will point to the first unit of
+ *             the span. The memory belongs to the datastore and must not
+ *             be modified or freed. Must not be NULL.
+ * @param num_units Pointer to a variable which will hold the number of
+ *                  units in the span. This is 0 once the end of the range
+ *                  has been reached. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_iter_next(struct sr_datastore_iter *iter,
+				  const void **data, uint64_t *num_units)
+{
+	struct sr_datastore *ds;
+	uint64_t chunk_index, chunk_offset;
+	const uint8_t *chunk;
+
+	if (!iter || !iter->ds) {
+		sr_err("ds: %s: iter was NULL or uninitialized", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data || !num_units) {
+		sr_err("ds: %s: data or num_units was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (iter->pos >= iter->end) {
+		*data = NULL;
+		*num_units = 0;
+		return SR_OK;
+	}
+
+	ds = iter->ds;
+	chunk_index = iter->pos / ds->chunksize;
+	chunk_offset = iter->pos % ds->chunksize;
+	if (!(chunk = chunk_data(ds, chunk_index)))
+		return SR_ERR;
+
+	*data = chunk + chunk_offset * ds->ds_unitsize;
+	*num_units = MIN(iter->end - iter->pos,
+			 ds->chunksize - chunk_offset);
+	iter->pos += *num_units;
+
+	return SR_OK;
+}
+
+/**
+ * Get the next run of identical units from a datastore iterator.
+ *
+ * For run-length encoded chunks, the runs are taken straight from the
+ * encoded data. Otherwise, the units are compared one by one.
+ * Runs never extend across chunk boundaries, so two consecutive runs may
+ * have the same value.
+ *
+ * This can be mixed with sr_datastore_iter_next() on the same iterator.
+ *
+ * @param iter The iterator, as set up by sr_datastore_iter_init().
+ *             Must not be NULL.
+ * @param unit Pointer to a variable which will point to the value of the
+ *             units in the run. The same rules as for the spans returned
+ *             by sr_datastore_iter_next() apply. Must not be NULL.
+ * @param run_length Pointer to a variable which will hold the number of
+ *                   units in the run. This is 0 once the end of the range
+ *                   has been reached. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_iter_next_run(struct sr_datastore_iter *iter,
+				      const void **unit, uint64_t *run_length)
+{
+	struct sr_datastore *ds;
+	struct ds_chunk *chunk;
+	const uint8_t *data, *run;
+	uint64_t chunk_index, chunk_offset, chunk_end, end;
+	uint32_t length;
+	int unitsize;
+
+	if (!iter || !iter->ds) {
+		sr_err("ds: %s: iter was NULL or uninitialized", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!unit || !run_length) {
+		sr_err("ds: %s: unit or run_length was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (iter->pos >= iter->end) {
+		*unit = NULL;
+		*run_length = 0;
+		return SR_OK;
+	}
+
+	ds = iter->ds;
+	unitsize = ds->ds_unitsize;
+	chunk_index = iter->pos / ds->chunksize;
+	chunk_offset = iter->pos % ds->chunksize;
+	chunk_end = MIN(iter->end - iter->pos + chunk_offset,
+			ds->chunksize);
+	chunk = g_ptr_array_index(ds->chunks, chunk_index);
+
+	if (chunk->rle) {
+		/* Continue from the last run we returned, if possible. */
+		if (iter->run_chunk != chunk_index
+		    || iter->run_start > chunk_offset) {
+			iter->run_chunk = chunk_index;
+			iter->run_index = 0;
+			iter->run_start = 0;
+		}
+		while (TRUE) {
+			run = chunk->rle + iter->run_index * RLE_RUN_SIZE(unitsize);
+			memcpy(&length, run, sizeof(uint32_t));
+			if (chunk_offset < iter->run_start + length)
+				break;
+			iter->run_start += length;
+			iter->run_index++;
+		}
+		*unit = run + sizeof(uint32_t);
+		end = MIN(iter->run_start + length, chunk_end);
+	} else {
+		if (!(data = chunk_data(ds, chunk_index)))
+			return SR_ERR;
+		run = data + chunk_offset * unitsize;
+		for (end = chunk_offset + 1; end < chunk_end; end++) {
+			if (memcmp(data + end * unitsize, run, unitsize))
+				break;
+		}
+		*unit = run;
+	}
+
+	*run_length = end - chunk_offset;
+	iter->pos += *run_length;
+
+	return SR_OK;
+}
+
+/**
+ * Copy the bit-plane of one probe for a range of units into a buffer.
+ *
+ * Bit n of the output buffer (LSB first, i.e. bit 0 of byte 0 comes first)
+ * is the value of the probe in unit 'start' + n. Unused bits in the last
+ * byte are cleared.
+ *
+ * The datastore must have bit-planes enabled, see
+ * sr_datastore_bitplanes_set().
+ *
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param probe The probe, i.e. the bit number within a unit (starting at 0).
+ * @param start The index of the first unit.
+ * @param num_units The number of units. The range must be within the units
+ *                  stored in the datastore.
+ * @param buf The buffer to copy the bits into. It must be large enough to
+ *            hold (num_units + 7) / 8 bytes. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_datastore_bitplane_get(struct sr_datastore *ds, int probe,
+				     uint64_t start, uint64_t num_units,
+				     uint8_t *buf)
+{
+	struct ds_chunk *chunk;
+	const uint8_t *plane;
+	uint64_t chunk_offset, span, out, i;
+	unsigned int shift;
+	uint8_t b;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!buf) {
+		sr_err("ds: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!ds->bitplanes) {
+		sr_err("ds: %s: datastore has no bit-planes", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (probe < 0 || probe >= ds->ds_unitsize * 8) {
+		sr_err("ds: %s: invalid probe %d", __func__, probe);
+		return SR_ERR_ARG;
+	}
+
+	if (start > ds->num_units || num_units > ds->num_units - start) {
+		sr_err("ds: %s: range %" PRIu64 "+%" PRIu64 " is beyond the "
+		       "%" PRIu64 " units in the datastore", __func__, start,
+		       num_units, ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	memset(buf, 0, (num_units + 7) / 8);
+
+	out = 0;
+	while (out < num_units) {
+		chunk = g_ptr_array_index(ds->chunks, start / ds->chunksize);
+		chunk_offset = start % ds->chunksize;
+		span = MIN(num_units - out, ds->chunksize - chunk_offset);
+		plane = chunk->planes + probe * PLANE_SIZE(ds);
+
+		/* Single bits until the output is byte-aligned. */
+		for (i = 0; i < span && (out + i) % 8; i++) {
+			if (plane[(chunk_offset + i) / 8] & (1 << ((chunk_offset + i) % 8)))
+				buf[(out + i) / 8] |= 1 << ((out + i) % 8);
+		}
+
+		/* Whole output bytes. */
+		shift = (chunk_offset + i) % 8;
+		for (; i + 8 <= span; i += 8) {
+			b = plane[(chunk_offset + i) / 8] >> shift;
+			if (shift)
+				b |= plane[(chunk_offset + i) / 8 + 1] << (8 - shift);
+			buf[(out + i) / 8] = b;
+		}
+
+		/* Remaining bits. */
+		for (; i < span; i++) {
+			if (plane[(chunk_offset + i) / 8] & (1 << ((chunk_offset + i) % 8)))
+				buf[(out + i) / 8] |= 1 << ((out + i) % 8);
+		}
+
+		out += span;
+		start += span;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get a decimated view of a range of units in the specified datastore.
+ *
+ * The range is split into 'num_pixels' consecutive intervals of (nearly)
+ * equal size. For every interval, the probes which toggled within it are
+ * returned, along with the value of its last unit. A toggle at the first
+ * unit of an interval, i.e. relative to the last unit of the previous
+ * interval, counts towards the interval.
+ *
+ * Bit n of the returned values is probe n, starting at 0.
+ *
+ * The datastore must have the summary pyramid enabled, see
+ * sr_datastore_summary_set(). Each interval takes O(log(num_units)) steps.
+ *
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param start The index of the first unit.
+ * @param num_units The number of units. The range must be within the units
+ *                  stored in the datastore.
+ * @param num_pixels The number of intervals to split the range into.
+ *                   Must be between 1 and num_units.
+ * @param toggled Array of num_pixels entries which will hold the probes
+ *                which toggled in each interval. Must not be NULL.
+ * @param values Array of num_pixels entries which will hold the value of
+ *               the last unit in each interval. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_summary_get(struct sr_datastore *ds, uint64_t start,
+				    uint64_t num_units, uint64_t num_pixels,
+				    uint64_t *toggled, uint64_t *values)
+{
+	uint64_t i, first, end, step, rem;
+	int ret;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!toggled || !values) {
+		sr_err("ds: %s: toggled or values was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!ds->summary) {
+		sr_err("ds: %s: datastore has no summary", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (start > ds->num_units || num_units > ds->num_units - start) {
+		sr_err("ds: %s: range %" PRIu64 "+%" PRIu64 " is beyond the "
+		       "%" PRIu64 " units in the datastore", __func__, start,
+		       num_units, ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	if (num_pixels == 0 || num_pixels > num_units) {
+		sr_err("ds: %s: can't split %" PRIu64 " units into %" PRIu64
+		       " pixels", __func__, num_units, num_pixels);
+		return SR_ERR_ARG;
+	}
+
+	/* Interval i starts at start + i * num_units / num_pixels. */
+	step = num_units / num_pixels;
+	rem = num_units % num_pixels;
+	first = start;
+	for (i = 0; i < num_pixels; i++) {
+		end = start + step * (i + 1) + rem * (i + 1) / num_pixels;
+		ret = summary_range(ds, first, end, &toggled[i], &values[i]);
+		if (ret != SR_OK)
+			return ret;
+		first = end;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Find the next transition of a probe after the specified unit.
+ *
+ * A transition at unit n means that the probe's value in unit n differs
+ * from the one in unit n - 1. The datastore must have the edge index
+ * enabled, see sr_datastore_edges_set().
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param probe The probe, i.e. the bit number within a unit (starting at 0).
+ * @param pos The index of the unit to start from. Must be within the units
+ *            stored in the datastore.
+ * @param edge Pointer to a variable which will hold the index of the first
+ *             unit after 'pos' with a transition, or the number of units
+ *             in the datastore if there is none. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_edge_next(struct sr_datastore *ds, int probe,
+				  uint64_t pos, uint64_t *edge)
+{
+	struct ds_edges *edges;
+	uint64_t index;
+	int ret;
+
+	if (!(edges = edges_get(ds, probe, __func__)))
+		return SR_ERR_ARG;
+
+	if (!edge || pos >= ds->num_units) {
+		sr_err("ds: %s: edge was NULL or pos was beyond the end",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = edges_rank(ds, edges, pos + 1, &index)) != SR_OK)
+		return ret;
+	if (index < edges->count)
+		return edges_position(ds, edges, index, edge);
+	*edge = ds->num_units;
+
+	return SR_OK;
+}
+
+/**
+ * Find the previous transition of a probe before the specified unit.
+ *
+ * See sr_datastore_edge_next() for what a transition is.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param probe The probe, i.e. the bit number within a unit (starting at 0).
+ * @param pos The index of the unit to start from. Must be within the units
+ *            stored in the datastore.
+ * @param edge Pointer to a variable which will hold the index of the last
+ *             unit before 'pos' with a transition, or 0 if there is none
+ *             (unit 0 never has a transition). Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_edge_prev(struct sr_datastore *ds, int probe,
+				  uint64_t pos, uint64_t *edge)
+{
+	struct ds_edges *edges;
+	uint64_t index;
+	int ret;
+
+	if (!(edges = edges_get(ds, probe, __func__)))
+		return SR_ERR_ARG;
+
+	if (!edge || pos >= ds->num_units) {
+		sr_err("ds: %s: edge was NULL or pos was beyond the end",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = edges_rank(ds, edges, pos, &index)) != SR_OK)
+		return ret;
+	if (index > 0)
+		return edges_position(ds, edges, index - 1, edge);
+	*edge = 0;
+
+	return SR_OK;
+}
+
+/**
+ * Count the transitions of a probe in a range of units.
+ *
+ * See sr_datastore_edge_next() for what a transition is. A transition at
+ * the first unit of the range counts.
+ *
+ * @param ds The datastore. Must not be NULL.
+ * @param probe The probe, i.e. the bit number within a unit (starting at 0).
+ * @param start The index of the first unit.
+ * @param num_units The number of units. The range must be within the units
+ *                  stored in the datastore.
+ * @param count Pointer to a variable which will hold the number of
+ *              transitions. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         if data could not be read back from the datastore's backing file.
+ */
+SR_API int sr_datastore_edge_count(struct sr_datastore *ds, int probe,
+				   uint64_t start, uint64_t num_units,
+				   uint64_t *count)
+{
+	struct ds_edges *edges;
+	uint64_t first, last;
+	int ret;
+
+	if (!(edges = edges_get(ds, probe, __func__)))
+		return SR_ERR_ARG;
+
+	if (!count) {
+		sr_err("ds: %s: count was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (start > ds->num_units || num_units > ds->num_units - start) {
+		sr_err("ds: %s: range %" PRIu64 "+%" PRIu64 " is beyond the "
+		       "%" PRIu64 " units in the datastore", __func__, start,
+		       num_units, ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = edges_rank(ds, edges, start, &first)) != SR_OK
+	    || (ret = edges_rank(ds, edges, start + num_units, &last)) != SR_OK)
+		return ret;
+	*count = last - first;
+
+	return SR_OK;
+}
+
+/**
+ * Allocate a new memory chunk, append it to the datastore's chunk table.
+ *
+ * The newly allocated chunk is added to the datastore's chunk table by this
+ * function, and the return value additionally points to the new chunk.
+ *
+ * The chunk's units are taken from the chunk pool if possible, and are not
+ * cleared. Its bit-planes, if any, are cleared.
+ *
+ * TODO: Return int, so we can return SR_OK / SR_ERR_ARG / SR_ERR_MALLOC?
+ *
+ * @param ds The datastore structure. Must not be NULL.
+ *
+ * @return Pointer to the newly allocated chunk, or NULL upon failure.
+ */
+static struct ds_chunk *new_chunk(struct sr_datastore *ds)
+{
+	struct ds_chunk *chunk;
+
+	/* Note: Caller checked that ds != NULL. */
+
+	if (!(chunk = g_try_malloc0(sizeof(struct ds_chunk)))) {
+		sr_err("ds: %s: chunk malloc failed", __func__);
+		return NULL;
+	}
+
+	chunk->huge = ds->hugepages;
+	chunk->data = chunk_alloc(ds->chunksize * ds->ds_unitsize, chunk->huge);
+	if (!chunk->data) {
+		sr_err("ds: %s: chunk malloc failed (ds_unitsize was %u)",
+		       __func__, ds->ds_unitsize);
+		g_free(chunk);
+		return NULL; /* TODO: SR_ERR_MALLOC later? */
+	}
+
+	if (ds->bitplanes) {
+		chunk->planes = g_try_malloc0(PLANE_SIZE(ds) * ds->ds_unitsize * 8);
+		if (!chunk->planes) {
+			sr_err("ds: %s: planes malloc failed", __func__);
+			chunk_release(chunk->data,
+				      ds->chunksize * ds->ds_unitsize,
+				      chunk->huge);
+			g_free(chunk);
+			return NULL;
+		}
+	}
+
+	g_ptr_array_add(ds->chunks, chunk);
+
+	return chunk; /* TODO: SR_OK later? */
+}
+
+/**
+ * Get memory for a chunk's units, from the chunk pool if possible.
+ *
+ * The memory is not cleared.
+ *
+ * @param size The size of the chunk in bytes.
+ * @param huge TRUE to align the memory to, and back it with, huge pages.
+ *
+ * @return Pointer to the memory, or NULL upon failure.
+ */
+static uint8_t *chunk_alloc(uint64_t size, gboolean huge)
+{
+	struct pool_chunk *pc;
+	GSList *l;
+	uint8_t *data;
+#ifdef HAVE_HUGE_PAGES
+	void *mem;
+	uint64_t huge_size;
+#endif
+
+	G_LOCK(pool);
+	for (l = pool; l; l = l->next) {
+		pc = l->data;
+		if (pc->size == size && pc->huge == huge) {
+			pool = g_slist_delete_link(pool, l);
+			pool_size -= size;
+			G_UNLOCK(pool);
+			data = pc->data;
+			g_free(pc);
+			return data;
+		}
+	}
+	G_UNLOCK(pool);
+
+#ifdef HAVE_HUGE_PAGES
+	if (huge) {
+		huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(uint64_t)(HUGE_PAGE_SIZE - 1);
+		if (posix_memalign(&mem, HUGE_PAGE_SIZE, huge_size))
+			return NULL;
+		/* This is only a hint, which the kernel may ignore. */
+		if (madvise(mem, huge_size, MADV_HUGEPAGE) < 0)
+			sr_dbg("ds: %s: madvise failed: %s", __func__,
+			       g_strerror(errno));
+		return mem;
+	}
+#endif
+
+	return g_try_malloc(size);
+}
+
+/**
+ * Return memory obtained from chunk_alloc() to the chunk pool, or free it
+ * if the pool is full.
+ *
+ * @param data The memory.
+ * @param size The size of the chunk in bytes.
+ * @param huge The 'huge' value the memory was allocated with.
+ */
+static void chunk_release(uint8_t *data, uint64_t size, gboolean huge)
+{
+	struct pool_chunk *pc;
+
+	G_LOCK(pool);
+	if (pool_size + size <= pool_max
+	    && (pc = g_try_malloc(sizeof(struct pool_chunk)))) {
+		pc->data = data;
+		pc->size = size;
+		pc->huge = huge;
+		pool = g_slist_prepend(pool, pc);
+		pool_size += size;
+		G_UNLOCK(pool);
+		return;
+	}
+	G_UNLOCK(pool);
+
+	chunk_free(data, huge);
+}
+
+/**
+ * Free memory obtained from chunk_alloc().
+ *
+ * @param data The memory.
+ * @param huge The 'huge' value the memory was allocated with.
+ */
+static void chunk_free(uint8_t *data, gboolean huge)
+{
+#ifdef HAVE_HUGE_PAGES
+	if (huge) {
+		free(data);
+		return;
+	}
+#else
+	(void)huge;
+#endif
+
+	g_free(data);
+}
+
+/**
+ * Free chunks from the chunk pool until it holds at most 'max_size' bytes.
+ *
+ * @param max_size The number of bytes to keep at most.
+ */
+static void pool_trim(uint64_t max_size)
+{
+	struct pool_chunk *pc;
+
+	G_LOCK(pool);
+	while (pool_size > max_size) {
+		pc = pool->data;
+		pool = g_slist_delete_link(pool, pool);
+		pool_size -= pc->size;
+		chunk_free(pc->data, pc->huge);
+		g_free(pc);
+	}
+	G_UNLOCK(pool);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/**
+ * Drop the oldest full chunks from memory, until the datastore is within
+ * its resident memory budget.
+ *
+ * @param ds The datastore. Must have a backing file.
+ * @param keep Index of a chunk which must stay in memory, because the
+ *             caller is about to use it.
+ */
+static void evict_chunks(struct sr_datastore *ds, guint keep)
+{
+	struct ds_chunk *chunk;
+	uint64_t chunk_bytes;
+	guint index;
+
+	chunk_bytes = ds->chunksize * ds->ds_unitsize;
+	while (ds->resident > ds->max_resident) {
+		index = GPOINTER_TO_UINT(g_queue_peek_head(ds->resident_chunks));
+		if (index == keep)
+			break;
+		g_queue_pop_head(ds->resident_chunks);
+		chunk = g_ptr_array_index(ds->chunks, index);
+		if (chunk->mapped)
+			munmap(chunk->data, chunk_bytes);
+		else
+			chunk_release(chunk->data, chunk_bytes, chunk->huge);
+		chunk->data = NULL;
+		chunk->mapped = FALSE;
+		ds->resident -= chunk_bytes;
+	}
+}
+#endif
+
+/**
+ * Handle a chunk which has just been filled up.
+ *
+ * For run-length encoded datastores, the chunk is encoded. For datastores
+ * with a backing file, the chunk is written to the file, and older chunks
+ * are dropped from memory as needed.
+ *
+ * @param ds The datastore.
+ * @param index Index of the chunk in the datastore's chunk table.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR if the chunk could not be written to the backing file.
+ */
+static int chunk_full(struct sr_datastore *ds, guint index)
+{
+	struct ds_chunk *chunk;
+#ifdef HAVE_SYS_MMAN_H
+	uint64_t chunk_bytes, written;
+	ssize_t ret;
+#endif
+
+	chunk = g_ptr_array_index(ds->chunks, index);
+
+	if (ds->rle)
+		return rle_encode(ds, chunk);
+
+#ifdef HAVE_SYS_MMAN_H
+	if (ds->fd == -1)
+		return SR_OK;
+
+	chunk_bytes = ds->chunksize * ds->ds_unitsize;
+	written = 0;
+	while (written < chunk_bytes) {
+		ret = pwrite(ds->fd, chunk->data + written,
+			     chunk_bytes - written,
+			     (off_t)index * chunk_bytes + written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			sr_err("ds: %s: failed to write chunk %u to the "
+			       "backing file: %s", __func__, index,
+			       g_strerror(errno));
+			return SR_ERR;
+		}
+		written += ret;
+	}
+
+	g_queue_push_tail(ds->resident_chunks, GUINT_TO_POINTER(index));
+	ds->resident += chunk_bytes;
+	evict_chunks(ds, G_MAXUINT);
+#endif
+
+	return SR_OK;
+}
+
+/**
+ * Get a pointer to the units of a chunk, mapping it back in from the
+ * backing file if it is not in memory.
+ *
+ * @param ds The datastore.
+ * @param index Index of the chunk in the datastore's chunk table.
+ *
+ * @return Pointer to the chunk's units, or NULL upon errors.
+ */
+static const uint8_t *chunk_data(struct sr_datastore *ds, guint index)
+{
+	struct ds_chunk *chunk;
+#ifdef HAVE_SYS_MMAN_H
+	uint64_t chunk_bytes;
+	void *map;
+#endif
+
+	chunk = g_ptr_array_index(ds->chunks, index);
+	if (chunk->data)
+		return chunk->data;
+
+	if (chunk->rle)
+		return rle_decode(ds, chunk, index);
+
+#ifdef HAVE_SYS_MMAN_H
+	chunk_bytes = ds->chunksize * ds->ds_unitsize;
+	map = mmap(NULL, chunk_bytes, PROT_READ, MAP_SHARED, ds->fd,
+		   (off_t)index * chunk_bytes);
+	if (map == MAP_FAILED) {
+		sr_err("ds: %s: failed to map chunk %u from the backing "
+		       "file: %s", __func__, index, g_strerror(errno));
+		return NULL;
+	}
+	chunk->data = map;
+	chunk->mapped = TRUE;
+
+	g_queue_push_tail(ds->resident_chunks, GUINT_TO_POINTER(index));
+	ds->resident += chunk_bytes;
+	evict_chunks(ds, index);
+
+	return chunk->data;
+#else
+	sr_err("ds: %s: chunk %u is not resident", __func__, index);
+
+	return NULL;
+#endif
+}
+
+/**
+ * Run-length encode a full chunk, and free its raw units.
+ *
+ * If the encoded chunk would not be smaller than the raw one, the chunk
+ * is left alone.
+ *
+ * @param ds The datastore.
+ * @param chunk The chunk to encode. Must be full, and not encoded yet.
+ *
+ * @return SR_OK upon success, or SR_ERR_MALLOC upon memory allocation
+ *         errors.
+ */
+static int rle_encode(struct sr_datastore *ds, struct ds_chunk *chunk)
+{
+	const uint8_t *unit;
+	uint8_t *run;
+	uint32_t length;
+	guint num_runs, i;
+	int unitsize;
+
+	unitsize = ds->ds_unitsize;
+
+	/* Count the runs first, so we know how much memory we need. */
+	num_runs = 1;
+	for (i = 1; i < ds->chunksize; i++) {
+		if (memcmp(chunk->data + i * unitsize,
+			   chunk->data + (i - 1) * unitsize, unitsize))
+			num_runs++;
+	}
+
+	if ((uint64_t)num_runs * RLE_RUN_SIZE(unitsize)
+	    >= (uint64_t)ds->chunksize * unitsize)
+		return SR_OK;
+
+	if (!(chunk->rle = g_try_malloc(num_runs * RLE_RUN_SIZE(unitsize)))) {
+		sr_err("ds: %s: rle malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	run = chunk->rle;
+	unit = chunk->data;
+	length = 1;
+	for (i = 1; i <= ds->chunksize; i++) {
+		if (i < ds->chunksize
+		    && !memcmp(chunk->data + i * unitsize, unit, unitsize)) {
+			length++;
+			continue;
+		}
+		memcpy(run, &length, sizeof(uint32_t));
+		memcpy(run + sizeof(uint32_t), unit, unitsize);
+		run += RLE_RUN_SIZE(unitsize);
+		unit = chunk->data + i * unitsize;
+		length = 1;
+	}
+	chunk->num_runs = num_runs;
+
+	chunk_release(chunk->data, ds->chunksize * unitsize, chunk->huge);
+	chunk->data = NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Decode a run-length encoded chunk into the datastore's scratch buffer.
+ *
+ * The decoded chunk stays valid until another chunk is decoded.
+ *
+ * @param ds The datastore.
+ * @param chunk The chunk to decode.
+ * @param index Index of the chunk in the datastore's chunk table.
+ *
+ * @return Pointer to the decoded units, or NULL upon errors.
+ */
+static const uint8_t *rle_decode(struct sr_datastore *ds,
+				 struct ds_chunk *chunk, guint index)
+{
+	const uint8_t *run;
+	uint8_t *out;
+	uint32_t length, j;
+	guint i;
+	int unitsize;
+
+	if (ds->decoded_index == index)
+		return ds->decoded;
+
+	unitsize = ds->ds_unitsize;
+	if (!ds->decoded) {
+		ds->decoded = g_try_malloc(ds->chunksize * unitsize);
+		if (!ds->decoded) {
+			sr_err("ds: %s: decoded malloc failed", __func__);
+			return NULL;
+		}
+	}
+
+	out = ds->decoded;
+	run = chunk->rle;
+	for (i = 0; i < chunk->num_runs; i++) {
+		memcpy(&length, run, sizeof(uint32_t));
+		if (unitsize == 1) {
+			memset(out, run[sizeof(uint32_t)], length);
+			out += length;
+		} else {
+			for (j = 0; j < length; j++, out += unitsize)
+				memcpy(out, run + sizeof(uint32_t), unitsize);
+		}
+		run += RLE_RUN_SIZE(unitsize);
+	}
+	ds->decoded_index = index;
+
+	return ds->decoded;
+}
+
+/**
+ * Transpose an 8x8 bit matrix.
+ *
+ * Byte n of the input is row n, bit m of a byte is column m. On return,
+ * byte m holds column m of the input, i.e. bit n of byte m of the output
+ * is bit m of byte n of the input.
+ */
+static inline uint64_t transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+
+	return x;
+}
+
+/**
+ * Fill in the bit-planes of a chunk for units which were just stored.
+ *
+ * Groups of 8 units which start at a multiple of 8 are transposed in one go
+ * (16 units at a time with SSE2, for 1-byte units). The units before and
+ * after those, if any, are done one bit at a time.
+ *
+ * @param ds The datastore.
+ * @param chunk The chunk. The units must already be in chunk->data.
+ * @param start Index of the first new unit within the chunk.
+ * @param num_units Number of new units.
+ */
+static void planes_fill(struct sr_datastore *ds, struct ds_chunk *chunk,
+			uint64_t start, uint64_t num_units)
+{
+	const uint8_t *unit;
+	uint64_t i, end, x;
+	int unitsize, lane, bit, j;
+#ifdef __SSE2__
+	__m128i v;
+	uint16_t mask;
+#endif
+
+	unitsize = ds->ds_unitsize;
+	end = start + num_units;
+
+	for (i = start; i < end; i++) {
+		if (i % 8 == 0 && i + 8 <= end)
+			break;
+		unit = chunk->data + i * unitsize;
+		for (bit = 0; bit < unitsize * 8; bit++) {
+			if (unit[bit / 8] & (1 << (bit % 8)))
+				chunk->planes[bit * PLANE_SIZE(ds) + i / 8] |= 1 << (i % 8);
+		}
+	}
+
+#ifdef __SSE2__
+	if (unitsize == 1) {
+		for (; i + 16 <= end; i += 16) {
+			/* The sign bits of all bytes, from probe 7 down to 0. */
+			v = _mm_loadu_si128((const __m128i *)(chunk->data + i));
+			for (bit = 7; bit >= 0; bit--) {
+				mask = _mm_movemask_epi8(v);
+				memcpy(chunk->planes + bit * PLANE_SIZE(ds) + i / 8,
+				       &mask, sizeof(mask));
+				v = _mm_slli_epi64(v, 1);
+			}
+		}
+	}
+#endif
+
+	for (; i + 8 <= end; i += 8) {
+		for (lane = 0; lane < unitsize; lane++) {
+			x = 0;
+			for (j = 0; j < 8; j++)
+				x |= (uint64_t)chunk->data[(i + j) * unitsize + lane] << (j * 8);
+			x = transpose8(x);
+			for (bit = 0; bit < 8; bit++)
+				chunk->planes[(lane * 8 + bit) * PLANE_SIZE(ds) + i / 8] = x >> (bit * 8);
+		}
+	}
+
+	for (; i < end; i++) {
+		unit = chunk->data + i * unitsize;
+		for (bit = 0; bit < unitsize * 8; bit++) {
+			if (unit[bit / 8] & (1 << (bit % 8)))
+				chunk->planes[bit * PLANE_SIZE(ds) + i / 8] |= 1 << (i % 8);
+		}
+	}
+}
+
+/**
+ * Get the value of a unit, with bit n being probe n.
+ *
+ * @param unit Pointer to the unit.
+ * @param unitsize The unit size, at most 8.
+ */
+static inline uint64_t unit_value(const uint8_t *unit, int unitsize)
+{
+	uint64_t value;
+	int i;
+
+	value = 0;
+	for (i = 0; i < unitsize; i++)
+		value |= (uint64_t)unit[i] << (i * 8);
+
+	return value;
+}
+
+/**
+ * Count the trailing zero bits of a value.
+ *
+ * @param x The value. Must not be 0.
+ *
+ * @return The index of the lowest bit which is set.
+ */
+static inline int ctz64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int n;
+
+	for (n = 0; !(x & 1); n++)
+		x >>= 1;
+
+	return n;
+#endif
+}
+
+/**
+ * Count the bits which are set in a value.
+ *
+ * @param x The value.
+ *
+ * @return The number of bits set.
+ */
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	int n;
+
+	for (n = 0; x; n++)
+		x &= x - 1;
+
+	return n;
+#endif
+}
+
+/**
+ * Append an entry to a level of the summary pyramid, and summarize the
+ * level's last SUMMARY_FANOUT entries on the next level if they are complete.
+ *
+ * @param ds The datastore.
+ * @param level The level to append the entry to.
+ * @param toggled The probes which toggled in the entry's bucket.
+ * @param last The value of the last unit in the entry's bucket.
+ */
+static void summary_push(struct sr_datastore *ds, guint level,
+			 uint64_t toggled, uint64_t last)
+{
+	GArray *entries;
+	struct ds_summary entry, *group;
+	guint i;
+
+	while (TRUE) {
+		if (level == ds->summary->len)
+			g_ptr_array_add(ds->summary, g_array_new(FALSE, FALSE,
+					sizeof(struct ds_summary)));
+		entries = g_ptr_array_index(ds->summary, level);
+		entry.toggled = toggled;
+		entry.last = last;
+		g_array_append_val(entries, entry);
+
+		if (entries->len % SUMMARY_FANOUT)
+			break;
+
+		group = &g_array_index(entries, struct ds_summary,
+				       entries->len - SUMMARY_FANOUT);
+		toggled = 0;
+		for (i = 0; i < SUMMARY_FANOUT; i++)
+			toggled |= group[i].toggled;
+		level++;
+	}
+}
+
+/**
+ * Update the summary pyramid and the edge index for units which are being
+ * put into the datastore.
+ *
+ * @param ds The datastore. ds->num_units must not include the new units yet.
+ * @param data The new units.
+ * @param num_units Number of new units.
+ */
+static void index_add(struct sr_datastore *ds, const uint8_t *data,
+		      uint64_t num_units)
+{
+	struct ds_edges *edges;
+	uint64_t pos, value, toggled, i;
+	int unitsize, probe;
+
+	unitsize = ds->ds_unitsize;
+	pos = ds->num_units;
+	for (i = 0; i < num_units; i++, pos++) {
+		value = unit_value(data + i * unitsize, unitsize);
+		toggled = pos > 0 ? value ^ ds->last_value : 0;
+		ds->last_value = value;
+
+		if (ds->summary) {
+			ds->summary_toggled |= toggled;
+			if ((pos + 1) % SUMMARY_BUCKET == 0) {
+				summary_push(ds, 0, ds->summary_toggled, value);
+				ds->summary_toggled = 0;
+			}
+		}
+
+		if (!ds->edges)
+			continue;
+
+		if (pos % EDGE_BLOCK == 0) {
+			for (probe = 0; probe < unitsize * 8; probe++) {
+				edges = g_ptr_array_index(ds->edges, probe);
+				g_array_append_val(edges->block_rank,
+						   edges->count);
+			}
+		}
+
+		/* Count a transition for every probe which toggled. */
+		for (; toggled; toggled &= toggled - 1) {
+			edges = g_ptr_array_index(ds->edges, ctz64(toggled));
+			edges->count++;
+		}
+	}
+}
+
+/**
+ * Summarize a range of units, using the largest summary entries which fit
+ * and scanning the units at either end of the range.
+ *
+ * @param ds The datastore. Must have a summary pyramid.
+ * @param start The index of the first unit.
+ * @param end The index of the unit just past the end of the range. The
+ *            range must not be empty.
+ * @param toggled Pointer to a variable which will hold the probes which
+ *                toggled in the range.
+ * @param last Pointer to a variable which will hold the value of the last
+ *             unit in the range.
+ *
+ * @return SR_OK upon success, or SR_ERR if data could not be read back from
+ *         the datastore's backing file.
+ */
+static int summary_range(struct sr_datastore *ds, uint64_t start,
+			 uint64_t end, uint64_t *toggled, uint64_t *last)
+{
+	struct sr_datastore_iter iter;
+	struct ds_summary *entry;
+	GArray *entries;
+	const void *unit;
+	uint64_t pos, size, entry_size, scan_end, run_length, value, prev;
+	gboolean have_prev;
+	guint level;
+	int ret;
+
+	*toggled = 0;
+	prev = 0;
+	have_prev = FALSE;
+	pos = start;
+	while (pos < end) {
+		/* Find the largest entry which starts here and fits. */
+		entry = NULL;
+		entry_size = 0;
+		size = SUMMARY_BUCKET;
+		for (level = 0; level < ds->summary->len; level++) {
+			if (pos % size || size > end - pos)
+				break;
+			entries = g_ptr_array_index(ds->summary, level);
+			if (pos / size >= entries->len)
+				break;
+			entry = &g_array_index(entries, struct ds_summary,
+					       pos / size);
+			entry_size = size;
+			size *= SUMMARY_FANOUT;
+		}
+
+		if (entry) {
+			*toggled |= entry->toggled;
+			prev = entry->last;
+			have_prev = TRUE;
+			pos += entry_size;
+			continue;
+		}
+
+		/*
+		 * Scan up to the next bucket boundary. The toggles at the
+		 * first unit of the range need the unit before it.
+		 */
+		scan_end = MIN(end, (pos / SUMMARY_BUCKET + 1) * SUMMARY_BUCKET);
+		if (!have_prev && pos > 0)
+			pos--;
+		ret = sr_datastore_iter_init(&iter, ds, pos, scan_end - pos);
+		if (ret != SR_OK)
+			return ret;
+		while ((ret = sr_datastore_iter_next_run(&iter, &unit,
+				&run_length)) == SR_OK && run_length > 0) {
+			value = unit_value(unit, ds->ds_unitsize);
+			if (have_prev)
+				*toggled |= value ^ prev;
+			prev = value;
+			have_prev = TRUE;
+		}
+		if (ret != SR_OK)
+			return ret;
+		pos = scan_end;
+	}
+	*last = prev;
+
+	return SR_OK;
+}
+
+/**
+ * Free the datastore's edge index.
+ *
+ * @param ds The datastore. Must have an edge index.
+ */
+static void edges_free(struct sr_datastore *ds)
+{
+	struct ds_edges *edges;
+	guint probe;
+
+	for (probe = 0; probe < ds->edges->len; probe++) {
+		edges = g_ptr_array_index(ds->edges, probe);
+		g_array_free(edges->block_rank, TRUE);
+		g_free(edges);
+	}
+	g_ptr_array_free(ds->edges, TRUE);
+	ds->edges = NULL;
+}
+
+/**
+ * Check the arguments common to the edge index queries, and get the edge
+ * index of a probe.
+ *
+ * @param ds The datastore.
+ * @param probe The probe.
+ * @param func The name of the calling function, for error messages.
+ *
+ * @return The probe's edge index, or NULL upon invalid arguments.
+ */
+static struct ds_edges *edges_get(struct sr_datastore *ds, int probe,
+				  const char *func)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", func);
+		return NULL;
+	}
+
+	if (!ds->edges) {
+		sr_err("ds: %s: datastore has no edge index", func);
+		return NULL;
+	}
+
+	if (probe < 0 || probe >= (int)ds->edges->len) {
+		sr_err("ds: %s: invalid probe %d", func, probe);
+		return NULL;
+	}
+
+	return g_ptr_array_index(ds->edges, probe);
+}
+
+/**
+ * Scan a range of units for the transitions of a probe.
+ *
+ * The probe's bits are gathered into a word, 64 units at a time. XORing the
+ * word with itself shifted by one unit leaves a bit set for every
+ * transition, which are then counted, or located with ctz.
+ *
+ * @param ds The datastore.
+ * @param edges The probe's edge index.
+ * @param start The index of the first unit.
+ * @param end The index of the unit just past the end of the range.
+ * @param nth The number of transitions in the range to skip before the one
+ *            to locate, or G_MAXUINT64 to count them all.
+ * @param count Pointer to a variable which will hold the number of
+ *              transitions in the range, before the located one if any.
+ * @param edge Pointer to a variable which will hold the index of the unit
+ *             with the located transition, or 'end' if there is none.
+ *
+ * @return SR_OK upon success, or SR_ERR if data could not be read back from
+ *         the datastore's backing file.
+ */
+static int edges_scan(struct sr_datastore *ds, struct ds_edges *edges,
+		      uint64_t start, uint64_t end, uint64_t nth,
+		      uint64_t *count, uint64_t *edge)
+{
+	struct sr_datastore_iter iter;
+	const void *span;
+	const uint8_t *unit;
+	uint64_t pos, span_units, word, prev, toggled, n;
+	int byte, shift, bits, ret;
+	gboolean first;
+
+	*count = 0;
+	*edge = end;
+	if (start >= end)
+		return SR_OK;
+
+	/* The unit before the range tells whether its first unit toggled. */
+	pos = start > 0 ? start - 1 : 0;
+	if ((ret = sr_datastore_iter_init(&iter, ds, pos, end - pos)) != SR_OK)
+		return ret;
+
+	byte = edges->probe / 8;
+	shift = edges->probe % 8;
+	unit = NULL;
+	span_units = 0;
+	prev = 0;
+	first = TRUE;
+	while (pos < end) {
+		word = 0;
+		for (bits = 0; bits < 64 && pos + bits < end; bits++) {
+			if (span_units == 0) {
+				ret = sr_datastore_iter_next(&iter, &span,
+							     &span_units);
+				if (ret != SR_OK)
+					return ret;
+				unit = span;
+			}
+			word |= (uint64_t)((unit[byte] >> shift) & 1) << bits;
+			unit += ds->ds_unitsize;
+			span_units--;
+		}
+
+		/* The first unit scanned never counts as a transition. */
+		if (first) {
+			prev = word & 1;
+			first = FALSE;
+		}
+		toggled = word ^ (word << 1 | prev);
+		if (bits < 64)
+			toggled &= (1ULL << bits) - 1;
+		prev = (word >> (bits - 1)) & 1;
+
+		n = popcount64(toggled);
+		if (nth < n) {
+			*count += nth;
+			for (; nth > 0; nth--)
+				toggled &= toggled - 1;
+			*edge = pos + ctz64(toggled);
+			return SR_OK;
+		}
+		nth -= n;
+		*count += n;
+		pos += bits;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Count the transitions before a unit.
+ *
+ * @param ds The datastore.
+ * @param edges The probe's edge index.
+ * @param pos The index of the unit. May be one past the last unit.
+ * @param rank Pointer to a variable which will hold the number of
+ *             transitions at units before 'pos'.
+ *
+ * @return SR_OK upon success, or SR_ERR if data could not be read back from
+ *         the datastore's backing file.
+ */
+static int edges_rank(struct sr_datastore *ds, struct ds_edges *edges,
+		      uint64_t pos, uint64_t *rank)
+{
+	uint64_t block, start, count, edge;
+	int ret;
+
+	block = pos / EDGE_BLOCK;
+	start = block * EDGE_BLOCK;
+	if (block >= edges->block_rank->len) {
+		*rank = edges->count;
+		return SR_OK;
+	}
+
+	/* Scan from whichever end of the block is closer. */
+	if (pos - start > EDGE_BLOCK / 2
+	    && block + 1 < edges->block_rank->len) {
+		ret = edges_scan(ds, edges, pos, start + EDGE_BLOCK,
+				 G_MAXUINT64, &count, &edge);
+		*rank = g_array_index(edges->block_rank, uint64_t, block + 1)
+			- count;
+	} else {
+		ret = edges_scan(ds, edges, start, pos, G_MAXUINT64,
+				 &count, &edge);
+		*rank = g_array_index(edges->block_rank, uint64_t, block)
+			+ count;
+	}
+
+	return ret;
+}
+
+/**
+ * Find the position of a transition.
+ *
+ * @param ds The datastore.
+ * @param edges The probe's edge index.
+ * @param index The number of transitions before it. Must be less than the
+ *              number of transitions in the datastore.
+ * @param edge Pointer to a variable which will hold the index of the unit
+ *             with the transition.
+ *
+ * @return SR_OK upon success, or SR_ERR if data could not be read back from
+ *         the datastore's backing file.
+ */
+static int edges_position(struct sr_datastore *ds, struct ds_edges *edges,
+			  uint64_t index, uint64_t *edge)
+{
+	uint64_t lo, hi, mid, count;
+
+	/* Find the last block with at most 'index' transitions before it. */
+	lo = 0;
+	hi = edges->block_rank->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (g_array_index(edges->block_rank, uint64_t, mid) <= index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	lo--;
+
+	return edges_scan(ds, edges, lo * EDGE_BLOCK,
+			  MIN((lo + 1) * EDGE_BLOCK, ds->num_units),
+			  index - g_array_index(edges->block_rank, uint64_t,
+						lo), &count, edge);
 }
@@ -20,9 +20,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+#if defined(__x86_64__) && defined(__GNUC__) \
+	&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_PEXT 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /**
  * Remove unused probes from samples.
  *
@@ -51,6 +59,10 @@
  * actually allocated for the input data (data_in), as this function does
  * not check that.
  *
+ * This allocates a new output buffer and works out how to compact the
+ * probes on every call. Callers which filter a stream of packets should
+ * use sr_filter_plan_new() and sr_filter_plan_run() instead.
+ *
  * @param in_unitsize The unit size (>= 1) of the input (data_in).
  * @param out_unitsize The unit size (>= 1) the output shall have (data_out).
  *                     The requested unit size must be big enough to hold as
@@ -78,12 +90,11 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out)
 {
-	unsigned int in_offset, out_offset;
-	int num_enabled_probes, out_bit, i;
-	uint64_t sample_in, sample_out;
+	struct sr_filter_plan *plan;
+	int ret;
 
-	if (!probelist) {
-		sr_err("filter: %s: probelist was NULL", __func__);
+	if (!data_out) {
+		sr_err("filter: %s: data_out was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
@@ -92,54 +103,365 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 		return SR_ERR_ARG;
 	}
 
-	if (!data_out) {
-		sr_err("filter: %s: data_out was NULL", __func__);
+	ret = sr_filter_plan_new(in_unitsize, out_unitsize, probelist, &plan);
+	if (ret != SR_OK)
+		return ret;
+
+	/* One extra byte, so that empty input doesn't fail the malloc. */
+	if (!(*data_out = g_try_malloc(length_in / in_unitsize * out_unitsize
+				       + 1))) {
+		sr_err("filter: %s: data_out malloc failed", __func__);
+		sr_filter_plan_destroy(plan);
+		return SR_ERR_MALLOC;
+	}
+
+	ret = sr_filter_plan_run(plan, data_in, length_in, *data_out,
+				 length_out);
+	sr_filter_plan_destroy(plan);
+	if (ret != SR_OK) {
+		g_free(*data_out);
+		*data_out = NULL;
+	}
+
+	return ret;
+}
+
+#ifdef HAVE_PEXT
+/**
+ * Check whether the CPU has a fast PEXT instruction.
+ *
+ * AMD CPUs before Zen 3 (family 19h) implement it in microcode, which
+ * makes it slower than the lookup tables, so it's not used on those.
+ */
+static int pext_usable(void)
+{
+	unsigned int eax, ebx, ecx, edx, family;
+
+	__builtin_cpu_init();
+
+	if (!__builtin_cpu_supports("bmi2"))
+		return 0;
+	if (!__builtin_cpu_is("amd"))
+		return 1;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	family = (eax >> 8) & 0xf;
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+
+	return family >= 0x19;
+}
+#endif
+
+/**
+ * Work out how to remove unused probes from samples.
+ *
+ * The plan can then be applied to any number of packets with
+ * sr_filter_plan_run(), which doesn't allocate any memory. See
+ * sr_filter_probes() for the format of the output.
+ *
+ * The plan uses the fastest method the probelist and the CPU allow for:
+ * plain copying if all probes are used in order, copying of whole bytes,
+ * a shift if the enabled probes are contiguous, the BMI2 PEXT instruction
+ * if they are in ascending order, or else one lookup table per input byte.
+ *
+ * @param in_unitsize The unit size (1-8) of the input.
+ * @param out_unitsize The unit size (1-8) the output shall have. It must be
+ *                     big enough to hold all enabled probes in 'probelist'.
+ * @param probelist Pointer to a list of integers (probe numbers). The probe
+ *                  numbers in this list are 1-based, i.e. the first probe
+ *                  is expected to be numbered 1 (not 0!). The list is
+ *                  terminated by a 0. Must not be NULL.
+ * @param plan Pointer to a variable which will hold the newly created plan.
+ *             The caller must free it with sr_filter_plan_destroy().
+ *             Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_new(int in_unitsize, int out_unitsize,
+			      const int *probelist,
+			      struct sr_filter_plan **plan)
+{
+	struct sr_filter_plan *p;
+	int num_enabled_probes, probe, byte, ascending, contiguous, i, v;
+
+	if (!probelist) {
+		sr_err("filter: %s: probelist was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (!length_out) {
-		sr_err("filter: %s: length_out was NULL", __func__);
+	if (!plan) {
+		sr_err("filter: %s: plan was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	num_enabled_probes = 0;
-	for (i = 0; probelist[i]; i++)
-		num_enabled_probes++;
+	if (in_unitsize < 1 || in_unitsize > 8
+	    || out_unitsize < 1 || out_unitsize > 8) {
+		sr_err("filter: %s: unit sizes %d and %d must be 1-8",
+		       __func__, in_unitsize, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	ascending = contiguous = TRUE;
+	for (i = 0; probelist[i]; i++) {
+		if (probelist[i] < 1 || probelist[i] > in_unitsize * 8) {
+			sr_err("filter: %s: invalid probe %d for unit size %d",
+			       __func__, probelist[i], in_unitsize);
+			return SR_ERR_ARG;
+		}
+		if (i > 0 && probelist[i] <= probelist[i - 1])
+			ascending = FALSE;
+		if (i > 0 && probelist[i] != probelist[i - 1] + 1)
+			contiguous = FALSE;
+	}
+	num_enabled_probes = i;
 
 	/* Are there more probes than the target unit size supports? */
 	if (num_enabled_probes > out_unitsize * 8) {
 		sr_err("filter: %s: too many probes (%d) for the target unit "
-		       "size (%d)", num_enabled_probes, out_unitsize, __func__);
+		       "size (%d)", __func__, num_enabled_probes, out_unitsize);
 		return SR_ERR_ARG;
 	}
 
-	if (!(*data_out = g_try_malloc(length_in))) {
-		sr_err("filter: %s: data_out malloc failed", __func__);
+	if (!(p = g_try_malloc0(sizeof(struct sr_filter_plan)))) {
+		sr_err("filter: %s: plan malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	if (num_enabled_probes == in_unitsize * 8) {
-		/* All probes are used -- no need to compress anything. */
-		memcpy(*data_out, data_in, length_in);
-		*length_out = length_in;
-		return SR_OK;
+	p->in_unitsize = in_unitsize;
+	p->out_unitsize = out_unitsize;
+	for (i = 0; i < num_enabled_probes; i++)
+		p->mask |= (uint64_t)1 << (probelist[i] - 1);
+	p->shift = num_enabled_probes ? probelist[0] - 1 : 0;
+
+	if (num_enabled_probes > 0 && contiguous) {
+		if (p->shift == 0 && num_enabled_probes == in_unitsize * 8
+		    && out_unitsize == in_unitsize)
+			p->method = SR_FILTER_COPY;
+		else if (p->shift % 8 == 0 && num_enabled_probes % 8 == 0
+			 && out_unitsize == num_enabled_probes / 8)
+			p->method = SR_FILTER_BYTES;
+		else
+			p->method = SR_FILTER_SHIFT;
+#ifdef HAVE_PEXT
+	} else if (ascending && pext_usable()) {
+		p->method = SR_FILTER_PEXT;
+#endif
+	} else {
+		p->method = SR_FILTER_LUT;
+		for (byte = 0; byte < in_unitsize; byte++) {
+			if (!((p->mask >> (byte * 8)) & 0xff))
+				continue;
+			p->lut_bytes[p->num_lut_bytes++] = byte;
+		}
+		for (i = 0; i < num_enabled_probes; i++) {
+			probe = probelist[i] - 1;
+			byte = probe / 8;
+			for (v = 0; v < 256; v++) {
+				if (v & (1 << (probe % 8)))
+					p->lut[byte][v] |= (uint64_t)1 << i;
+			}
+		}
+	}
+
+	sr_dbg("filter: %s: %d probes, unit size %d -> %d, method %d",
+	       __func__, num_enabled_probes, in_unitsize, out_unitsize,
+	       p->method);
+	*plan = p;
+
+	return SR_OK;
+}
+
+/**
+ * Free a plan created by sr_filter_plan_new().
+ *
+ * @param plan The plan. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_destroy(struct sr_filter_plan *plan)
+{
+	if (!plan) {
+		sr_err("filter: %s: plan was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(plan);
+
+	return SR_OK;
+}
+
+/* Read a little-endian unit of up to 8 bytes. */
+static inline uint64_t unit_load(const uint8_t *p, int unitsize)
+{
+	uint64_t v;
+	uint32_t v32;
+	uint16_t v16;
+	int i;
+
+	switch (unitsize) {
+	case 1:
+		return p[0];
+	case 2:
+		memcpy(&v16, p, 2);
+		return GUINT16_FROM_LE(v16);
+	case 4:
+		memcpy(&v32, p, 4);
+		return GUINT32_FROM_LE(v32);
+	case 8:
+		memcpy(&v, p, 8);
+		return GUINT64_FROM_LE(v);
+	default:
+		v = 0;
+		for (i = 0; i < unitsize; i++)
+			v |= (uint64_t)p[i] << (i * 8);
+		return v;
+	}
+}
+
+/* Write a little-endian unit of up to 8 bytes. */
+static inline void unit_store(uint8_t *p, uint64_t v, int unitsize)
+{
+	uint32_t v32;
+	uint16_t v16;
+	int i;
+
+	switch (unitsize) {
+	case 1:
+		p[0] = v;
+		break;
+	case 2:
+		v16 = GUINT16_TO_LE(v);
+		memcpy(p, &v16, 2);
+		break;
+	case 4:
+		v32 = GUINT32_TO_LE(v);
+		memcpy(p, &v32, 4);
+		break;
+	case 8:
+		v = GUINT64_TO_LE(v);
+		memcpy(p, &v, 8);
+		break;
+	default:
+		for (i = 0; i < unitsize; i++)
+			p[i] = v >> (i * 8);
+		break;
+	}
+}
+
+#ifdef HAVE_PEXT
+__attribute__((target("bmi2")))
+static void filter_pext(const struct sr_filter_plan *plan,
+			const uint8_t *in, uint8_t *out, uint64_t num_units)
+{
+	uint64_t i;
+
+	for (i = 0; i < num_units; i++) {
+		unit_store(out, _pext_u64(unit_load(in, plan->in_unitsize),
+					  plan->mask), plan->out_unitsize);
+		in += plan->in_unitsize;
+		out += plan->out_unitsize;
 	}
+}
+#endif
+
+/**
+ * Remove unused probes from samples, according to a plan.
+ *
+ * This is the same as sr_filter_probes(), except that the output is written
+ * into a buffer provided by the caller, and no memory is allocated.
+ *
+ * @param plan The plan, as created by sr_filter_plan_new(). Must not be NULL.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length, in number of bytes. A trailing
+ *                  partial unit is ignored.
+ * @param data_out Pointer to the output data buffer. It must be large enough
+ *                 to hold length_in / in_unitsize * out_unitsize bytes, and
+ *                 must not overlap the input, unless it is the same buffer
+ *                 and out_unitsize <= in_unitsize. Must not be NULL.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_run(const struct sr_filter_plan *plan,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out)
+{
+	const uint8_t *in;
+	uint8_t *out;
+	uint64_t num_units, sample_out, i;
+	int in_unitsize, out_unitsize, j;
 
-	/* If we reached this point, not all probes are used, so "compress". */
-	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
-		memcpy(&sample_in, data_in + in_offset, in_unitsize);
-		sample_out = out_bit = 0;
-		for (i = 0; probelist[i]; i++) {
-			if (sample_in & (1 << (probelist[i] - 1)))
-				sample_out |= (1 << out_bit);
-			out_bit++;
+	if (!plan) {
+		sr_err("filter: %s: plan was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data_in || !data_out) {
+		sr_err("filter: %s: data_in or data_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!length_out) {
+		sr_err("filter: %s: length_out was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	in_unitsize = plan->in_unitsize;
+	out_unitsize = plan->out_unitsize;
+	num_units = length_in / in_unitsize;
+	*length_out = num_units * out_unitsize;
+	in = data_in;
+	out = data_out;
+
+	switch (plan->method) {
+	case SR_FILTER_COPY:
+		if (data_out != data_in)
+			memmove(data_out, data_in, *length_out);
+		break;
+	case SR_FILTER_BYTES:
+		in += plan->shift / 8;
+		if (out_unitsize == 1) {
+			for (i = 0; i < num_units; i++)
+				out[i] = in[i * in_unitsize];
+		} else {
+			for (i = 0; i < num_units; i++) {
+				memmove(out, in, out_unitsize);
+				in += in_unitsize;
+				out += out_unitsize;
+			}
+		}
+		break;
+	case SR_FILTER_SHIFT:
+		for (i = 0; i < num_units; i++) {
+			sample_out = (unit_load(in, in_unitsize) & plan->mask)
+				     >> plan->shift;
+			unit_store(out, sample_out, out_unitsize);
+			in += in_unitsize;
+			out += out_unitsize;
+		}
+		break;
+#ifdef HAVE_PEXT
+	case SR_FILTER_PEXT:
+		filter_pext(plan, in, out, num_units);
+		break;
+#endif
+	default:
+		for (i = 0; i < num_units; i++) {
+			sample_out = 0;
+			for (j = 0; j < plan->num_lut_bytes; j++)
+				sample_out |= plan->lut[plan->lut_bytes[j]]
+						[in[plan->lut_bytes[j]]];
+			unit_store(out, sample_out, out_unitsize);
+			in += in_unitsize;
+			out += out_unitsize;
 		}
-		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
-		in_offset += in_unitsize;
-		out_offset += out_unitsize;
+		break;
 	}
-	*length_out = out_offset;
 
 	return SR_OK;
 }
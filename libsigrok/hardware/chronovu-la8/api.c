@@ -66,7 +66,7 @@ static int hw_init(const char *devinfo)
 	ctx->trigger_pattern = 0x00; /* Value irrelevant, see trigger_mask. */
 	ctx->trigger_mask = 0x00; /* All probes are "don't care". */
 	ctx->trigger_timeout = 10; /* Default to 10s trigger timeout. */
-	ctx->trigger_found = 0;
+	ctx->trigger = NULL;
 	ctx->done = 0;
 	ctx->block_counter = 0;
 	ctx->divcount = 0; /* 10ns sample period == 100MHz samplerate */
@@ -228,6 +228,7 @@ static int hw_cleanup(void)
 {
 	GSList *l;
 	struct sr_dev_inst *sdi;
+	struct context *ctx;
 	int ret = SR_OK;
 
 	/* Properly close all devices. */
@@ -238,6 +239,8 @@ static int hw_cleanup(void)
 			ret = SR_ERR_BUG;
 			continue;
 		}
+		if ((ctx = sdi->priv) && ctx->trigger)
+			sr_trigger_destroy(ctx->trigger);
 		sr_dev_inst_free(sdi); /* Returns void. */
 	}
 	g_slist_free(dev_insts); /* Returns void. */
@@ -505,7 +508,8 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->done = (ctx->divcount + 1) * 0.08388608 + time(NULL)
 			+ ctx->trigger_timeout;
 	ctx->block_counter = 0;
-	ctx->trigger_found = 0;
+	if (ctx->trigger)
+		sr_trigger_reset(ctx->trigger);
 
 	/* Hook up a dummy handler to receive data from the LA8. */
 	sr_source_add(-1, G_IO_IN, 0, receive_data, sdi);
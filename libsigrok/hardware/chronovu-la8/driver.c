@@ -375,6 +375,13 @@ SR_PRIV int configure_probes(struct context *ctx, const GSList *probes)
 	sr_dbg("la8: trigger_mask = 0x%x, trigger_pattern = 0x%x",
 	       ctx->trigger_mask, ctx->trigger_pattern);
 
+	/* The same conditions, to find the trigger point in the samples. */
+	if (ctx->trigger)
+		sr_trigger_destroy(ctx->trigger);
+	ctx->trigger = NULL;
+	if (sr_trigger_new((GSList *)probes, 0, NULL, &ctx->trigger) != SR_OK)
+		return SR_ERR;
+
 	return SR_OK;
 }
 
@@ -454,37 +461,26 @@ SR_PRIV int la8_read_block(struct context *ctx)
 
 SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 {
-	int i;
-	uint8_t sample, expected_sample;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+	uint64_t offset;
 	int trigger_point; /* Relative trigger point (in this block). */
 
 	/* Note: No sanity checks on ctx/block, caller is responsible. */
 
-	/* Check if we can find the trigger condition in this block. */
+	/*
+	 * Check if we can find the trigger condition in this block. Don't
+	 * continue if the trigger was found previously, or if triggers are
+	 * "don't care", i.e. if no trigger conditions were specified by the
+	 * user (the trigger fired right away then). In that case we don't
+	 * want to send an SR_DF_TRIGGER packet at all.
+	 */
 	trigger_point = -1;
-	expected_sample = ctx->trigger_pattern & ctx->trigger_mask;
-	for (i = 0; i < BS; i++) {
-		/* Don't continue if the trigger was found previously. */
-		if (ctx->trigger_found)
-			break;
-
-		/*
-		 * Also, don't continue if triggers are "don't care", i.e. if
-		 * no trigger conditions were specified by the user. In that
-		 * case we don't want to send an SR_DF_TRIGGER packet at all.
-		 */
-		if (ctx->trigger_mask == 0x00)
-			break;
-
-		sample = *(ctx->final_buf + (block * BS) + i);
-
-		if ((sample & ctx->trigger_mask) == expected_sample) {
-			trigger_point = i;
-			ctx->trigger_found = 1;
-			break;
-		}
+	if (ctx->trigger && !ctx->trigger->fired) {
+		sr_trigger_scan(ctx->trigger, ctx->final_buf + (block * BS),
+				BS, 1, &offset);
+		if (ctx->trigger->fired)
+			trigger_point = offset;
 	}
 
 	/* If no trigger was found, send one SR_DF_LOGIC packet. */
@@ -86,8 +86,11 @@ struct context {
 	/** Time (in seconds) before the trigger times out. */
 	uint64_t trigger_timeout;
 
-	/** Tells us whether an SR_DF_TRIGGER packet was already sent. */
-	int trigger_found;
+	/**
+	 * Finds the trigger point in the samples read back from the device.
+	 * NULL until the probes are configured.
+	 */
+	struct sr_trigger *trigger;
 
 	/** TODO */
 	time_t done;
@@ -89,6 +89,7 @@ static const int hwcaps[] = {
 	/* These are really implemented in the driver, not the hardware. */
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_CONTINUOUS,
+	SR_HWCAP_CAPTURE_RATIO,
 	0,
 };
 
@@ -320,15 +321,7 @@ static int configure_probes(struct context *ctx, GSList *probes)
 {
 	struct sr_probe *probe;
 	GSList *l;
-	int probe_bit, stage, i;
-	char *tc;
 
-	for (i = 0; i < NUM_TRIGGER_STAGES; i++) {
-		ctx->trigger_mask[i] = 0;
-		ctx->trigger_value[i] = 0;
-	}
-
-	stage = -1;
 	for (l = probes; l; l = l->next) {
 		probe = (struct sr_probe *)l->data;
 		if (probe->enabled == FALSE)
@@ -336,30 +329,15 @@ static int configure_probes(struct context *ctx, GSList *probes)
 
 		if (probe->index > 8)
 			ctx->sample_wide = TRUE;
-
-		probe_bit = 1 << (probe->index - 1);
-		if (!(probe->trigger))
-			continue;
-
-		stage = 0;
-		for (tc = probe->trigger; *tc; tc++) {
-			ctx->trigger_mask[stage] |= probe_bit;
-			if (*tc == '1')
-				ctx->trigger_value[stage] |= probe_bit;
-			stage++;
-			if (stage > NUM_TRIGGER_STAGES)
-				return SR_ERR;
-		}
 	}
 
-	if (stage == -1)
-		/*
-		 * We didn't configure any triggers, make sure acquisition
-		 * doesn't wait for any.
-		 */
-		ctx->trigger_stage = TRIGGER_FIRED;
-	else
-		ctx->trigger_stage = 0;
+	if (ctx->trigger)
+		sr_trigger_destroy(ctx->trigger);
+	ctx->trigger = NULL;
+
+	/* The pre-trigger size is set once the sample limit is known. */
+	if (sr_trigger_new(probes, 0, sr_session_send, &ctx->trigger) != SR_OK)
+		return SR_ERR;
 
 	return SR_OK;
 }
@@ -373,8 +351,6 @@ static struct context *fx2lafw_dev_new(void)
 		return NULL;
 	}
 
-	ctx->trigger_stage = TRIGGER_FIRED;
-
 	return ctx;
 }
 
@@ -568,6 +544,8 @@ static int hw_cleanup(void)
 			continue;
 		}
 		close_dev(sdi);
+		if (ctx->trigger)
+			sr_trigger_destroy(ctx->trigger);
 		sdi = l->data;
 		sr_dev_inst_free(sdi);
 	}
@@ -645,6 +623,13 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	} else if (hwcap == SR_HWCAP_LIMIT_SAMPLES) {
 		ctx->limit_samples = *(const uint64_t *)value;
 		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_CAPTURE_RATIO) {
+		ctx->capture_ratio = *(const uint64_t *)value;
+		if (ctx->capture_ratio > 100) {
+			ctx->capture_ratio = 0;
+			ret = SR_ERR;
+		} else
+			ret = SR_OK;
 	} else {
 		ret = SR_ERR;
 	}
@@ -686,7 +671,7 @@ static void finish_acquisition(struct context *ctx)
 
 	/* Terminate session */
 	packet.type = SR_DF_END;
-	sr_session_send(ctx->session_dev_id, &packet);
+	sr_trigger_send(ctx->trigger, ctx->session_dev_id, &packet);
 
 	/* Remove fds from polling */
 	const struct libusb_pollfd **const lupfd =
@@ -697,6 +682,7 @@ static void finish_acquisition(struct context *ctx)
 
 	ctx->num_transfers = 0;
 	g_free(ctx->transfers);
+	g_free(ctx->packets);
 }
 
 static void free_transfer(struct libusb_transfer *transfer)
@@ -704,13 +690,16 @@ static void free_transfer(struct libusb_transfer *transfer)
 	struct context *ctx = transfer->user_data;
 	unsigned int i;
 
-	g_free(transfer->buffer);
 	transfer->buffer = NULL;
 	libusb_free_transfer(transfer);
 
 	for (i = 0; i < ctx->num_transfers; i++) {
 		if (ctx->transfers[i] == transfer) {
 			ctx->transfers[i] = NULL;
+			/* The buffer is freed once the frontend is done too. */
+			if (ctx->packets[i])
+				sr_datafeed_packet_release(ctx->packets[i]);
+			ctx->packets[i] = NULL;
 			break;
 		}
 	}
@@ -731,13 +720,25 @@ static void resubmit_transfer(struct libusb_transfer *transfer)
 	}
 }
 
+static int transfer_index(struct context *ctx,
+			  struct libusb_transfer *transfer)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->num_transfers; i++) {
+		if (ctx->transfers[i] == transfer)
+			return i;
+	}
+
+	return -1;
+}
+
 static void receive_transfer(struct libusb_transfer *transfer)
 {
 	gboolean packet_has_error = FALSE;
-	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
+	struct sr_datafeed_logic *transfer_logic;
 	struct context *ctx = transfer->user_data;
-	int trigger_offset, i;
+	int i;
 
 	/*
 	 * If acquisition has already ended, just free any queued up
@@ -751,10 +752,7 @@ static void receive_transfer(struct libusb_transfer *transfer)
 	sr_info("fx2lafw: receive_transfer(): status %d received %d bytes.",
 		transfer->status, transfer->actual_length);
 
-	/* Save incoming transfer before reusing the transfer struct. */
-	uint8_t *const cur_buf = transfer->buffer;
 	const int sample_width = ctx->sample_wide ? 2 : 1;
-	const int cur_sample_count = transfer->actual_length / sample_width;
 
 	switch (transfer->status) {
 	case LIBUSB_TRANSFER_NO_DEVICE:
@@ -786,86 +784,33 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		ctx->empty_transfer_count = 0;
 	}
 
-	trigger_offset = 0;
-	if (ctx->trigger_stage >= 0) {
-		for (i = 0; i < cur_sample_count; i++) {
-
-			const uint16_t cur_sample = ctx->sample_wide ?
-				*((const uint16_t*)cur_buf + i) :
-				*((const uint8_t*)cur_buf + i);
-
-			if ((cur_sample & ctx->trigger_mask[ctx->trigger_stage]) ==
-				ctx->trigger_value[ctx->trigger_stage]) {
-				/* Match on this trigger stage. */
-				ctx->trigger_buffer[ctx->trigger_stage] = cur_sample;
-				ctx->trigger_stage++;
-
-				if (ctx->trigger_stage == NUM_TRIGGER_STAGES ||
-					ctx->trigger_mask[ctx->trigger_stage] == 0) {
-					/* Match on all trigger stages, we're done. */
-					trigger_offset = i + 1;
-
-					/*
-					 * TODO: Send pre-trigger buffer to session bus.
-					 * Tell the frontend we hit the trigger here.
-					 */
-					packet.type = SR_DF_TRIGGER;
-					packet.payload = NULL;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					/*
-					 * Send the samples that triggered it, since we're
-					 * skipping past them.
-					 */
-					packet.type = SR_DF_LOGIC;
-					packet.payload = &logic;
-					logic.unitsize = sizeof(*ctx->trigger_buffer);
-					logic.length = ctx->trigger_stage * logic.unitsize;
-					logic.data = ctx->trigger_buffer;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					ctx->trigger_stage = TRIGGER_FIRED;
-					break;
-				}
-			} else if (ctx->trigger_stage > 0) {
-				/*
-				 * We had a match before, but not in the next sample. However, we may
-				 * have a match on this stage in the next bit -- trigger on 0001 will
-				 * fail on seeing 00001, so we need to go back to stage 0 -- but at
-				 * the next sample from the one that matched originally, which the
-				 * counter increment at the end of the loop takes care of.
-				 */
-				i -= ctx->trigger_stage;
-				if (i < -1)
-					i = -1; /* Oops, went back past this buffer. */
-				/* Reset trigger stage. */
-				ctx->trigger_stage = 0;
-			}
-		}
+	/*
+	 * Send the incoming transfer through the trigger. Until it fires,
+	 * the trigger keeps the samples for the pre-trigger buffer. After
+	 * that, the transfer buffer, which belongs to a reference-counted
+	 * packet, is passed on to the frontend without copying.
+	 */
+	i = transfer_index(ctx, transfer);
+	transfer_logic = ctx->packets[i]->payload;
+	transfer_logic->length = transfer->actual_length;
+	transfer_logic->unitsize = sample_width;
+	sr_trigger_send(ctx->trigger, ctx->session_dev_id, ctx->packets[i]);
+
+	/* Get a fresh buffer if the frontend kept this one. */
+	if (sr_datafeed_packet_reuse(&ctx->packets[i]) != SR_OK) {
+		abort_acquisition(ctx);
+		free_transfer(transfer);
+		return;
 	}
+	transfer_logic = ctx->packets[i]->payload;
+	transfer->buffer = transfer_logic->data;
 
-	if (ctx->trigger_stage == TRIGGER_FIRED) {
-		/* Send the incoming transfer to the session bus. */
-		const int trigger_offset_bytes = trigger_offset * sample_width;
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = transfer->actual_length - trigger_offset_bytes;
-		logic.unitsize = sample_width;
-		logic.data = cur_buf + trigger_offset_bytes;
-		sr_session_send(ctx->session_dev_id, &packet);
-
-		ctx->num_samples += cur_sample_count;
-		if (ctx->limit_samples &&
-			(unsigned int)ctx->num_samples > ctx->limit_samples) {
-			abort_acquisition(ctx);
-			free_transfer(transfer);
-			return;
-		}
-	} else {
-		/*
-		 * TODO: Buffer pre-trigger data in capture
-		 * ratio-sized buffer.
-		 */
+	/* The pre-trigger samples count towards the limit too. */
+	if (ctx->limit_samples
+	    && ctx->trigger->num_sent >= ctx->limit_samples) {
+		abort_acquisition(ctx);
+		free_transfer(transfer);
+		return;
 	}
 
 	resubmit_transfer(transfer);
@@ -918,9 +863,9 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	struct context *ctx;
 	struct libusb_transfer *transfer;
 	const struct libusb_pollfd **lupfd;
+	struct sr_datafeed_logic *logic;
 	unsigned int i;
 	int ret;
-	unsigned char *buf;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
 		return SR_ERR;
@@ -933,6 +878,13 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->num_samples = 0;
 	ctx->empty_transfer_count = 0;
 
+	/* No probes configured: no trigger conditions either. */
+	if (!ctx->trigger && sr_trigger_new(NULL, 0, sr_session_send,
+					    &ctx->trigger) != SR_OK)
+		return SR_ERR;
+	sr_trigger_pre_trigger_set(ctx->trigger,
+			ctx->limit_samples * ctx->capture_ratio / 100);
+
 	const unsigned int timeout = get_timeout(ctx);
 	const unsigned int num_transfers = get_number_of_transfers(ctx);
 	const size_t size = get_buffer_size(ctx);
@@ -941,20 +893,30 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	if (!ctx->transfers)
 		return SR_ERR;
 
+	ctx->packets = g_try_malloc0(sizeof(*ctx->packets) * num_transfers);
+	if (!ctx->packets) {
+		g_free(ctx->transfers);
+		ctx->transfers = NULL;
+		return SR_ERR;
+	}
+
 	ctx->num_transfers = num_transfers;
 
 	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(size))) {
+		if (sr_datafeed_packet_new(SR_DF_LOGIC, size,
+					   &ctx->packets[i]) != SR_OK) {
 			sr_err("fx2lafw: %s: buf malloc failed.", __func__);
 			return SR_ERR_MALLOC;
 		}
+		logic = ctx->packets[i]->payload;
 		transfer = libusb_alloc_transfer(0);
 		libusb_fill_bulk_transfer(transfer, ctx->usb->devhdl,
-				2 | LIBUSB_ENDPOINT_IN, buf, size,
+				2 | LIBUSB_ENDPOINT_IN, logic->data, size,
 				receive_transfer, ctx, timeout);
 		if (libusb_submit_transfer(transfer) != 0) {
 			libusb_free_transfer(transfer);
-			g_free(buf);
+			sr_datafeed_packet_release(ctx->packets[i]);
+			ctx->packets[i] = NULL;
 			abort_acquisition(ctx);
 			return SR_ERR;
 		}
@@ -972,14 +934,14 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	packet.payload = &header;
 	header.feed_version = 1;
 	gettimeofday(&header.starttime, NULL);
-	sr_session_send(cb_data, &packet);
+	sr_trigger_send(ctx->trigger, cb_data, &packet);
 
 	/* Send metadata about the SR_DF_LOGIC packets to come. */
 	packet.type = SR_DF_META_LOGIC;
 	packet.payload = &meta;
 	meta.samplerate = ctx->cur_samplerate;
 	meta.num_probes = ctx->sample_wide ? 16 : 8;
-	sr_session_send(cb_data, &packet);
+	sr_trigger_send(ctx->trigger, cb_data, &packet);
 
 	if ((ret = command_start_acquisition (ctx->usb->devhdl,
 		ctx->cur_samplerate, ctx->sample_wide)) != SR_OK) {
@@ -25,8 +25,7 @@
 
 #define USB_INTERFACE		0
 #define USB_CONFIGURATION	1
-#define NUM_TRIGGER_STAGES	4
-#define TRIGGER_TYPES		"01"
+#define TRIGGER_TYPES		"01rfc"
 
 #define MAX_RENUM_DELAY_MS	3000
 #define NUM_SIMUL_TRANSFERS	32
@@ -40,9 +39,6 @@
 /* 6 delay states of up to 256 clock ticks */
 #define MAX_SAMPLE_DELAY	(6 * 256)
 
-/* Software trigger implementation: positive values indicate trigger stage. */
-#define TRIGGER_FIRED          -1
-
 #define DEV_CAPS_16BIT_POS	0
 
 #define DEV_CAPS_16BIT		(1 << DEV_CAPS_16BIT_POS)
@@ -74,13 +70,12 @@ struct context {
 	/* Device/capture settings */
 	uint64_t cur_samplerate;
 	uint64_t limit_samples;
+	uint64_t capture_ratio;
 
 	gboolean sample_wide;
 
-	uint16_t trigger_mask[NUM_TRIGGER_STAGES];
-	uint16_t trigger_value[NUM_TRIGGER_STAGES];
-	int trigger_stage;
-	uint16_t trigger_buffer[NUM_TRIGGER_STAGES];
+	/* The trigger is matched in software. */
+	struct sr_trigger *trigger;
 
 	int num_samples;
 	int submitted_transfers;
@@ -92,6 +87,8 @@ struct context {
 
 	unsigned int num_transfers;
 	struct libusb_transfer **transfers;
+	/* The packets whose data buffers the transfers fill, by transfer. */
+	struct sr_datafeed_packet **packets;
 };
 
 #endif
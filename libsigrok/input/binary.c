@@ -18,19 +18,26 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
-#define CHUNKSIZE             (512 * 1024)
+/* Default size of the SR_DF_LOGIC packets sent, see "packetsize". */
+#define DEFAULT_PACKETSIZE    (4 * 1024 * 1024)
 #define DEFAULT_NUM_PROBES    8
 
 struct context {
 	uint64_t samplerate;
+	uint64_t packetsize;
 };
 
 static int format_match(const char *filename)
@@ -56,6 +63,7 @@ static int init(struct sr_input *in)
 
 	num_probes = DEFAULT_NUM_PROBES;
 	ctx->samplerate = 0;
+	ctx->packetsize = DEFAULT_PACKETSIZE;
 
 	if(in->param) {
 		param = g_hash_table_lookup(in->param, "numprobes");
@@ -70,6 +78,16 @@ static int init(struct sr_input *in)
 			if (sr_parse_sizestring(param, &ctx->samplerate) != SR_OK)
 				return SR_ERR;
 		}
+
+		param = g_hash_table_lookup(in->param, "packetsize");
+		if (param) {
+			if (sr_parse_sizestring(param, &ctx->packetsize) != SR_OK
+			    || ctx->packetsize < 1 || ctx->packetsize > G_MAXINT) {
+				sr_err("binary in: %s: invalid packetsize '%s'",
+				       __func__, param);
+				return SR_ERR;
+			}
+		}
 	}
 
 	/* Create a virtual device. */
@@ -85,15 +103,131 @@ static int init(struct sr_input *in)
 	return SR_OK;
 }
 
+/**
+ * Send a regular file straight from a shared mapping of it: each packet
+ * is a page-aligned window of the file, without copying it.
+ *
+ * @return SR_OK upon success, SR_ERR if the file can't be mapped, in which
+ *         case nothing was sent.
+ */
+static int load_mmap(struct sr_input *in, int fd, uint64_t size,
+		     int unitsize)
+{
+#ifndef _WIN32
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct context *ctx;
+	uint8_t *map;
+	uint64_t window, offset, len;
+	long pagesize;
+
+	ctx = in->internal;
+
+	if (size > G_MAXSIZE)
+		return SR_ERR;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		sr_dbg("binary in: %s: mmap failed, reading instead",
+		       __func__);
+		return SR_ERR;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	/* Windows start on a page, and on a sample. */
+	if ((pagesize = sysconf(_SC_PAGESIZE)) < 1)
+		pagesize = 4096;
+	window = pagesize * unitsize;
+	window = (ctx->packetsize + window - 1) / window * window;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = unitsize;
+	for (offset = 0; offset < size; offset += len) {
+		len = MIN(window, size - offset);
+		/* Have the next window read in while this one is sent. */
+		if (offset + len < size)
+			madvise(map + offset + len, MIN(window,
+				size - offset - len), MADV_WILLNEED);
+		logic.length = len;
+		logic.data = map + offset;
+		sr_session_send(in->vdev, &packet);
+		/* Frontends keep copies, see sr_datafeed_packet_acquire(). */
+		madvise(map + offset, len, MADV_DONTNEED);
+	}
+	munmap(map, size);
+
+	return SR_OK;
+#else
+	(void)in;
+	(void)fd;
+	(void)size;
+	(void)unitsize;
+
+	return SR_ERR;
+#endif
+}
+
+/**
+ * Read the file in packets of the configured size, e.g. from a pipe.
+ * The packets are filled completely, so they always hold whole samples.
+ */
+static int load_read(struct sr_input *in, int fd, int unitsize)
+{
+	struct sr_datafeed_packet *data_packet;
+	struct sr_datafeed_logic *logic;
+	struct context *ctx;
+	uint64_t packetsize;
+	ssize_t ret;
+	size_t size;
+
+	ctx = in->internal;
+
+	packetsize = MAX(ctx->packetsize / unitsize, 1) * unitsize;
+
+	/* The chunks are read straight into a reference-counted packet. */
+	if (sr_datafeed_packet_new(SR_DF_LOGIC, packetsize,
+				   &data_packet) != SR_OK)
+		return SR_ERR_MALLOC;
+
+	/* chop up the input file into chunks and feed it into the session bus */
+	ret = 1;
+	while (ret > 0) {
+		if (sr_datafeed_packet_reuse(&data_packet) != SR_OK)
+			return SR_ERR_MALLOC;
+		logic = data_packet->payload;
+		for (size = 0; size < packetsize; size += ret) {
+			ret = read(fd, (uint8_t *)logic->data + size,
+				   packetsize - size);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+			} else if (ret < 0) {
+				sr_err("binary in: %s: read failed: %s",
+				       __func__, strerror(errno));
+				break;
+			} else if (ret == 0) {
+				break;
+			}
+		}
+		/* Whatever was read before an error is sent as well. */
+		if (size == 0)
+			break;
+		logic->length = size;
+		logic->unitsize = unitsize;
+		sr_session_send(in->vdev, data_packet);
+	}
+	sr_datafeed_packet_release(data_packet);
+
+	return ret < 0 ? SR_ERR : SR_OK;
+}
+
 static int loadfile(struct sr_input *in, const char *filename)
 {
 	struct sr_datafeed_header header;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_meta_logic meta;
-	struct sr_datafeed_logic logic;
-	unsigned char buffer[CHUNKSIZE];
-	int fd, size, num_probes;
+	struct stat st;
 	struct context *ctx;
+	int fd, num_probes, unitsize, ret;
 
 	ctx = in->internal;
 
@@ -101,6 +235,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 		return SR_ERR;
 
 	num_probes = g_slist_length(in->vdev->probes);
+	unitsize = (num_probes + 7) / 8;
 
 	/* send header */
 	header.feed_version = 1;
@@ -116,25 +251,23 @@ static int loadfile(struct sr_input *in, const char *filename)
 	meta.num_probes = num_probes;
 	sr_session_send(in->vdev, &packet);
 
-	/* chop up the input file into chunks and feed it into the session bus */
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
-	logic.unitsize = (num_probes + 7) / 8;
-	logic.data = buffer;
-	while ((size = read(fd, buffer, CHUNKSIZE)) > 0) {
-		logic.length = size;
-		sr_session_send(in->vdev, &packet);
-	}
+	/* Pipes, stdin and the like can only be read. */
+	ret = SR_ERR;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		ret = load_mmap(in, fd, st.st_size, unitsize);
+	if (ret != SR_OK)
+		ret = load_read(in, fd, unitsize);
 	close(fd);
 
 	/* end of stream */
 	packet.type = SR_DF_END;
+	packet.payload = NULL;
 	sr_session_send(in->vdev, &packet);
 
 	g_free(ctx);
 	in->internal = NULL;
 
-	return SR_OK;
+	return ret;
 }
 
 SR_PRIV struct sr_input_format input_binary = {
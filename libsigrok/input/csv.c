@@ -0,0 +1,717 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * The file is cut into blocks of whole lines of about this size, which are
+ * parsed in parallel.
+ */
+#define BLOCKSIZE             (4 * 1024 * 1024)
+#define DEFAULT_NUM_PROBES    8
+
+/*
+ * Options:
+ *  - numprobes: The number of logic columns, one bit each, which come
+ *    first. As written by the CSV output module, the first one is the
+ *    highest probe.
+ *  - analog: The number of analog (voltage) columns, with probes named
+ *    "A0", "A1", ... Files have either logic or analog columns, so
+ *    numprobes defaults to 0 with this.
+ *  - samplerate: Otherwise taken from a "; Samplerate:" comment.
+ *  - separator: The column separator, ',' by default.
+ *  - threads: The number of threads parsing blocks, by default as many
+ *    as there are CPUs.
+ *
+ * Lines starting with ';' or '#' are comments, lines not starting with a
+ * number (e.g. column titles) are skipped. Files written by the CSV output
+ * module are recognized, other files need the format given explicitly.
+ */
+
+/* A block of lines, and the packets parsed from it. */
+struct csv_job {
+	char *text;
+	size_t len;
+	struct sr_datafeed_packet *logic;
+	struct sr_datafeed_packet *analog;
+	int ret;
+	gboolean done;
+};
+
+struct context {
+	uint64_t samplerate;
+	int num_probes;
+	int num_analog;
+	int unitsize;
+	char separator;
+	struct sr_dev *vdev;
+
+	/* The parser threads, if there are more than one. */
+	int num_threads;
+	GThread **threads;
+	GMutex *mutex;
+	GCond *job_cond;
+	GCond *done_cond;
+	/* Jobs not picked up by a thread yet. */
+	GQueue *pending;
+	/* All jobs not sent yet, in file order. */
+	GQueue *inflight;
+	gboolean quit;
+	gboolean failed;
+};
+
+static const double powers_of_10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int format_match(const char *filename)
+{
+	char buf[16];
+	int fd, len;
+
+	/* Other CSV files can't be told from text, they need -I csv. */
+	if (!filename || !g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+		return FALSE;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return FALSE;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	/* As written by the CSV output module. */
+	return len >= 5 && !strncmp(buf, "; CSV", 5);
+}
+
+static int init(struct sr_input *in)
+{
+	int i;
+	long num;
+	char name[SR_MAX_PROBENAME_LEN + 1];
+	char *param;
+	struct context *ctx;
+
+	if (!(ctx = g_try_malloc0(sizeof(*ctx)))) {
+		sr_err("csv in: %s: ctx malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	ctx->num_probes = DEFAULT_NUM_PROBES;
+	ctx->separator = ',';
+	ctx->num_threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	if ((num = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+		ctx->num_threads = num;
+#endif
+
+	if (in->param) {
+		param = g_hash_table_lookup(in->param, "numprobes");
+		if (param) {
+			num = strtol(param, NULL, 10);
+			if (num < 0 || num > SR_MAX_NUM_PROBES) {
+				sr_err("csv in: %s: invalid numprobes '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+			ctx->num_probes = num;
+		}
+
+		param = g_hash_table_lookup(in->param, "analog");
+		if (param) {
+			num = strtol(param, NULL, 10);
+			if (num < 0 || num > SR_MAX_NUM_PROBES) {
+				sr_err("csv in: %s: invalid analog '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+			ctx->num_analog = num;
+			/* Analog columns only, unless asked otherwise. */
+			if (!g_hash_table_lookup(in->param, "numprobes"))
+				ctx->num_probes = 0;
+		}
+
+		param = g_hash_table_lookup(in->param, "samplerate");
+		if (param) {
+			if (sr_parse_sizestring(param, &ctx->samplerate) != SR_OK) {
+				g_free(ctx);
+				return SR_ERR;
+			}
+		}
+
+		param = g_hash_table_lookup(in->param, "separator");
+		if (param) {
+			if (strlen(param) != 1 || param[0] == '\n') {
+				sr_err("csv in: %s: invalid separator '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+			ctx->separator = param[0];
+		}
+
+		param = g_hash_table_lookup(in->param, "threads");
+		if (param) {
+			num = strtol(param, NULL, 10);
+			if (num < 1 || num > 256) {
+				sr_err("csv in: %s: invalid threads '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+			ctx->num_threads = num;
+		}
+	}
+
+	if (!ctx->num_probes && !ctx->num_analog) {
+		sr_err("csv in: %s: no logic or analog columns", __func__);
+		g_free(ctx);
+		return SR_ERR;
+	}
+
+	/*
+	 * Frontends and output modules take all probes of a device as
+	 * logic probes, or all of them as analog ones.
+	 */
+	if (ctx->num_probes && ctx->num_analog) {
+		sr_err("csv in: %s: mixed logic and analog columns are not "
+		       "supported", __func__);
+		g_free(ctx);
+		return SR_ERR;
+	}
+	ctx->unitsize = (ctx->num_probes + 7) / 8;
+
+	/* Create a virtual device. */
+	in->vdev = sr_dev_new(NULL, 0);
+	in->internal = ctx;
+	ctx->vdev = in->vdev;
+
+	/* One probe per column, logic or analog. */
+	for (i = 0; i < ctx->num_probes; i++) {
+		snprintf(name, SR_MAX_PROBENAME_LEN, "%d", i);
+		/* TODO: Check return value. */
+		sr_dev_probe_add(in->vdev, name);
+	}
+	for (i = 0; i < ctx->num_analog; i++) {
+		snprintf(name, SR_MAX_PROBENAME_LEN, "A%d", i);
+		/* TODO: Check return value. */
+		sr_dev_probe_add(in->vdev, name);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Parse a decimal number. Digits beyond what a double holds are dropped,
+ * anything unusual (e.g. "nan") is left to g_ascii_strtod().
+ */
+static float parse_float(const char *p)
+{
+	const char *start;
+	uint64_t mant;
+	int exp10, e, digits;
+	gboolean neg, eneg;
+	double value;
+
+	start = p;
+	neg = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+
+	mant = 0;
+	exp10 = digits = 0;
+	for (; *p >= '0' && *p <= '9'; p++, digits++) {
+		if (mant < 100000000000000000ULL)
+			mant = mant * 10 + (*p - '0');
+		else
+			exp10++;
+	}
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, digits++) {
+			if (mant < 100000000000000000ULL) {
+				mant = mant * 10 + (*p - '0');
+				exp10--;
+			}
+		}
+	}
+	if (!digits)
+		return g_ascii_strtod(start, NULL);
+	if (*p == 'e' || *p == 'E') {
+		p++;
+		eneg = *p == '-';
+		if (*p == '-' || *p == '+')
+			p++;
+		for (e = 0; *p >= '0' && *p <= '9' && e < 10000; p++)
+			e = e * 10 + (*p - '0');
+		exp10 += eneg ? -e : e;
+	}
+
+	value = mant;
+	if (exp10 < -22 || exp10 > 22) {
+		/* Rare enough to not bother. */
+		for (; exp10 > 0; exp10--)
+			value *= 10;
+		for (; exp10 < 0; exp10++)
+			value /= 10;
+	} else if (exp10 < 0) {
+		value /= powers_of_10[-exp10];
+	} else {
+		value *= powers_of_10[exp10];
+	}
+
+	return neg ? -value : value;
+}
+
+/* Skip to the start of the next column, or to the end of the line. */
+static const char *next_column(const char *p, const char *eol, char sep)
+{
+	while (p < eol && *p != sep)
+		p++;
+
+	return p < eol ? p + 1 : eol;
+}
+
+/**
+ * Parse a block of lines into one SR_DF_LOGIC and one SR_DF_ANALOG packet.
+ * Missing columns are taken as 0.
+ */
+static void job_parse(struct context *ctx, struct csv_job *job)
+{
+	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_analog *analog;
+	const char *p, *eol, *end;
+	uint8_t *samples;
+	float *values;
+	uint64_t rows, n, sample;
+	int i;
+
+	end = job->text + job->len;
+
+	/* Every line could be a row. */
+	rows = 0;
+	for (p = job->text; p < end && (p = memchr(p, '\n', end - p)); p++)
+		rows++;
+	if (job->len && end[-1] != '\n')
+		rows++;
+
+	samples = NULL;
+	values = NULL;
+	if (ctx->num_probes) {
+		if ((job->ret = sr_datafeed_packet_new(SR_DF_LOGIC,
+				rows * ctx->unitsize, &job->logic)) != SR_OK)
+			return;
+		logic = job->logic->payload;
+		samples = logic->data;
+	}
+	if (ctx->num_analog) {
+		if ((job->ret = sr_datafeed_packet_new(SR_DF_ANALOG,
+				rows * ctx->num_analog * sizeof(float),
+				&job->analog)) != SR_OK)
+			return;
+		analog = job->analog->payload;
+		values = analog->data;
+	}
+
+	n = 0;
+	for (p = job->text; p < end; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		while (p < eol && (*p == ' ' || *p == '\t'))
+			p++;
+		/* Comments, column titles and empty lines. */
+		if (p == eol || !((*p >= '0' && *p <= '9') || *p == '-'
+				  || *p == '+' || *p == '.'))
+			continue;
+
+		sample = 0;
+		for (i = ctx->num_probes - 1; i >= 0; i--) {
+			while (p < eol && (*p == ' ' || *p == '\t'))
+				p++;
+			if (p < eol && *p == '1')
+				sample |= 1ULL << i;
+			p = next_column(p, eol, ctx->separator);
+		}
+		if (samples)
+			memcpy(samples + n * ctx->unitsize, &sample,
+			       ctx->unitsize);
+
+		for (i = 0; i < ctx->num_analog; i++) {
+			while (p < eol && (*p == ' ' || *p == '\t'))
+				p++;
+			values[n * ctx->num_analog + i] =
+				p < eol ? parse_float(p) : 0;
+			p = next_column(p, eol, ctx->separator);
+		}
+		n++;
+	}
+
+	if (job->logic) {
+		logic->length = n * ctx->unitsize;
+		logic->unitsize = ctx->unitsize;
+	}
+	if (job->analog) {
+		analog->num_samples = n;
+		analog->mq = SR_MQ_VOLTAGE;
+		analog->unit = SR_UNIT_VOLT;
+	}
+	job->ret = SR_OK;
+}
+
+static void job_free(struct csv_job *job)
+{
+	if (job->logic)
+		sr_datafeed_packet_release(job->logic);
+	if (job->analog)
+		sr_datafeed_packet_release(job->analog);
+	g_free(job->text);
+	g_free(job);
+}
+
+/* Send the packets of a parsed block, and free it. */
+static int job_send(struct context *ctx, struct csv_job *job)
+{
+	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_analog *analog;
+	int ret;
+
+	if ((ret = job->ret) != SR_OK) {
+		ctx->failed = TRUE;
+	} else if (!ctx->failed) {
+		logic = job->logic ? job->logic->payload : NULL;
+		if (logic && logic->length)
+			sr_session_send(ctx->vdev, job->logic);
+		analog = job->analog ? job->analog->payload : NULL;
+		if (analog && analog->num_samples)
+			sr_session_send(ctx->vdev, job->analog);
+	}
+	job_free(job);
+
+	return ret;
+}
+
+static gpointer parse_thread(gpointer data)
+{
+	struct context *ctx;
+	struct csv_job *job;
+
+	ctx = data;
+
+	g_mutex_lock(ctx->mutex);
+	while (TRUE) {
+		while (!ctx->quit && g_queue_is_empty(ctx->pending))
+			g_cond_wait(ctx->job_cond, ctx->mutex);
+		if (ctx->quit)
+			break;
+		job = g_queue_pop_head(ctx->pending);
+		g_mutex_unlock(ctx->mutex);
+
+		job_parse(ctx, job);
+
+		g_mutex_lock(ctx->mutex);
+		job->done = TRUE;
+		g_cond_broadcast(ctx->done_cond);
+	}
+	g_mutex_unlock(ctx->mutex);
+
+	return NULL;
+}
+
+/**
+ * Send the parsed blocks at the head of the queue, in file order, waiting
+ * for them until no more than max_inflight are left.
+ */
+static int jobs_drain(struct context *ctx, unsigned int max_inflight)
+{
+	struct csv_job *job;
+
+	if (!ctx->threads)
+		return ctx->failed ? SR_ERR : SR_OK;
+
+	g_mutex_lock(ctx->mutex);
+	while ((job = g_queue_peek_head(ctx->inflight))
+	       && (job->done
+		   || g_queue_get_length(ctx->inflight) > max_inflight)) {
+		while (!job->done)
+			g_cond_wait(ctx->done_cond, ctx->mutex);
+		g_queue_pop_head(ctx->inflight);
+		g_mutex_unlock(ctx->mutex);
+		job_send(ctx, job);
+		g_mutex_lock(ctx->mutex);
+	}
+	g_mutex_unlock(ctx->mutex);
+
+	return ctx->failed ? SR_ERR : SR_OK;
+}
+
+static int job_submit(struct context *ctx, char *text, size_t len)
+{
+	struct csv_job *job;
+
+	if (!(job = g_try_malloc0(sizeof(struct csv_job)))) {
+		sr_err("csv in: %s: job malloc failed", __func__);
+		g_free(text);
+		ctx->failed = TRUE;
+		return SR_ERR_MALLOC;
+	}
+	job->text = text;
+	job->len = len;
+
+	if (!ctx->threads) {
+		job_parse(ctx, job);
+		return job_send(ctx, job);
+	}
+
+	g_mutex_lock(ctx->mutex);
+	g_queue_push_tail(ctx->pending, job);
+	g_queue_push_tail(ctx->inflight, job);
+	g_cond_signal(ctx->job_cond);
+	g_mutex_unlock(ctx->mutex);
+
+	/* Keep every thread busy, but don't read in the whole file. */
+	return jobs_drain(ctx, 2 * ctx->num_threads);
+}
+
+static int threads_start(struct context *ctx)
+{
+	int i;
+
+	if (!(ctx->threads = g_try_malloc0(ctx->num_threads
+					   * sizeof(GThread *)))) {
+		sr_err("csv in: %s: threads malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->mutex = g_mutex_new();
+	ctx->job_cond = g_cond_new();
+	ctx->done_cond = g_cond_new();
+	ctx->pending = g_queue_new();
+	ctx->inflight = g_queue_new();
+
+	for (i = 0; i < ctx->num_threads; i++) {
+		if (!(ctx->threads[i] = g_thread_create(parse_thread, ctx,
+							TRUE, NULL))) {
+			sr_err("csv in: %s: failed to start parser thread",
+			       __func__);
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
+static void threads_stop(struct context *ctx)
+{
+	struct csv_job *job;
+	int i;
+
+	if (!ctx->threads)
+		return;
+
+	g_mutex_lock(ctx->mutex);
+	ctx->quit = TRUE;
+	g_cond_broadcast(ctx->job_cond);
+	g_mutex_unlock(ctx->mutex);
+	for (i = 0; i < ctx->num_threads && ctx->threads[i]; i++)
+		g_thread_join(ctx->threads[i]);
+
+	while ((job = g_queue_pop_head(ctx->inflight)))
+		job_free(job);
+	g_queue_free(ctx->pending);
+	g_queue_free(ctx->inflight);
+	g_cond_free(ctx->job_cond);
+	g_cond_free(ctx->done_cond);
+	g_mutex_free(ctx->mutex);
+	g_free(ctx->threads);
+	ctx->threads = NULL;
+}
+
+/* Take the samplerate from the comments the CSV output module writes. */
+static void parse_comments(struct context *ctx, const char *p,
+			   const char *end)
+{
+	const char *eol;
+
+	for (; p < end && (*p == ';' || *p == '#'); p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			break;
+		if (!ctx->samplerate && !strncmp(p, "; Samplerate: ", 14))
+			ctx->samplerate = strtoull(p + 14, NULL, 10);
+	}
+}
+
+static int send_header(struct context *ctx)
+{
+	struct sr_datafeed_header header;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_meta_logic meta;
+	struct sr_datafeed_meta_analog meta_analog;
+
+	/* send header */
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	packet.type = SR_DF_HEADER;
+	packet.payload = &header;
+	sr_session_send(ctx->vdev, &packet);
+
+	/* Send metadata about the SR_DF_LOGIC packets to come. */
+	if (ctx->num_probes) {
+		packet.type = SR_DF_META_LOGIC;
+		packet.payload = &meta;
+		meta.samplerate = ctx->samplerate;
+		meta.num_probes = ctx->num_probes;
+		sr_session_send(ctx->vdev, &packet);
+	}
+
+	/* Send metadata about the SR_DF_ANALOG packets to come. */
+	if (ctx->num_analog) {
+		packet.type = SR_DF_META_ANALOG;
+		packet.payload = &meta_analog;
+		meta_analog.num_probes = ctx->num_analog;
+		sr_session_send(ctx->vdev, &packet);
+	}
+
+	return SR_OK;
+}
+
+static int loadfile(struct sr_input *in, const char *filename)
+{
+	struct sr_datafeed_packet packet;
+	struct context *ctx;
+	char *buf, *carry, *eol;
+	size_t len, carry_len;
+	ssize_t size;
+	gboolean eof, first, read_failed;
+	int fd, ret;
+
+	ctx = in->internal;
+
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		sr_err("csv in: %s: file open failed", __func__);
+		return SR_ERR;
+	}
+
+	ret = SR_OK;
+	if (ctx->num_threads > 1 && (ret = threads_start(ctx)) != SR_OK)
+		threads_stop(ctx);
+
+	carry = NULL;
+	carry_len = 0;
+	eof = FALSE;
+	first = TRUE;
+	read_failed = FALSE;
+	while (ret == SR_OK && !eof) {
+		/* The partial line left over, and a new block. */
+		if (!(buf = g_try_malloc(carry_len + BLOCKSIZE + 1))) {
+			sr_err("csv in: %s: buf malloc failed", __func__);
+			ret = SR_ERR_MALLOC;
+			break;
+		}
+		if (carry_len)
+			memcpy(buf, carry, carry_len);
+		g_free(carry);
+		carry = NULL;
+		for (len = carry_len; len < carry_len + BLOCKSIZE; len += size) {
+			size = read(fd, buf + len, carry_len + BLOCKSIZE - len);
+			if (size < 0 && errno == EINTR) {
+				size = 0;
+			} else if (size < 0) {
+				sr_err("csv in: %s: read failed: %s",
+				       __func__, strerror(errno));
+				read_failed = eof = TRUE;
+				break;
+			} else if (size == 0) {
+				eof = TRUE;
+				break;
+			}
+		}
+		/* The lines read before an error are still sent. */
+		if (read_failed)
+			for (; len > 0 && buf[len - 1] != '\n'; len--);
+		buf[len] = 0;
+
+		if (first) {
+			parse_comments(ctx, buf, buf + len);
+			send_header(ctx);
+			first = FALSE;
+		}
+
+		/* Whole lines only, the rest goes with the next block. */
+		carry_len = 0;
+		if (!eof) {
+			for (eol = buf + len; eol > buf && eol[-1] != '\n'; eol--);
+			carry_len = buf + len - eol;
+			if (carry_len == len) {
+				/* No end of line in the whole block. */
+				carry = buf;
+				continue;
+			}
+			if (carry_len) {
+				if (!(carry = g_try_malloc(carry_len))) {
+					sr_err("csv in: %s: carry malloc "
+					       "failed", __func__);
+					g_free(buf);
+					ret = SR_ERR_MALLOC;
+					break;
+				}
+				memcpy(carry, eol, carry_len);
+				len -= carry_len;
+				buf[len] = 0;
+			}
+		}
+
+		ret = job_submit(ctx, buf, len);
+	}
+	g_free(carry);
+	close(fd);
+
+	if (ret == SR_OK)
+		ret = jobs_drain(ctx, 0);
+	if (ret == SR_OK && read_failed)
+		ret = SR_ERR;
+	threads_stop(ctx);
+
+	/* end of stream */
+	if (!first) {
+		packet.type = SR_DF_END;
+		packet.payload = NULL;
+		sr_session_send(in->vdev, &packet);
+	}
+
+	g_free(ctx);
+	in->internal = NULL;
+
+	return ret;
+}
+
+SR_PRIV struct sr_input_format input_csv = {
+	.id = "csv",
+	.description = "Comma-separated values (CSV)",
+	.format_match = format_match,
+	.init = init,
+	.loadfile = loadfile,
+};
@@ -21,10 +21,14 @@
 #include "libsigrok-internal.h"
 
 extern SR_PRIV struct sr_input_format input_chronovu_la8;
+extern SR_PRIV struct sr_input_format input_vcd;
+extern SR_PRIV struct sr_input_format input_csv;
 extern SR_PRIV struct sr_input_format input_binary;
 
 static struct sr_input_format *input_module_list[] = {
 	&input_chronovu_la8,
+	&input_vcd,
+	&input_csv,
 	/* This one has to be last, because it will take any input. */
 	&input_binary,
 	NULL,
@@ -0,0 +1,690 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/* Size of the blocks the file is read in. */
+#define BLOCKSIZE             (1024 * 1024)
+/* Default size of the SR_DF_LOGIC packets sent, see "packetsize". */
+#define DEFAULT_PACKETSIZE    (4 * 1024 * 1024)
+#define DEFAULT_NUM_PROBES    8
+
+/*
+ * Identifier codes are made of the printable characters '!' to '~'. Those
+ * of one or two characters, which is what most tools use for up to 8836
+ * variables, are looked up directly in a table.
+ */
+#define ID_CHARS              ('~' - '!' + 1)
+#define ID_TABLE_SIZE         (ID_CHARS + ID_CHARS * ID_CHARS)
+
+/* A $var, mapped to 'width' probes from 'probe' on. */
+struct vcd_var {
+	int probe;
+	int width;
+};
+
+struct context {
+	uint64_t samplerate;
+	uint64_t packetsize;
+	int unitsize;
+
+	/* The file, and the block of it being tokenized. */
+	int fd;
+	char *buf;
+	size_t bufsize;
+	size_t len;
+	size_t pos;
+	gboolean eof;
+
+	/* Index + 1 into vars[] by identifier code, 0 for unknown codes. */
+	uint8_t *ids;
+	/* Identifier codes of more than two characters. */
+	GHashTable *long_ids;
+	struct vcd_var vars[SR_MAX_NUM_PROBES];
+	int num_vars;
+	int next_probe;
+
+	/* A time of t is sample t * mul / div. */
+	uint64_t mul;
+	uint64_t div;
+
+	/* The current value of all probes, and the sample it starts at. */
+	uint64_t cur;
+	uint64_t sample;
+	gboolean have_time;
+	struct sr_datafeed_packet *packet;
+	uint64_t fill;
+};
+
+static int format_match(const char *filename)
+{
+	char buf[256], *p;
+	int fd, len;
+
+	if (!filename || !g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+		return FALSE;
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		return FALSE;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return FALSE;
+	buf[len] = 0;
+
+	/* The file starts with one of the declaration keywords. */
+	for (p = buf; *p && *p <= ' '; p++);
+	if (!strncmp(p, "$date", 5) || !strncmp(p, "$version", 8)
+	    || !strncmp(p, "$timescale", 10) || !strncmp(p, "$comment", 8)
+	    || !strncmp(p, "$scope", 6) || !strncmp(p, "$var", 4))
+		return TRUE;
+
+	return FALSE;
+}
+
+static int init(struct sr_input *in)
+{
+	int num_probes, i;
+	char name[SR_MAX_PROBENAME_LEN + 1];
+	char *param;
+	struct context *ctx;
+
+	if (!(ctx = g_try_malloc0(sizeof(*ctx)))) {
+		sr_err("vcd in: %s: ctx malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	num_probes = DEFAULT_NUM_PROBES;
+	ctx->samplerate = 0;
+	ctx->packetsize = DEFAULT_PACKETSIZE;
+
+	if (in->param) {
+		param = g_hash_table_lookup(in->param, "numprobes");
+		if (param) {
+			num_probes = strtoul(param, NULL, 10);
+			if (num_probes < 1 || num_probes > SR_MAX_NUM_PROBES) {
+				sr_err("vcd in: %s: invalid numprobes '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+		}
+
+		param = g_hash_table_lookup(in->param, "samplerate");
+		if (param) {
+			if (sr_parse_sizestring(param, &ctx->samplerate) != SR_OK) {
+				g_free(ctx);
+				return SR_ERR;
+			}
+		}
+
+		param = g_hash_table_lookup(in->param, "packetsize");
+		if (param) {
+			if (sr_parse_sizestring(param, &ctx->packetsize) != SR_OK
+			    || ctx->packetsize < 1 || ctx->packetsize > G_MAXINT) {
+				sr_err("vcd in: %s: invalid packetsize '%s'",
+				       __func__, param);
+				g_free(ctx);
+				return SR_ERR;
+			}
+		}
+	}
+
+	/* Create a virtual device. */
+	in->vdev = sr_dev_new(NULL, 0);
+	in->internal = ctx;
+
+	/* The probes are named after the $var they get in loadfile(). */
+	for (i = 0; i < num_probes; i++) {
+		snprintf(name, SR_MAX_PROBENAME_LEN, "%d", i);
+		/* TODO: Check return value. */
+		sr_dev_probe_add(in->vdev, name);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Read the next block of the file, keeping the partial token at the end of
+ * the current one.
+ */
+static int fill_buffer(struct context *ctx)
+{
+	char *buf;
+	ssize_t ret;
+
+	if (ctx->pos > 0) {
+		memmove(ctx->buf, ctx->buf + ctx->pos, ctx->len - ctx->pos);
+		ctx->len -= ctx->pos;
+		ctx->pos = 0;
+	}
+
+	/* A single token filling the whole block. */
+	if (ctx->len == ctx->bufsize) {
+		if (!(buf = g_try_realloc(ctx->buf, ctx->bufsize * 2))) {
+			sr_err("vcd in: %s: buf realloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		ctx->buf = buf;
+		ctx->bufsize *= 2;
+	}
+
+	if ((ret = read(ctx->fd, ctx->buf + ctx->len,
+			ctx->bufsize - ctx->len)) < 0) {
+		sr_err("vcd in: %s: read failed", __func__);
+		return SR_ERR;
+	}
+	if (ret == 0)
+		ctx->eof = TRUE;
+	ctx->len += ret;
+
+	return SR_OK;
+}
+
+/**
+ * Get the next whitespace-separated token, straight from the block buffer.
+ *
+ * @param ctx The context.
+ * @param tok Set to the token, which is valid until the next call, or to
+ *            NULL at the end of the file. It isn't NUL-terminated.
+ * @param len Set to the length of the token.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR upon read errors.
+ */
+static int next_token(struct context *ctx, const char **tok, size_t *len)
+{
+	size_t start, end;
+	int ret;
+
+	while (TRUE) {
+		for (start = ctx->pos; start < ctx->len
+		     && (unsigned char)ctx->buf[start] <= ' '; start++);
+		for (end = start; end < ctx->len
+		     && (unsigned char)ctx->buf[end] > ' '; end++);
+
+		/* The token ends within the block. */
+		if (end < ctx->len || (ctx->eof && end > start)) {
+			*tok = ctx->buf + start;
+			*len = end - start;
+			ctx->pos = end;
+			return SR_OK;
+		}
+		if (ctx->eof) {
+			*tok = NULL;
+			*len = 0;
+			return SR_OK;
+		}
+
+		ctx->pos = start;
+		if ((ret = fill_buffer(ctx)) != SR_OK)
+			return ret;
+	}
+}
+
+static gboolean token_is(const char *tok, size_t len, const char *str)
+{
+	return tok && len == strlen(str) && !memcmp(tok, str, len);
+}
+
+/* Skip the rest of a section, up to its $end. */
+static int skip_section(struct context *ctx)
+{
+	const char *tok;
+	size_t len;
+	int ret;
+
+	do {
+		if ((ret = next_token(ctx, &tok, &len)) != SR_OK)
+			return ret;
+	} while (tok && !token_is(tok, len, "$end"));
+
+	return SR_OK;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/**
+ * Parse a $timescale, e.g. "10 ns" or "1ps", and set up the conversion of
+ * times to samples. Without a samplerate option, each time unit is a sample.
+ */
+static int parse_timescale(struct context *ctx, const char *str)
+{
+	static const char *units[] = { "s", "ms", "us", "ns", "ps", "fs" };
+	uint64_t num, div, g;
+	char *unit;
+	unsigned int i;
+
+	num = strtoull(str, &unit, 10);
+	for (i = 0; i < G_N_ELEMENTS(units); i++) {
+		if (!strcmp(unit, units[i]))
+			break;
+	}
+	if ((num != 1 && num != 10 && num != 100)
+	    || i == G_N_ELEMENTS(units)) {
+		sr_err("vcd in: Invalid timescale '%s'.", str);
+		return SR_ERR;
+	}
+	for (div = 1; i > 0; i--)
+		div *= 1000;
+
+	if (!ctx->samplerate) {
+		ctx->samplerate = div % num ? 0 : div / num;
+		ctx->mul = ctx->div = 1;
+		return SR_OK;
+	}
+
+	/* Time units of num / div seconds at samplerate. */
+	g = gcd(num, div);
+	num /= g;
+	div /= g;
+	g = gcd(ctx->samplerate, div);
+	ctx->mul = num * (ctx->samplerate / g);
+	ctx->div = div / g;
+
+	return SR_OK;
+}
+
+static int id_index(const char *tok, size_t len)
+{
+	if (len == 1 && tok[0] >= '!' && tok[0] <= '~')
+		return tok[0] - '!';
+	if (len == 2 && tok[0] >= '!' && tok[0] <= '~'
+	    && tok[1] >= '!' && tok[1] <= '~')
+		return ID_CHARS + (tok[0] - '!') * ID_CHARS + (tok[1] - '!');
+
+	return -1;
+}
+
+static struct vcd_var *var_find(struct context *ctx, const char *tok,
+				size_t len)
+{
+	char key[64];
+	int i, n;
+
+	if ((i = id_index(tok, len)) >= 0)
+		n = ctx->ids[i];
+	else if (len < sizeof(key)) {
+		memcpy(key, tok, len);
+		key[len] = 0;
+		n = GPOINTER_TO_INT(g_hash_table_lookup(ctx->long_ids, key));
+	} else
+		n = 0;
+
+	return n ? &ctx->vars[n - 1] : NULL;
+}
+
+/**
+ * Map a $var to the next free probes, and name them after it.
+ *
+ * @param fields The type, size, identifier code, reference and optionally
+ *               the bit range of the variable.
+ * @param num_fields The number of fields.
+ */
+static void var_add(struct sr_input *in, char **fields, int num_fields)
+{
+	struct context *ctx;
+	struct vcd_var *var;
+	char name[SR_MAX_PROBENAME_LEN + 1];
+	const char *id;
+	int width, num_probes, i;
+
+	ctx = in->internal;
+
+	if (num_fields < 4)
+		return;
+	id = fields[2];
+	width = strtoul(fields[1], NULL, 10);
+	if (!strcmp(fields[0], "real") || !strcmp(fields[0], "realtime")
+	    || width < 1)
+		return;
+
+	/* Another name for a variable which is already there. */
+	if (var_find(ctx, id, strlen(id)))
+		return;
+
+	num_probes = g_slist_length(in->vdev->probes);
+	if (ctx->next_probe + width > num_probes) {
+		sr_warn("vcd in: No probes left for '%s', skipping it (see "
+			"the numprobes option).", fields[3]);
+		return;
+	}
+
+	var = &ctx->vars[ctx->num_vars++];
+	var->probe = ctx->next_probe;
+	var->width = width;
+	ctx->next_probe += width;
+
+	if ((i = id_index(id, strlen(id))) >= 0)
+		ctx->ids[i] = ctx->num_vars;
+	else
+		g_hash_table_insert(ctx->long_ids, g_strdup(id),
+				    GINT_TO_POINTER(ctx->num_vars));
+
+	for (i = 0; i < width; i++) {
+		if (width == 1)
+			snprintf(name, sizeof(name), "%s%s", fields[3],
+				 num_fields > 4 ? fields[4] : "");
+		else
+			snprintf(name, sizeof(name), "%s[%d]", fields[3], i);
+		sr_dev_probe_name_set(in->vdev, var->probe + i + 1, name);
+	}
+}
+
+/**
+ * Parse the declarations, up to $enddefinitions.
+ */
+static int parse_header(struct sr_input *in)
+{
+	struct context *ctx;
+	GString *timescale;
+	const char *tok;
+	char *fields[5];
+	size_t len;
+	int num_fields, ret, i;
+
+	ctx = in->internal;
+
+	timescale = NULL;
+	ret = SR_OK;
+	while (TRUE) {
+		if ((ret = next_token(ctx, &tok, &len)) != SR_OK)
+			break;
+		if (!tok) {
+			sr_err("vcd in: No $enddefinitions found.");
+			ret = SR_ERR;
+			break;
+		}
+
+		if (token_is(tok, len, "$enddefinitions")) {
+			ret = skip_section(ctx);
+			break;
+		} else if (token_is(tok, len, "$var")) {
+			num_fields = 0;
+			while ((ret = next_token(ctx, &tok, &len)) == SR_OK
+			       && tok && !token_is(tok, len, "$end")) {
+				if (num_fields < 5)
+					fields[num_fields++] = g_strndup(tok,
+									 len);
+			}
+			if (ret == SR_OK)
+				var_add(in, fields, num_fields);
+			for (i = 0; i < num_fields; i++)
+				g_free(fields[i]);
+		} else if (token_is(tok, len, "$timescale")) {
+			timescale = g_string_new(NULL);
+			while ((ret = next_token(ctx, &tok, &len)) == SR_OK
+			       && tok && !token_is(tok, len, "$end"))
+				g_string_append_len(timescale, tok, len);
+			if (ret == SR_OK)
+				ret = parse_timescale(ctx, timescale->str);
+			g_string_free(timescale, TRUE);
+		} else if (len > 0 && tok[0] == '$') {
+			ret = skip_section(ctx);
+		}
+		if (ret != SR_OK)
+			break;
+	}
+
+	/* Without a $timescale, each time unit is a sample. */
+	if (!ctx->div) {
+		ctx->mul = ctx->div = 1;
+		if (!ctx->samplerate)
+			ctx->samplerate = 1;
+	}
+
+	return ret;
+}
+
+static int flush_packet(struct sr_input *in)
+{
+	struct context *ctx;
+	struct sr_datafeed_logic *logic;
+
+	ctx = in->internal;
+
+	if (!ctx->fill)
+		return SR_OK;
+
+	logic = ctx->packet->payload;
+	logic->length = ctx->fill;
+	logic->unitsize = ctx->unitsize;
+	sr_session_send(in->vdev, ctx->packet);
+	ctx->fill = 0;
+
+	return sr_datafeed_packet_reuse(&ctx->packet);
+}
+
+/**
+ * Send count samples of the current value of the probes.
+ */
+static int send_samples(struct sr_input *in, uint64_t count)
+{
+	struct context *ctx;
+	struct sr_datafeed_logic *logic;
+	uint8_t *dest;
+	uint64_t n, done;
+	int ret;
+
+	ctx = in->internal;
+
+	while (count > 0) {
+		logic = ctx->packet->payload;
+		dest = (uint8_t *)logic->data + ctx->fill;
+		n = MIN(count, (ctx->packetsize - ctx->fill) / ctx->unitsize);
+
+		/* One sample, then keep doubling it up. */
+		memcpy(dest, &ctx->cur, ctx->unitsize);
+		for (done = 1; done < n; done *= 2)
+			memcpy(dest + done * ctx->unitsize, dest,
+			       MIN(done, n - done) * ctx->unitsize);
+
+		ctx->fill += n * ctx->unitsize;
+		count -= n;
+		if (ctx->fill + ctx->unitsize > ctx->packetsize
+		    && (ret = flush_packet(in)) != SR_OK)
+			return ret;
+	}
+
+	return SR_OK;
+}
+
+static void var_set(struct vcd_var *var, uint64_t *cur, uint64_t value)
+{
+	uint64_t mask;
+
+	mask = var->width >= 64 ? G_MAXUINT64 : (1ULL << var->width) - 1;
+	*cur = (*cur & ~(mask << var->probe)) | ((value & mask) << var->probe);
+}
+
+/**
+ * Parse the value changes, and send the probes' values at each time.
+ */
+static int parse_body(struct sr_input *in)
+{
+	struct context *ctx;
+	struct vcd_var *var;
+	const char *tok;
+	uint64_t value, time, sample;
+	size_t len, i;
+	int ret;
+
+	ctx = in->internal;
+
+	while ((ret = next_token(ctx, &tok, &len)) == SR_OK && tok) {
+		switch (tok[0]) {
+		case '#':
+			for (time = 0, i = 1; i < len; i++)
+				time = time * 10 + (tok[i] - '0');
+			sample = (time / ctx->div) * ctx->mul
+				 + (time % ctx->div) * ctx->mul / ctx->div;
+			/* Values before the first time apply from sample 0 on. */
+			ctx->have_time = TRUE;
+			if (sample <= ctx->sample)
+				break;
+			if ((ret = send_samples(in, sample - ctx->sample)) != SR_OK)
+				return ret;
+			ctx->sample = sample;
+			break;
+		case '0':
+		case '1':
+		case 'x':
+		case 'X':
+		case 'z':
+		case 'Z':
+			if ((var = var_find(ctx, tok + 1, len - 1)))
+				var_set(var, &ctx->cur, tok[0] == '1');
+			break;
+		case 'b':
+		case 'B':
+			/* Unknown bits are 0, only the low 64 matter. */
+			for (value = 0, i = 1; i < len; i++)
+				value = (value << 1) | (tok[i] == '1');
+			if ((ret = next_token(ctx, &tok, &len)) != SR_OK)
+				return ret;
+			if (tok && (var = var_find(ctx, tok, len)))
+				var_set(var, &ctx->cur, value);
+			break;
+		case 'r':
+		case 'R':
+			/* Real values have no probes, skip the identifier. */
+			if ((ret = next_token(ctx, &tok, &len)) != SR_OK)
+				return ret;
+			break;
+		case '$':
+			if (token_is(tok, len, "$comment")
+			    && (ret = skip_section(ctx)) != SR_OK)
+				return ret;
+			/* $dumpvars and the like only group values. */
+			break;
+		default:
+			break;
+		}
+	}
+	if (ret != SR_OK)
+		return ret;
+
+	/* The values at the last time. */
+	if (ctx->have_time && (ret = send_samples(in, 1)) != SR_OK)
+		return ret;
+
+	return flush_packet(in);
+}
+
+static int loadfile(struct sr_input *in, const char *filename)
+{
+	struct sr_datafeed_header header;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_meta_logic meta;
+	struct context *ctx;
+	int num_probes, ret;
+
+	ctx = in->internal;
+
+	if ((ctx->fd = open(filename, O_RDONLY)) == -1) {
+		sr_err("vcd in: %s: file open failed", __func__);
+		return SR_ERR;
+	}
+
+	num_probes = g_slist_length(in->vdev->probes);
+	ctx->unitsize = (num_probes + 7) / 8;
+	ctx->packetsize = MAX(ctx->packetsize / ctx->unitsize, 1)
+			  * ctx->unitsize;
+	ctx->bufsize = BLOCKSIZE;
+
+	ret = SR_ERR_MALLOC;
+	if (!(ctx->buf = g_try_malloc(ctx->bufsize))) {
+		sr_err("vcd in: %s: buf malloc failed", __func__);
+		goto out;
+	}
+	if (!(ctx->ids = g_try_malloc0(ID_TABLE_SIZE))) {
+		sr_err("vcd in: %s: ids malloc failed", __func__);
+		goto out;
+	}
+	ctx->long_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
+					      g_free, NULL);
+	if (sr_datafeed_packet_new(SR_DF_LOGIC, ctx->packetsize,
+				   &ctx->packet) != SR_OK)
+		goto out;
+
+	/* The probes get their names before the frontend sees them. */
+	if ((ret = parse_header(in)) != SR_OK)
+		goto out;
+
+	/* send header */
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	packet.type = SR_DF_HEADER;
+	packet.payload = &header;
+	sr_session_send(in->vdev, &packet);
+
+	/* Send metadata about the SR_DF_LOGIC packets to come. */
+	packet.type = SR_DF_META_LOGIC;
+	packet.payload = &meta;
+	meta.samplerate = ctx->samplerate;
+	meta.num_probes = num_probes;
+	sr_session_send(in->vdev, &packet);
+
+	ret = parse_body(in);
+
+	/* end of stream */
+	packet.type = SR_DF_END;
+	packet.payload = NULL;
+	sr_session_send(in->vdev, &packet);
+
+out:
+	close(ctx->fd);
+	if (ctx->packet)
+		sr_datafeed_packet_release(ctx->packet);
+	if (ctx->long_ids)
+		g_hash_table_destroy(ctx->long_ids);
+	g_free(ctx->ids);
+	g_free(ctx->buf);
+	g_free(ctx);
+	in->internal = NULL;
+
+	return ret;
+}
+
+SR_PRIV struct sr_input_format input_vcd = {
+	.id = "vcd",
+	.description = "Value Change Dump (VCD)",
+	.format_match = format_match,
+	.init = init,
+	.loadfile = loadfile,
+};
@@ -37,9 +37,29 @@
 #define ARRAY_AND_SIZE(a) (a), ARRAY_SIZE(a)
 #endif
 
-/* Size of a datastore chunk in units */
+/* Default size of a datastore chunk in units */
 #define DATASTORE_CHUNKSIZE (512 * 1024)
 
+/* Default max. number of bytes of free chunks in the datastore chunk pool */
+#define DATASTORE_POOL_SIZE (64 * 1024 * 1024)
+
+/*
+ * Session file version 2 block index, the "index-N" member of a device.
+ * All values are little-endian. The header holds the magic, uint32 flags
+ * (SESSION_INDEX_*), uint32 unitsize, uint32 size of a block record, and
+ * uint64 samples per block, number of blocks, total samples and number of
+ * trigger positions. Then follows a record for each
+ * "logic-N-B" block (B counting from 1): uint64 masks of the probes high
+ * in all samples (min), high in any sample (max), and toggling within the
+ * block or from the previous one (changed). Last come the sample numbers
+ * of the triggers, as uint64.
+ */
+#define SESSION_INDEX_MAGIC		"SRIX"
+#define SESSION_INDEX_HEADER_SIZE	48
+#define SESSION_INDEX_RECORD_SIZE	24
+/* The block records contain valid summaries. */
+#define SESSION_INDEX_SUMMARY		(1 << 0)
+
 #ifdef HAVE_LIBUSB_1_0
 struct sr_usb_dev_inst {
 	uint8_t bus;
@@ -77,6 +97,10 @@ SR_PRIV int sr_info(const char *format, ...);
 SR_PRIV int sr_warn(const char *format, ...);
 SR_PRIV int sr_err(const char *format, ...);
 
+/*--- datastore.c -----------------------------------------------------------*/
+
+SR_PRIV void sr_datastore_pool_free(void);
+
 /*--- hwdriver.c ------------------------------------------------------------*/
 
 SR_PRIV void sr_hw_cleanup_all(void);
@@ -134,6 +134,7 @@ enum {
 	SR_DF_META_ANALOG,
 	SR_DF_FRAME_BEGIN,
 	SR_DF_FRAME_END,
+	SR_DF_OVERRUN,
 };
 
 /* sr_datafeed_analog.mq values */
@@ -191,6 +192,14 @@ struct sr_datafeed_analog {
 	float *data;
 };
 
+/* Data packets of the device were dropped before this point. */
+struct sr_datafeed_overrun {
+	/* Number of SR_DF_LOGIC and SR_DF_ANALOG packets dropped. */
+	uint64_t packets;
+	/* Number of samples in those packets. */
+	uint64_t samples;
+};
+
 struct sr_input {
 	struct sr_input_format *format;
 	GHashTable *param;
@@ -228,8 +237,82 @@ struct sr_output_format {
 struct sr_datastore {
 	/* Size in bytes of the number of units stored in this datastore */
 	int ds_unitsize;
-	unsigned int num_units; /* TODO: uint64_t */
-	GSList *chunklist;
+	uint64_t num_units;
+	/* Number of units per chunk */
+	uint64_t chunksize;
+	/* Table of chunk pointers, each chunk holds 'chunksize' units */
+	GPtrArray *chunks;
+	/* Backing file for full chunks, or -1 if all data is kept in memory */
+	int fd;
+	/* Name of the backing file, NULL if it's an anonymous temporary file */
+	char *filename;
+	/* Max. number of bytes of full chunks to keep in memory */
+	uint64_t max_resident;
+	/* Number of bytes of full chunks currently in memory */
+	uint64_t resident;
+	/* Indices of the full chunks in memory, oldest first */
+	GQueue *resident_chunks;
+	/* Run-length encode chunks as soon as they are full */
+	gboolean rle;
+	/* Scratch buffer holding one decoded chunk, and that chunk's index */
+	uint8_t *decoded;
+	guint decoded_index;
+	/* Keep a bit-plane per probe for every chunk */
+	gboolean bitplanes;
+	/* Summary pyramid: one GArray of summary entries per level, or NULL */
+	GPtrArray *summary;
+	/* Probes which toggled in the summary bucket being filled */
+	uint64_t summary_toggled;
+	/* Edge index: one table of transitions per probe, or NULL */
+	GPtrArray *edges;
+	/* Value of the last unit put into the datastore (summary, edges) */
+	uint64_t last_value;
+	/* Back chunks with huge pages */
+	gboolean hugepages;
+};
+
+/* Iterates over contiguous spans of units in a datastore, without copying. */
+struct sr_datastore_iter {
+	struct sr_datastore *ds;
+	/* Index of the next unit to return */
+	uint64_t pos;
+	/* Index of the unit just past the end of the iterated range */
+	uint64_t end;
+	/* Chunk, index and first unit of the last run-length encoded run */
+	guint run_chunk;
+	guint run_index;
+	uint64_t run_start;
+};
+
+/* sr_filter_plan.method values */
+enum {
+	/* All probes, in order: copy the data as it is */
+	SR_FILTER_COPY,
+	/* Whole bytes of probes, in order: copy those bytes of every unit */
+	SR_FILTER_BYTES,
+	/* Contiguous probes, in order: shift and mask every unit */
+	SR_FILTER_SHIFT,
+	/* Probes in ascending order: BMI2 parallel bit extract */
+	SR_FILTER_PEXT,
+	/* Any probes: OR together a lookup table entry per input byte */
+	SR_FILTER_LUT,
+};
+
+/* A precomputed plan for removing unused probes from samples. */
+struct sr_filter_plan {
+	int in_unitsize;
+	int out_unitsize;
+	/* How units are compacted, see SR_FILTER_* */
+	int method;
+	/* Input bits of the enabled probes (BYTES, SHIFT, PEXT) */
+	uint64_t mask;
+	/* Number of bits the enabled probes are shifted down (BYTES, SHIFT) */
+	int shift;
+	/* Input bytes holding enabled probes, and how many there are (LUT) */
+	int lut_bytes[8];
+	int num_lut_bytes;
+	/* For every input byte and byte value, the output bits (LUT) */
+	uint64_t lut[8][256];
 };
 
 /*
@@ -261,6 +344,54 @@ struct sr_probe {
 	char *trigger;
 };
 
+/* Maximum number of stages of a software trigger */
+#define SR_MAX_TRIGGER_STAGES 16
+
+/*
+ * The conditions of one software trigger stage. Bit n is the probe with
+ * index n + 1.
+ */
+struct sr_trigger_stage {
+	/* Probes which must be at a given level, and those levels */
+	uint64_t mask;
+	uint64_t value;
+	/* Probes which must have a rising edge, falling edge, or either */
+	uint64_t rising;
+	uint64_t falling;
+	uint64_t change;
+};
+
+typedef int (*sr_trigger_send_callback_t)(struct sr_dev *dev,
+		struct sr_datafeed_packet *packet);
+
+/*
+ * A software trigger. Stage n must match on the sample after the one
+ * stage n - 1 matched on; the trigger fires on the sample matching the
+ * last stage.
+ */
+struct sr_trigger {
+	int num_stages;
+	struct sr_trigger_stage stages[SR_MAX_TRIGGER_STAGES];
+	/* Where sr_trigger_send() passes packets on to */
+	sr_trigger_send_callback_t send;
+	/* Set once the trigger fired, all data is passed on from then on */
+	gboolean fired;
+	/* Bit n set if stages 0 to n matched, ending at the previous sample */
+	uint64_t matched;
+	/* The previous sample, for edges, if there was one */
+	uint64_t prev;
+	gboolean have_prev;
+	/* Number of samples sent before SR_DF_TRIGGER */
+	uint64_t pre_trigger;
+	/* Number of samples passed on since the trigger was reset */
+	uint64_t num_sent;
+	/* Ring buffer of the last samples seen before the trigger fired */
+	uint8_t *ring;
+	int unitsize;
+	uint64_t ring_start;
+	uint64_t ring_length;
+};
+
 /* Hardware driver capabilities */
 enum {
 	SR_HWCAP_DUMMY = 0, /* Used to terminate lists. Must be 0! */
@@ -349,6 +480,18 @@ enum {
 	/** The device supports setting the number of probes. */
 	SR_HWCAP_CAPTURE_NUM_PROBES,
 
+	/** How a capturefile is replayed, see the SR_REPLAY_* values. */
+	SR_HWCAP_CAPTURE_REPLAY,
+
+	/**
+	 * The capturefile is split into blocks which are listed in this
+	 * index file (session file version 2).
+	 */
+	SR_HWCAP_CAPTURE_INDEXFILE,
+
+	/** The first sample of the capturefile to replay. */
+	SR_HWCAP_CAPTURE_START,
+
 
 	/*--- Acquisition modes ---------------------------------------------*/
 
@@ -379,6 +522,14 @@ enum {
 
 };
 
+/* SR_HWCAP_CAPTURE_REPLAY values */
+enum {
+	/* Send the capture as fast as it can be read */
+	SR_REPLAY_MAX_SPEED,
+	/* Send the capture at its recorded samplerate */
+	SR_REPLAY_REALTIME,
+};
+
 struct sr_hwcap_option {
 	int hwcap;
 	int type;
@@ -481,6 +632,97 @@ struct sr_dev_driver {
 	int (*dev_acquisition_stop) (int dev_index, void *session_dev_id);
 };
 
+/* sr_session_config_set() keys */
+enum {
+	/* gboolean: run acquisition and datafeed callbacks in threads */
+	SR_SESSION_THREADED,
+	/* int: number of consumer threads running the datafeed callbacks */
+	SR_SESSION_CONSUMERS,
+	/* int: maximum number of packets queued per consumer thread */
+	SR_SESSION_QUEUE_LENGTH,
+	/* int: merge small SR_DF_LOGIC packets into blocks of this many
+	 * bytes, 0 disables coalescing */
+	SR_SESSION_COALESCE_SIZE,
+	/* int: longest time (ms) data is held back for coalescing, 0 for
+	 * no limit */
+	SR_SESSION_COALESCE_LATENCY,
+	/* int: what to do when a consumer's queue is full (SR_QUEUE_*) */
+	SR_SESSION_QUEUE_POLICY,
+	/* gboolean: collect datafeed callback and driver statistics */
+	SR_SESSION_STATS,
+	/* int: compression of the samples in session files, a deflate
+	 * level 1-9 or SR_FILE_LEVEL_* */
+	SR_SESSION_FILE_LEVEL,
+	/* int: threads (de)compressing the samples of each session file */
+	SR_SESSION_FILE_THREADS,
+};
+
+/* SR_SESSION_FILE_LEVEL values, besides the deflate levels 1 to 9 */
+enum {
+	/* zlib's default deflate level */
+	SR_FILE_LEVEL_DEFAULT = -1,
+	/* No compression, for maximum write speed */
+	SR_FILE_LEVEL_STORE = 0,
+};
+
+/* SR_SESSION_QUEUE_POLICY values */
+enum {
+	/* Wait until the consumer catches up */
+	SR_QUEUE_BLOCK,
+	/* Drop the oldest queued data packet */
+	SR_QUEUE_DROP_OLDEST,
+	/* Drop the data packet being sent */
+	SR_QUEUE_DROP_NEWEST,
+};
+
+/*
+ * Number of buckets in the statistics histograms. Bucket 0 counts values
+ * of 0, bucket n counts values from 2^(n-1) up to 2^n - 1, the last
+ * bucket also counts everything larger.
+ */
+#define SR_STATS_BUCKETS 32
+
+/* Statistics of one datafeed callback, see sr_session_stats_callback_get(). */
+struct sr_datafeed_cb_stats {
+	/* Number of packets the callback was called with. */
+	uint64_t calls;
+	/* Bytes and samples in the SR_DF_LOGIC and SR_DF_ANALOG packets. */
+	uint64_t bytes;
+	uint64_t samples;
+	/* Time (us) from the first call until the last call returned. */
+	uint64_t elapsed;
+	/* Time (us) spent inside the callback. */
+	uint64_t busy;
+	/*
+	 * Latency (us) from sr_session_send() until the callback returned,
+	 * including time spent in queues, coalescing and earlier callbacks.
+	 */
+	uint64_t latency_min;
+	uint64_t latency_max;
+	uint64_t latency_total;
+	uint64_t latency_hist[SR_STATS_BUCKETS];
+};
+
+/* Statistics of the packets sent by one driver's devices. */
+struct sr_driver_stats {
+	/* Number of packets of any type. */
+	uint64_t packets;
+	/* Number of SR_DF_LOGIC and SR_DF_ANALOG packets. */
+	uint64_t data_packets;
+	/* Bytes and samples in those packets. */
+	uint64_t bytes;
+	uint64_t samples;
+	/* Time (us) from the first until the last packet was sent. */
+	uint64_t elapsed;
+	/* Size (bytes) of the data packets. */
+	uint64_t size_min;
+	uint64_t size_max;
+	uint64_t size_hist[SR_STATS_BUCKETS];
+};
+
+/* Records a session file during acquisition, see sr_session_writer_new(). */
+struct sr_session_writer;
+
 struct sr_session {
 	/* List of struct sr_dev* */
 	GSList *devs;
@@ -489,16 +731,54 @@ struct sr_session {
 	GTimeVal starttime;
 	gboolean running;
 
-	unsigned int num_sources;
-
-	/* Both "sources" and "pollfds" are of the same size and contain pairs of
-	 * descriptor and callback function. We can not embed the GPollFD into the
-	 * source struct since we want to be able to pass the array of all poll
-	 * descriptors to g_poll.
+	/* Threaded mode settings, see sr_session_config_set(). */
+	gboolean threaded;
+	int num_consumers;
+	int queue_length;
+	int queue_policy;
+	/* Data packets and samples dropped by all queues. */
+	uint64_t dropped_packets;
+	uint64_t dropped_samples;
+	/* Set while the acquisition threads are running. */
+	gint acquiring;
+	/* Array of struct consumer*, NULL unless in threaded mode. */
+	GPtrArray *consumers;
+	/* Protects the sources, the source table and the pollers. */
+	GMutex *sources_mutex;
+
+	/* SR_DF_LOGIC coalescing settings, see sr_session_config_set(). */
+	int coalesce_size;
+	int coalesce_latency;
+	/* struct coalescer* by struct sr_dev* */
+	GHashTable *coalescers;
+	/* Software triggers, struct sr_trigger* by struct sr_dev* */
+	GHashTable *triggers;
+
+	/* Session file compression, see sr_session_config_set(). */
+	int file_level;
+	int file_threads;
+
+	/* Statistics collection, see sr_session_config_set(). */
+	gboolean stats;
+	/* struct cb_stats* by sr_datafeed_callback_t */
+	GHashTable *cb_stats;
+	/* struct driver_stats* by struct sr_dev_driver* */
+	GHashTable *driver_stats;
+
+	/*
+	 * Event sources by slot number. Slots are allocated once and reused
+	 * through a free list, so adding and removing sources doesn't need
+	 * any memory allocation once the table is large enough.
 	 */
-	struct source *sources;
-	GPollFD *pollfds;
-	int source_timeout;
+	struct source **sources;
+	unsigned int sources_size;
+	unsigned int num_sources;
+	/* Unused slots, linked through struct source. */
+	struct source *free_sources;
+	/* struct source* by poll object (fd, pollfd or channel) */
+	GHashTable *source_table;
+	/* List of struct poller*, one per running event loop. */
+	GSList *pollers;
 };
 
 #include "proto.h"
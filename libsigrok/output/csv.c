@@ -32,6 +32,8 @@ struct context {
 	uint64_t samplerate;
 	GString *header;
 	char separator;
+	/* Text of every byte value: its bits, MSB first, each separated. */
+	char bits_text[256][16];
 };
 
 /*
@@ -54,7 +56,7 @@ static int init(struct sr_output *o)
 	int num_probes;
 	uint64_t samplerate;
 	time_t t;
-	unsigned int i;
+	unsigned int i, b;
 
 	if (!o) {
 		sr_err("csv out: %s: o was NULL", __func__);
@@ -102,6 +104,13 @@ static int init(struct sr_output *o)
 
 	ctx->separator = ',';
 
+	for (i = 0; i < 256; i++) {
+		for (b = 0; b < 8; b++) {
+			ctx->bits_text[i][b * 2] = '0' + ((i >> (7 - b)) & 1);
+			ctx->bits_text[i][b * 2 + 1] = ctx->separator;
+		}
+	}
+
 	ctx->header = g_string_sized_new(512);
 
 	t = time(NULL);
@@ -172,9 +181,10 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	GString *outstr;
-	uint64_t sample, i;
-	int j;
+	const uint8_t *sample, *end;
+	uint8_t *outbuf, *p;
+	uint64_t outsize;
+	int j, topbits;
 
 	if (!o) {
 		sr_err("csv out: %s: o was NULL", __func__);
@@ -191,27 +201,43 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		return SR_ERR_ARG;
 	}
 
+	/* Every sample is a line of probe values, separator and newline. */
+	outsize = (length_in / ctx->unitsize)
+			* (ctx->num_enabled_probes * 2 + 1);
+	if (ctx->header)
+		outsize += ctx->header->len;
+
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
+		sr_err("csv out: %s: outbuf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	p = outbuf;
+
 	if (ctx->header) {
 		/* First data packet. */
-		outstr = ctx->header;
+		memcpy(p, ctx->header->str, ctx->header->len);
+		p += ctx->header->len;
+		g_string_free(ctx->header, TRUE);
 		ctx->header = NULL;
-	} else {
-		outstr = g_string_sized_new(512);
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		memcpy(&sample, data_in + i, ctx->unitsize);
-		for (j = ctx->num_enabled_probes - 1; j >= 0; j--) {
-			g_string_append_printf(outstr, "%d%c",
-				(int)((sample & (1 << j)) >> j),
-				ctx->separator);
+	/* The highest probe comes first, the top byte may be partly used. */
+	topbits = ctx->num_enabled_probes - (ctx->unitsize - 1) * 8;
+
+	end = data_in + length_in - length_in % ctx->unitsize;
+	for (sample = data_in; sample < end; sample += ctx->unitsize) {
+		memcpy(p, ctx->bits_text[sample[ctx->unitsize - 1]]
+				+ 16 - topbits * 2, topbits * 2);
+		p += topbits * 2;
+		for (j = ctx->unitsize - 2; j >= 0; j--) {
+			memcpy(p, ctx->bits_text[sample[j]], 16);
+			p += 16;
 		}
-		g_string_append_printf(outstr, "\n");
+		*p++ = '\n';
 	}
 
-	*data_out = (uint8_t *)outstr->str;
-	*length_out = outstr->len;
-	g_string_free(outstr, FALSE);
+	*data_out = outbuf;
+	*length_out = p - outbuf;
 
 	return SR_OK;
 }
@@ -35,7 +35,7 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 		      uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int outsize, offset, p;
+	unsigned int outsize, offset, p, len;
 	int max_linelen;
 	uint64_t sample;
 	uint8_t *outbuf, c;
@@ -50,15 +50,16 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 	outsize = 512 + (1 + (length_in / ctx->unitsize) / ctx->samples_per_line)
             * (ctx->num_enabled_probes * max_linelen);
 
-	if (!(outbuf = g_try_malloc0(outsize + 1))) {
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
 		sr_err("bits out: %s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	outbuf[0] = '\0';
+	len = 0;
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		strncpy((char *)outbuf, ctx->header, outsize);
+		len = strlen(ctx->header);
+		memcpy(outbuf, ctx->header, len);
 		g_free(ctx->header);
 		ctx->header = NULL;
 
@@ -72,7 +73,7 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 		     offset += ctx->unitsize) {
 			memcpy(&sample, data_in + offset, ctx->unitsize);
 			for (p = 0; p < ctx->num_enabled_probes; p++) {
-				c = (sample & ((uint64_t) 1 << p)) ? '1' : '0';
+				c = '0' + ((sample >> p) & 1);
 				ctx->linebuf[p * ctx->linebuf_len +
 					     ctx->line_offset] = c;
 			}
@@ -89,7 +90,7 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 
 			/* End of line. */
 			if (ctx->spl_cnt >= ctx->samples_per_line) {
-				flush_linebufs(ctx, outbuf);
+				len += flush_linebufs(ctx, outbuf + len);
 				ctx->line_offset = ctx->spl_cnt = 0;
 				ctx->mark_trigger = -1;
 			}
@@ -100,7 +101,7 @@ SR_PRIV int data_bits(struct sr_output *o, const uint8_t *data_in,
 	}
 
 	*data_out = outbuf;
-	*length_out = strlen((const char *)outbuf);
+	*length_out = len;
 
 	return SR_OK;
 }
@@ -25,6 +25,8 @@
 #include "libsigrok-internal.h"
 #include "text.h"
 
+static const char hexdigits[] = "0123456789abcdef";
+
 SR_PRIV int init_hex(struct sr_output *o)
 {
 	return init(o, DEFAULT_BPL_HEX, MODE_HEX);
@@ -35,40 +37,41 @@ SR_PRIV int data_hex(struct sr_output *o, const uint8_t *data_in,
 		     uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int outsize, offset, p;
+	unsigned int outsize, offset, p, len;
 	int max_linelen;
 	uint64_t sample;
-	uint8_t *outbuf;
+	uint8_t *outbuf, *line;
 
 	ctx = o->internal;
 	max_linelen = SR_MAX_PROBENAME_LEN + 3 + ctx->samples_per_line
 			+ ctx->samples_per_line / 2;
-	outsize = length_in / ctx->unitsize * ctx->num_enabled_probes
-			/ ctx->samples_per_line * max_linelen + 512;
+	outsize = 512 + (1 + (length_in / ctx->unitsize) / ctx->samples_per_line)
+			* (ctx->num_enabled_probes * max_linelen);
 
-	if (!(outbuf = g_try_malloc0(outsize + 1))) {
+	if (!(outbuf = g_try_malloc(outsize + 1))) {
 		sr_err("hex out: %s: outbuf malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
 
-	outbuf[0] = '\0';
+	len = 0;
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		strncpy((char *)outbuf, ctx->header, outsize);
+		len = strlen(ctx->header);
+		memcpy(outbuf, ctx->header, len);
 		g_free(ctx->header);
 		ctx->header = NULL;
 	}
 
-	ctx->line_offset = 0;
 	for (offset = 0; offset <= length_in - ctx->unitsize;
 	     offset += ctx->unitsize) {
 		memcpy(&sample, data_in + offset, ctx->unitsize);
 		for (p = 0; p < ctx->num_enabled_probes; p++) {
 			ctx->linevalues[p] <<= 1;
-			if (sample & ((uint64_t) 1 << p))
-				ctx->linevalues[p] |= 1;
-			sprintf((char *)ctx->linebuf + (p * ctx->linebuf_len) +
-				ctx->line_offset, "%.2x", ctx->linevalues[p]);
+			ctx->linevalues[p] |= (sample >> p) & 1;
+			line = ctx->linebuf + p * ctx->linebuf_len
+					+ ctx->line_offset;
+			line[0] = hexdigits[ctx->linevalues[p] >> 4];
+			line[1] = hexdigits[ctx->linevalues[p] & 0xf];
 		}
 		ctx->spl_cnt++;
 
@@ -82,13 +85,13 @@ SR_PRIV int data_hex(struct sr_output *o, const uint8_t *data_in,
 
 		/* End of line. */
 		if (ctx->spl_cnt >= ctx->samples_per_line) {
-			flush_linebufs(ctx, outbuf);
+			len += flush_linebufs(ctx, outbuf + len);
 			ctx->line_offset = ctx->spl_cnt = 0;
 		}
 	}
 
 	*data_out = outbuf;
-	*length_out = strlen((const char *)outbuf);
+	*length_out = len;
 
 	return SR_OK;
 }
@@ -27,42 +27,59 @@
 #include "libsigrok-internal.h"
 #include "text.h"
 
-SR_PRIV void flush_linebufs(struct context *ctx, uint8_t *outbuf)
+/*
+ * Write out the line of every probe, and the trigger marker if any, and
+ * clear the line buffers.
+ *
+ * @param ctx The output context.
+ * @param outbuf Where to write the lines.
+ *
+ * @return The number of bytes written to outbuf.
+ */
+SR_PRIV int flush_linebufs(struct context *ctx, uint8_t *outbuf)
 {
-	static int max_probename_len = 0;
-	int len, i;
+	uint8_t *p;
+	const uint8_t *line;
+	int len, i, space_offset;
 
 	if (ctx->linebuf[0] == 0)
-		return;
-
-	if (max_probename_len == 0) {
-		/* First time through... */
-		for (i = 0; ctx->probelist[i]; i++) {
-			len = strlen(ctx->probelist[i]);
-			if (len > max_probename_len)
-				max_probename_len = len;
-		}
-	}
+		return 0;
 
+	p = outbuf;
 	for (i = 0; ctx->probelist[i]; i++) {
-		sprintf((char *)outbuf + strlen((const char *)outbuf),
-			"%*s:%s\n", max_probename_len,
-			ctx->probelist[i], ctx->linebuf + i * ctx->linebuf_len);
+		/* "%*s:%s\n", the probe name right aligned. */
+		len = strlen(ctx->probelist[i]);
+		memset(p, ' ', ctx->max_probename_len - len);
+		p += ctx->max_probename_len - len;
+		memcpy(p, ctx->probelist[i], len);
+		p += len;
+		*p++ = ':';
+		line = ctx->linebuf + i * ctx->linebuf_len;
+		len = strlen((const char *)line);
+		memcpy(p, line, len);
+		p += len;
+		*p++ = '\n';
 	}
 
 	/* Mark trigger with a ^ character. */
 	if (ctx->mark_trigger != -1)
 	{
-		int space_offset = ctx->mark_trigger / 8;
+		space_offset = ctx->mark_trigger / 8;
 
 		if (ctx->mode == MODE_ASCII)
 			space_offset = 0;
 
-		sprintf((char *)outbuf + strlen((const char *)outbuf),
-			"T:%*s^\n", ctx->mark_trigger + space_offset, "");
+		*p++ = 'T';
+		*p++ = ':';
+		memset(p, ' ', ctx->mark_trigger + space_offset);
+		p += ctx->mark_trigger + space_offset;
+		*p++ = '^';
+		*p++ = '\n';
 	}
 
 	memset(ctx->linebuf, 0, i * ctx->linebuf_len);
+
+	return p - outbuf;
 }
 
 SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
@@ -87,6 +104,8 @@ SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode)
 		if (!probe->enabled)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
+		if ((int)strlen(probe->name) > ctx->max_probename_len)
+			ctx->max_probename_len = strlen(probe->name);
 	}
 
 	ctx->probelist[ctx->num_enabled_probes] = 0;
@@ -159,14 +178,13 @@ SR_PRIV int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		break;
 	case SR_DF_END:
 		outsize = ctx->num_enabled_probes
-				* (ctx->samples_per_line + 20) + 512;
+				* (SR_MAX_PROBENAME_LEN + 3 + ctx->linebuf_len) + 512;
 		if (!(outbuf = g_try_malloc0(outsize))) {
 			sr_err("text out: %s: outbuf malloc failed", __func__);
 			return SR_ERR_MALLOC;
 		}
-		flush_linebufs(ctx, outbuf);
+		*length_out = flush_linebufs(ctx, outbuf);
 		*data_out = outbuf;
-		*length_out = strlen((const char *)outbuf);
 		g_free(o->internal);
 		o->internal = NULL;
 		break;
@@ -41,12 +41,13 @@ struct context {
 	int spl_cnt;
 	uint8_t *linevalues;
 	char *header;
+	int max_probename_len;
 	int mark_trigger;
 	uint64_t prevsample;
 	enum outputmode mode;
 };
 
-SR_PRIV void flush_linebufs(struct context *ctx, uint8_t *outbuf);
+SR_PRIV int flush_linebufs(struct context *ctx, uint8_t *outbuf);
 SR_PRIV int init(struct sr_output *o, int default_spl, enum outputmode mode);
 SR_PRIV int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		  uint64_t *length_out);
@@ -26,17 +26,65 @@
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+/* Identifiers are at most this long; 94 + 94 * 94 covers every probe. */
+#define MAX_ID_LEN 2
+
+/* "#" and a 64-bit timestamp in decimal, plus newline. */
+#define MAX_TIME_LEN 22
+
 struct context {
 	int num_enabled_probes;
 	int unitsize;
 	char *probelist[SR_MAX_NUM_PROBES + 1];
-	int *prevbits;
+	char ids[SR_MAX_NUM_PROBES][MAX_ID_LEN + 1];
+	int id_lens[SR_MAX_NUM_PROBES];
 	GString *header;
+	uint64_t mask;
 	uint64_t prevsample;
-	int period;
+	uint64_t samplecount;
+	uint64_t period;
 	uint64_t samplerate;
+	char *buf;
+	size_t bufsize;
 };
 
+/*
+ * Build the identifier for a probe: the printable characters '!' to '~'
+ * as digits, single characters first, then two of them.
+ */
+static int make_id(char *id, int index)
+{
+	int len;
+
+	if (index < 94) {
+		id[0] = '!' + index;
+		len = 1;
+	} else {
+		index -= 94;
+		id[0] = '!' + index / 94;
+		id[1] = '!' + index % 94;
+		len = 2;
+	}
+	id[len] = '\0';
+
+	return len;
+}
+
+/* Index of the lowest set bit, value must not be zero. */
+static int ctz64(uint64_t value)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(value);
+#else
+	int bit;
+
+	for (bit = 0; !(value & 1); bit++)
+		value >>= 1;
+
+	return bit;
+#endif
+}
+
 static const char *vcd_header_comment = "\
 $comment\n  Acquisition with %d/%d probes at %s\n$end\n";
 
@@ -63,13 +111,15 @@ static int init(struct sr_output *o)
 			continue;
 		ctx->probelist[ctx->num_enabled_probes++] = probe->name;
 	}
-	if (ctx->num_enabled_probes > 94) {
-		sr_err("vcd out: VCD only supports 94 probes.");
-		return SR_ERR;
-	}
 
 	ctx->probelist[ctx->num_enabled_probes] = 0;
 	ctx->unitsize = (ctx->num_enabled_probes + 7) / 8;
+	if (ctx->num_enabled_probes == 64)
+		ctx->mask = G_MAXUINT64;
+	else
+		ctx->mask = (1ULL << ctx->num_enabled_probes) - 1;
+	for (i = 0; i < ctx->num_enabled_probes; i++)
+		ctx->id_lens[i] = make_id(ctx->ids[i], i);
 	ctx->header = g_string_sized_new(512);
 	num_probes = g_slist_length(o->dev->probes);
 
@@ -118,23 +168,24 @@ static int init(struct sr_output *o)
 
 	/* Wires / channels */
 	for (i = 0; i < ctx->num_enabled_probes; i++) {
-		g_string_append_printf(ctx->header, "$var wire 1 %c %s $end\n",
-				(char)('!' + i), ctx->probelist[i]);
+		g_string_append_printf(ctx->header, "$var wire 1 %s %s $end\n",
+				ctx->ids[i], ctx->probelist[i]);
 	}
 
 	g_string_append(ctx->header, "$upscope $end\n"
-			"$enddefinitions $end\n$dumpvars\n");
-
-	if (!(ctx->prevbits = g_try_malloc0(sizeof(int) * num_probes))) {
-		g_string_free(ctx->header, TRUE);
-		g_free(ctx);
-		sr_err("vcd out: %s: ctx->prevbits malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+			"$enddefinitions $end\n");
 
 	return SR_OK;
 }
 
+static void context_free(struct context *ctx)
+{
+	if (ctx->header)
+		g_string_free(ctx->header, TRUE);
+	g_free(ctx->buf);
+	g_free(ctx);
+}
+
 static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		 uint64_t *length_out)
 {
@@ -145,7 +196,7 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 		outbuf = (uint8_t *)g_strdup("$dumpoff\n$end\n");
 		*data_out = outbuf;
 		*length_out = strlen((const char *)outbuf);
-		g_free(o->internal);
+		context_free(o->internal);
 		o->internal = NULL;
 		break;
 	default:
@@ -157,59 +208,136 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 	return SR_OK;
 }
 
+/* Write a number in decimal, returning the end of it. */
+static char *put_u64(char *p, uint64_t value)
+{
+	char digits[20];
+	int n;
+
+	n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	while (n > 0)
+		*p++ = digits[--n];
+
+	return p;
+}
+
+/* The time of a sample, in timescale units, without overflowing. */
+static uint64_t sample_time(const struct context *ctx, uint64_t samplenum)
+{
+	if (!ctx->samplerate)
+		return samplenum;
+
+	return (samplenum / ctx->samplerate) * ctx->period
+	       + (samplenum % ctx->samplerate) * ctx->period / ctx->samplerate;
+}
+
+/* Make sure the output buffer holds at least size bytes. */
+static int buf_reserve(struct context *ctx, size_t size)
+{
+	char *buf;
+	size_t bufsize;
+
+	if (size <= ctx->bufsize)
+		return SR_OK;
+
+	bufsize = MAX(size, ctx->bufsize * 2);
+	if (!(buf = g_try_realloc(ctx->buf, bufsize))) {
+		sr_err("vcd out: %s: buf realloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->buf = buf;
+	ctx->bufsize = bufsize;
+
+	return SR_OK;
+}
+
 static int data(struct sr_output *o, const uint8_t *data_in,
 		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
 {
 	struct context *ctx;
-	unsigned int i;
-	int p, curbit, prevbit;
-	uint64_t sample;
-	static uint64_t samplecount = 0;
-	GString *out;
-	int first_sample = 0;
+	uint64_t sample, changed, i;
+	size_t len, max_len;
+	char *p;
+	int bit, ret;
+	gboolean first_sample;
 
 	ctx = o->internal;
-	out = g_string_sized_new(512);
+	len = 0;
+	first_sample = FALSE;
 
 	if (ctx->header) {
 		/* The header is still here, this must be the first packet. */
-		g_string_append(out, ctx->header->str);
+		if ((ret = buf_reserve(ctx, ctx->header->len)) != SR_OK)
+			return ret;
+		memcpy(ctx->buf, ctx->header->str, ctx->header->len);
+		len = ctx->header->len;
 		g_string_free(ctx->header, TRUE);
 		ctx->header = NULL;
-		first_sample = 1;
+		first_sample = TRUE;
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		samplecount++;
+	/* A timestamp, and every probe changing. */
+	max_len = MAX_TIME_LEN + strlen("$dumpvars\n$end\n")
+		  + ctx->num_enabled_probes * (MAX_ID_LEN + 2);
 
+	for (i = 0; i + ctx->unitsize <= length_in; i += ctx->unitsize) {
+		sample = 0;
 		memcpy(&sample, data_in + i, ctx->unitsize);
 
-		if (first_sample) {
-			/* First packet. We neg to make sure sample is stored. */
-			ctx->prevsample = ~sample;
-			first_sample = 0;
-		}
-
-		for (p = 0; p < ctx->num_enabled_probes; p++) {
-			curbit = (sample & ((uint64_t) (1 << p))) >> p;
-			prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
-
-			/* VCD only contains deltas/changes of signals. */
-			if (prevbit == curbit)
-				continue;
-
-			/* Output which signal changed to which value. */
-			g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
-					(uint64_t)(((float)samplecount / ctx->samplerate)
-					* ctx->period), curbit, (char)('!' + p));
+		/* VCD only contains deltas/changes of signals. */
+		if (first_sample)
+			changed = ctx->mask;
+		else
+			changed = (sample ^ ctx->prevsample) & ctx->mask;
+
+		if (changed) {
+			if ((ret = buf_reserve(ctx, len + max_len)) != SR_OK)
+				return ret;
+			p = ctx->buf + len;
+			*p++ = '#';
+			p = put_u64(p, sample_time(ctx, ctx->samplecount));
+			*p++ = '\n';
+			if (first_sample) {
+				memcpy(p, "$dumpvars\n", 10);
+				p += 10;
+			}
+
+			/* Output which signals changed to which value. */
+			while (changed) {
+				bit = ctz64(changed);
+				changed &= changed - 1;
+				*p++ = '0' + ((sample >> bit) & 1);
+				memcpy(p, ctx->ids[bit], ctx->id_lens[bit]);
+				p += ctx->id_lens[bit];
+				*p++ = '\n';
+			}
+
+			if (first_sample) {
+				memcpy(p, "$end\n", 5);
+				p += 5;
+				first_sample = FALSE;
+			}
+			len = p - ctx->buf;
 		}
 
 		ctx->prevsample = sample;
+		ctx->samplecount++;
 	}
 
-	*data_out = (uint8_t *)out->str;
-	*length_out = out->len;
-	g_string_free(out, FALSE);
+	*data_out = NULL;
+	*length_out = 0;
+	if (!len)
+		return SR_OK;
+
+	/* The caller frees the output, so hand the buffer over. */
+	*data_out = (uint8_t *)ctx->buf;
+	*length_out = len;
+	ctx->buf = NULL;
+	ctx->bufsize = 0;
 
 	return SR_OK;
 }
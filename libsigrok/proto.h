@@ -39,11 +39,45 @@ SR_API char *sr_log_logdomain_get(void);
 
 /*--- datastore.c -----------------------------------------------------------*/
 
-SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds);
+SR_API int sr_datastore_new(int unitsize, uint64_t chunksize,
+			    struct sr_datastore **ds);
 SR_API int sr_datastore_destroy(struct sr_datastore *ds);
+SR_API int sr_datastore_backing_file_set(struct sr_datastore *ds,
+					 const char *filename,
+					 uint64_t max_resident);
+SR_API int sr_datastore_rle_set(struct sr_datastore *ds, gboolean rle);
+SR_API int sr_datastore_bitplanes_set(struct sr_datastore *ds,
+				      gboolean bitplanes);
+SR_API int sr_datastore_hugepages_set(struct sr_datastore *ds,
+				      gboolean hugepages);
+SR_API int sr_datastore_pool_set(uint64_t max_size);
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 			    unsigned int length, int in_unitsize,
 			    const int *probelist);
+SR_API int sr_datastore_get_range(struct sr_datastore *ds, uint64_t start,
+				  uint64_t num_units, void *buf);
+SR_API int sr_datastore_iter_init(struct sr_datastore_iter *iter,
+				  struct sr_datastore *ds, uint64_t start,
+				  uint64_t num_units);
+SR_API int sr_datastore_iter_next(struct sr_datastore_iter *iter,
+				  const void **data, uint64_t *num_units);
+SR_API int sr_datastore_iter_next_run(struct sr_datastore_iter *iter,
+				      const void **unit, uint64_t *run_length);
+SR_API int sr_datastore_bitplane_get(struct sr_datastore *ds, int probe,
+				     uint64_t start, uint64_t num_units,
+				     uint8_t *buf);
+SR_API int sr_datastore_summary_set(struct sr_datastore *ds, gboolean summary);
+SR_API int sr_datastore_summary_get(struct sr_datastore *ds, uint64_t start,
+				    uint64_t num_units, uint64_t num_pixels,
+				    uint64_t *toggled, uint64_t *values);
+SR_API int sr_datastore_edges_set(struct sr_datastore *ds, gboolean edges);
+SR_API int sr_datastore_edge_next(struct sr_datastore *ds, int probe,
+				  uint64_t pos, uint64_t *edge);
+SR_API int sr_datastore_edge_prev(struct sr_datastore *ds, int probe,
+				  uint64_t pos, uint64_t *edge);
+SR_API int sr_datastore_edge_count(struct sr_datastore *ds, int probe,
+				   uint64_t start, uint64_t num_units,
+				   uint64_t *count);
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -68,6 +102,27 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    const int *probelist, const uint8_t *data_in,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out);
+SR_API int sr_filter_plan_new(int in_unitsize, int out_unitsize,
+			      const int *probelist,
+			      struct sr_filter_plan **plan);
+SR_API int sr_filter_plan_destroy(struct sr_filter_plan *plan);
+SR_API int sr_filter_plan_run(const struct sr_filter_plan *plan,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out);
+
+/*--- trigger.c -------------------------------------------------------------*/
+
+SR_API int sr_trigger_new(GSList *probes, uint64_t pre_trigger,
+			  sr_trigger_send_callback_t send,
+			  struct sr_trigger **trig);
+SR_API int sr_trigger_destroy(struct sr_trigger *trig);
+SR_API int sr_trigger_pre_trigger_set(struct sr_trigger *trig,
+				      uint64_t pre_trigger);
+SR_API int sr_trigger_reset(struct sr_trigger *trig);
+SR_API int sr_trigger_scan(struct sr_trigger *trig, const void *data,
+			   uint64_t length, int unitsize, uint64_t *offset);
+SR_API int sr_trigger_send(struct sr_trigger *trig, struct sr_dev *dev,
+			   struct sr_datafeed_packet *packet);
 
 /*--- hwdriver.c ------------------------------------------------------------*/
 
@@ -92,12 +147,39 @@ SR_API int sr_session_dev_add(struct sr_dev *dev);
 SR_API int sr_session_datafeed_callback_remove_all(void);
 SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb);
 
+/* Reference-counted datafeed packets */
+SR_API int sr_datafeed_packet_new(int type, uint64_t size,
+				  struct sr_datafeed_packet **packet);
+SR_API struct sr_datafeed_packet *sr_datafeed_packet_acquire(
+		const struct sr_dev *dev, struct sr_datafeed_packet *packet);
+SR_API int sr_datafeed_packet_release(struct sr_datafeed_packet *packet);
+SR_API int sr_datafeed_packet_reuse(struct sr_datafeed_packet **packet);
+
+/* Session configuration */
+SR_API int sr_session_config_set(int key, const void *value);
+SR_API int sr_session_config_get(int key, void *value);
+SR_API int sr_session_dropped_get(uint64_t *packets, uint64_t *samples);
+SR_API int sr_session_stats_callback_get(sr_datafeed_callback_t cb,
+		struct sr_datafeed_cb_stats *stats);
+SR_API int sr_session_stats_driver_get(const struct sr_dev_driver *driver,
+		struct sr_driver_stats *stats);
+SR_API int sr_session_stats_reset(void);
+SR_API int sr_session_trigger_set(struct sr_dev *dev, uint64_t pre_trigger);
+
 /* Session control */
 SR_API int sr_session_start(void);
 SR_API int sr_session_run(void);
 SR_API int sr_session_halt(void);
 SR_API int sr_session_stop(void);
 SR_API int sr_session_save(const char *filename);
+SR_API int sr_session_writer_new(const char *filename,
+		struct sr_session_writer **writer);
+SR_API int sr_session_writer_append(struct sr_session_writer *writer,
+		struct sr_dev *dev, const void *data, uint64_t length,
+		int unitsize);
+SR_API int sr_session_writer_trigger(struct sr_session_writer *writer,
+		struct sr_dev *dev);
+SR_API int sr_session_writer_finish(struct sr_session_writer *writer);
 SR_API int sr_session_source_add(int fd, int events, int timeout,
 		sr_receive_data_callback_t cb, void *cb_data);
 SR_API int sr_session_source_add_pollfd(GPollFD *pollfd, int timeout,
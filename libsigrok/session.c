@@ -21,10 +21,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <glib.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define HAVE_EPOLL 1
+#endif
+
 struct source {
 	int timeout;
 	sr_receive_data_callback_t cb;
@@ -34,12 +41,176 @@ struct source {
 	 * being polled and will be used to match the source when removing it again.
 	 */
 	gintptr poll_object;
+
+	/* The device whose acquisition thread polls this source, or NULL. */
+	struct sr_dev *dev;
+
+	/* The descriptor, and the events to poll it for. */
+	GPollFD pollfd;
+	/* Index in session->sources. */
+	unsigned int slot;
+	/* Changed whenever the slot is reused, to spot stale events. */
+	unsigned int serial;
+	gboolean active;
+	/* The event loop polling this source, or NULL. */
+	struct poller *poller;
+	/* Called on every iteration of the event loop, without waiting. */
+	gboolean always_ready;
+	/* Last time (us) the callback was called, for the timeout. */
+	gint64 last_call;
+	/* Next unused slot, while on the free list. */
+	struct source *next;
+	/* The next source added for the same poll object, if any. */
+	struct source *same_next;
+#ifdef HAVE_EPOLL
+	/* Timer for the timeout, -1 if not created yet. Kept across reuse. */
+	int timerfd;
+	/* The descriptor registered with epoll, -1 if none. A duplicate of
+	 * the source's fd if another source polls the same fd. */
+	int epoll_fd;
+#endif
+};
+
+/* Default threaded mode settings. */
+#define SESSION_CONSUMERS		1
+#define SESSION_QUEUE_LENGTH		64
+
+/* Longest an acquisition thread waits before checking for a stop request. */
+#define ACQUISITION_POLL_INTERVAL	100
+
+/* Number of epoll events handled per iteration of an event loop. */
+#define POLLER_EVENTS			32
+
+/* An event loop, polling the sources of one device or all of them. */
+struct poller {
+	/* The device whose sources are polled, NULL for all sources. */
+	struct sr_dev *dev;
+	/* Number of sources polled, and how many of them are always ready. */
+	unsigned int num_sources;
+	unsigned int num_ready;
+#ifdef HAVE_EPOLL
+	/* -1 if epoll isn't available, then g_poll() is used. */
+	int epfd;
+	struct epoll_event events[POLLER_EVENTS];
+#endif
+	/* Sources to check in this iteration, see poller_snapshot(). */
+	unsigned int *slots;
+	unsigned int *serials;
+	GPollFD *pollfds;
+	unsigned int size;
+};
+
+/* A consumer thread and its bounded packet queue. */
+struct consumer {
+	GThread *thread;
+	GMutex *mutex;
+	GCond *not_empty;
+	GCond *not_full;
+	/* Queue of struct queued_packet* */
+	GQueue *packets;
+	unsigned int max_length;
+	gboolean done;
+	/* Data packets and samples dropped from this queue. */
+	uint64_t dropped_packets;
+	uint64_t dropped_samples;
+};
+
+struct queued_packet {
+	struct sr_dev *dev;
+	struct sr_datafeed_packet *packet;
+	/* When the packet was sent, 0 if not known. */
+	gint64 sent_time;
+};
+
+struct acquisition {
+	GThread *thread;
+	struct sr_dev *dev;
+	/* TRUE once the thread has called dev_acquisition_stop(). */
+	gboolean stopped;
+};
+
+/* A reference-counted datafeed packet, see sr_datafeed_packet_new(). */
+struct ref_packet {
+	struct sr_datafeed_packet packet;
+	int refcount;
+	/* Size of the data buffer following this struct. */
+	uint64_t size;
+	union {
+		struct sr_datafeed_header header;
+		struct sr_datafeed_meta_logic meta_logic;
+		struct sr_datafeed_logic logic;
+		struct sr_datafeed_meta_analog meta_analog;
+		struct sr_datafeed_analog analog;
+		struct sr_datafeed_overrun overrun;
+	} payload;
+};
+
+/* Collects the small SR_DF_LOGIC packets of one device. */
+struct coalescer {
+	/* Reference-counted packet of session->coalesce_size bytes. */
+	struct sr_datafeed_packet *packet;
+	/* Number of bytes collected in the packet. */
+	uint64_t length;
+	uint16_t unitsize;
+	/* When the first of the collected bytes arrived. */
+	gint64 first_time;
+};
+
+G_LOCK_DEFINE_STATIC(coalescers);
+
+/* Statistics of a datafeed callback, see sr_session_stats_callback_get(). */
+struct cb_stats {
+	struct sr_datafeed_cb_stats stats;
+	/* Number of calls with a known latency. */
+	uint64_t latencies;
+	gint64 first_time;
+	gint64 last_time;
 };
 
+/* Statistics of a driver, see sr_session_stats_driver_get(). */
+struct driver_stats {
+	struct sr_driver_stats stats;
+	gint64 first_time;
+	gint64 last_time;
+};
+
+/* Protects session->triggers. */
+G_LOCK_DEFINE_STATIC(triggers);
+
+/* Protects session->cb_stats and session->driver_stats. */
+G_LOCK_DEFINE_STATIC(stats);
+
+/* Protects session->dropped_packets and session->dropped_samples. */
+G_LOCK_DEFINE_STATIC(dropped);
+
+/* All live reference-counted packets, keyed by packet. */
+static GHashTable *ref_packets = NULL;
+G_LOCK_DEFINE_STATIC(ref_packets);
+
+/*
+ * The device being started or polled by the current thread. Sources added
+ * while this is set are polled by that device's acquisition thread.
+ */
+static GStaticPrivate current_dev = G_STATIC_PRIVATE_INIT;
+
 /* There can only be one session at a time. */
 /* 'session' is not static, it's used elsewhere (via 'extern'). */
 struct sr_session *session;
 
+static int consumers_start(void);
+static void consumers_stop(void);
+static void coalescers_flush(struct sr_dev *dev, gboolean expired_only);
+static void coalescers_free(void);
+static void triggers_free(void);
+static void stats_free(void);
+static void sources_free(void);
+static void packet_data(const struct sr_dev *dev,
+			const struct sr_datafeed_packet *packet,
+			const void **data, uint64_t *size);
+static gboolean packet_samples(const struct sr_datafeed_packet *packet,
+			       uint64_t *samples);
+static void sources_remove_slot(unsigned int slot, unsigned int serial);
+
 /**
  * Create a new session.
  *
@@ -55,7 +226,11 @@ SR_API struct sr_session *sr_session_new(void)
 		return NULL; /* TODO: SR_ERR_MALLOC? */
 	}
 
-	session->source_timeout = -1;
+	session->num_consumers = SESSION_CONSUMERS;
+	session->queue_length = SESSION_QUEUE_LENGTH;
+	session->file_level = SR_FILE_LEVEL_DEFAULT;
+	session->file_threads = 1;
+	session->sources_mutex = g_mutex_new();
 
 	return session;
 }
@@ -76,6 +251,14 @@ SR_API int sr_session_destroy(void)
 
 	sr_session_dev_remove_all();
 
+	/* Consumers are left over if the session was started but not run. */
+	consumers_stop();
+	coalescers_free();
+	triggers_free();
+	stats_free();
+	sources_free();
+	g_mutex_free(session->sources_mutex);
+
 	/* TODO: Error checks needed? */
 
 	/* TODO: Loop over protocol decoders and free them. */
@@ -206,292 +389,2302 @@ SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
 }
 
 /**
- * TODO.
- */
-static int sr_session_run_poll(void)
-{
-	unsigned int i;
-	int ret;
-
-	while (session->running) {
-		ret = g_poll(session->pollfds, session->num_sources, session->source_timeout);
-
-		for (i = 0; i < session->num_sources; i++) {
-			if (session->pollfds[i].revents > 0 || (ret == 0
-				&& session->source_timeout == session->sources[i].timeout)) {
-				/*
-				 * Invoke the source's callback on an event,
-				 * or if the poll timeout out and this source
-				 * asked for that timeout.
-				 */
-				if (!session->sources[i].cb(session->pollfds[i].fd, session->pollfds[i].revents,
-						  session->sources[i].cb_data))
-					sr_session_source_remove(session->sources[i].poll_object);
-			}
-		}
-	}
-
-	return SR_OK;
-}
-
-/**
- * Start a session.
+ * Set a configuration option of the current session.
  *
- * There can only be one session at a time.
+ * In threaded mode (SR_SESSION_THREADED) every device in the session gets
+ * its own acquisition thread which polls that device's event sources, and
+ * the datafeed callbacks run in separate consumer threads which receive
+ * the packets through bounded queues. All packets of a device are handled
+ * by the same consumer thread, in the order they were sent. With more than
+ * one consumer (SR_SESSION_CONSUMERS), the datafeed callbacks may run
+ * concurrently for different devices and must be thread-safe.
  *
- * @return SR_OK upon success, SR_ERR upon errors.
+ * With SR_SESSION_COALESCE_SIZE set, consecutive SR_DF_LOGIC packets of a
+ * device are merged into blocks of up to that many bytes before they are
+ * handed to the datafeed callbacks. Any other packet (trigger, frame and
+ * end markers, etc.) first flushes the collected data, so the order of the
+ * packets is kept. SR_SESSION_COALESCE_LATENCY limits how long data is
+ * held back; this is checked whenever the device sends a packet and after
+ * its sources have been polled.
+ *
+ * SR_SESSION_QUEUE_POLICY selects what happens when a consumer's queue
+ * is full: the sending driver waits (SR_QUEUE_BLOCK, the default), or
+ * data packets are dropped (SR_QUEUE_DROP_OLDEST, SR_QUEUE_DROP_NEWEST).
+ * Dropped data is reported to the datafeed callbacks by SR_DF_OVERRUN
+ * packets, and counted, see sr_session_dropped_get().
+ *
+ * SR_SESSION_FILE_LEVEL and SR_SESSION_FILE_THREADS apply to session files
+ * created afterwards, see sr_session_writer_new(). With more than one
+ * thread, the blocks of samples are deflated in parallel. When replaying a
+ * session file, each capture in it is inflated by SR_SESSION_FILE_THREADS
+ * threads in the same way.
+ * SR_FILE_LEVEL_STORE writes the samples uncompressed.
+ *
+ * The configuration can only be changed before the session is started.
+ *
+ * @param key The option to set (SR_SESSION_THREADED, SR_SESSION_CONSUMERS,
+ *            SR_SESSION_QUEUE_LENGTH, SR_SESSION_COALESCE_SIZE,
+ *            SR_SESSION_COALESCE_LATENCY, SR_SESSION_QUEUE_POLICY,
+ *            SR_SESSION_STATS, SR_SESSION_FILE_LEVEL or
+ *            SR_SESSION_FILE_THREADS).
+ * @param value Pointer to the new value: a gboolean for SR_SESSION_THREADED
+ *              and SR_SESSION_STATS, an int for the others. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists or it has already been started.
  */
-SR_API int sr_session_start(void)
+SR_API int sr_session_config_set(int key, const void *value)
 {
-	struct sr_dev *dev;
-	GSList *l;
-	int ret;
+	int num;
 
 	if (!session) {
-		sr_err("session: %s: session was NULL; a session must be "
-		       "created first, before starting it.", __func__);
+		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	if (!session->devs) {
-		/* TODO: Actually the case? */
-		sr_err("session: %s: session->devs was NULL; a session "
-		       "cannot be started without devices.", __func__);
-		return SR_ERR_BUG;
+	if (!value) {
+		sr_err("session: %s: value was NULL", __func__);
+		return SR_ERR_ARG;
 	}
 
-	/* TODO: Check driver_index validity? */
-
-	sr_info("session: starting");
+	if (session->consumers || session->running) {
+		sr_err("session: %s: session was already started", __func__);
+		return SR_ERR_BUG;
+	}
 
-	for (l = session->devs; l; l = l->next) {
-		dev = l->data;
-		/* TODO: Check for dev != NULL. */
-		if ((ret = dev->driver->dev_acquisition_start(
-				dev->driver_index, dev)) != SR_OK) {
-			sr_err("session: %s: could not start an acquisition "
-			       "(%d)", __func__, ret);
-			break;
+	switch (key) {
+	case SR_SESSION_THREADED:
+		session->threaded = *(const gboolean *)value;
+		break;
+	case SR_SESSION_CONSUMERS:
+	case SR_SESSION_QUEUE_LENGTH:
+		if ((num = *(const int *)value) < 1) {
+			sr_err("session: %s: invalid value %d for key %d",
+			       __func__, num, key);
+			return SR_ERR_ARG;
+		}
+		if (key == SR_SESSION_CONSUMERS)
+			session->num_consumers = num;
+		else
+			session->queue_length = num;
+		break;
+	case SR_SESSION_COALESCE_SIZE:
+	case SR_SESSION_COALESCE_LATENCY:
+		if ((num = *(const int *)value) < 0) {
+			sr_err("session: %s: invalid value %d for key %d",
+			       __func__, num, key);
+			return SR_ERR_ARG;
+		}
+		if (key == SR_SESSION_COALESCE_SIZE)
+			session->coalesce_size = num;
+		else
+			session->coalesce_latency = num;
+		break;
+	case SR_SESSION_QUEUE_POLICY:
+		num = *(const int *)value;
+		if (num != SR_QUEUE_BLOCK && num != SR_QUEUE_DROP_OLDEST
+		    && num != SR_QUEUE_DROP_NEWEST) {
+			sr_err("session: %s: invalid queue policy %d",
+			       __func__, num);
+			return SR_ERR_ARG;
+		}
+		session->queue_policy = num;
+		break;
+	case SR_SESSION_STATS:
+		session->stats = *(const gboolean *)value;
+		break;
+	case SR_SESSION_FILE_LEVEL:
+		num = *(const int *)value;
+		if (num < SR_FILE_LEVEL_DEFAULT || num > 9) {
+			sr_err("session: %s: invalid session file level %d",
+			       __func__, num);
+			return SR_ERR_ARG;
 		}
+		session->file_level = num;
+		break;
+	case SR_SESSION_FILE_THREADS:
+		if ((num = *(const int *)value) < 1) {
+			sr_err("session: %s: invalid value %d for key %d",
+			       __func__, num, key);
+			return SR_ERR_ARG;
+		}
+		session->file_threads = num;
+		break;
+	default:
+		sr_err("session: %s: unknown key %d", __func__, key);
+		return SR_ERR_ARG;
 	}
 
-	/* TODO: What if there are multiple devices? Which return code? */
-
-	return ret;
+	return SR_OK;
 }
 
 /**
- * Run the session.
+ * Get a configuration option of the current session.
  *
- * TODO: Various error checks etc.
+ * @param key The option to get, see sr_session_config_set().
+ * @param value Pointer to where the value will be stored. Must not be NULL.
  *
- * @return SR_OK upon success, SR_ERR_BUG upon errors.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists.
  */
-SR_API int sr_session_run(void)
+SR_API int sr_session_config_get(int key, void *value)
 {
 	if (!session) {
-		sr_err("session: %s: session was NULL; a session must be "
-		       "created first, before running it.", __func__);
+		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	if (!session->devs) {
-		/* TODO: Actually the case? */
-		sr_err("session: %s: session->devs was NULL; a session "
-		       "cannot be run without devices.", __func__);
-		return SR_ERR_BUG;
+	if (!value) {
+		sr_err("session: %s: value was NULL", __func__);
+		return SR_ERR_ARG;
 	}
 
-	sr_info("session: running");
-	session->running = TRUE;
-
-	/* Do we have real sources? */
-	if (session->num_sources == 1 && session->pollfds[0].fd == -1) {
-		/* Dummy source, freewheel over it. */
-		while (session->running)
-			session->sources[0].cb(-1, 0, session->sources[0].cb_data);
-	} else {
-		/* Real sources, use g_poll() main loop. */
-		sr_session_run_poll();
+	switch (key) {
+	case SR_SESSION_THREADED:
+		*(gboolean *)value = session->threaded;
+		break;
+	case SR_SESSION_CONSUMERS:
+		*(int *)value = session->num_consumers;
+		break;
+	case SR_SESSION_QUEUE_LENGTH:
+		*(int *)value = session->queue_length;
+		break;
+	case SR_SESSION_COALESCE_SIZE:
+		*(int *)value = session->coalesce_size;
+		break;
+	case SR_SESSION_COALESCE_LATENCY:
+		*(int *)value = session->coalesce_latency;
+		break;
+	case SR_SESSION_QUEUE_POLICY:
+		*(int *)value = session->queue_policy;
+		break;
+	case SR_SESSION_STATS:
+		*(gboolean *)value = session->stats;
+		break;
+	case SR_SESSION_FILE_LEVEL:
+		*(int *)value = session->file_level;
+		break;
+	case SR_SESSION_FILE_THREADS:
+		*(int *)value = session->file_threads;
+		break;
+	default:
+		sr_err("session: %s: unknown key %d", __func__, key);
+		return SR_ERR_ARG;
 	}
 
 	return SR_OK;
 }
 
 /**
- * Halt the current session.
+ * Get the amount of data dropped because consumers couldn't keep up.
  *
- * This function is deprecated and should not be used in new code, use
- * sr_session_stop() instead. The behaviour of this function is identical to
- * sr_session_stop().
+ * Data is only dropped in threaded mode, with the SR_QUEUE_DROP_OLDEST or
+ * SR_QUEUE_DROP_NEWEST queue policy. The counters cover the lifetime of
+ * the current session.
+ *
+ * @param packets Will be set to the number of dropped data packets.
+ *                Can be NULL.
+ * @param samples Will be set to the number of samples in those packets.
+ *                Can be NULL.
  *
  * @return SR_OK upon success, SR_ERR_BUG if no session exists.
  */
-SR_API int sr_session_halt(void)
+SR_API int sr_session_dropped_get(uint64_t *packets, uint64_t *samples)
 {
-	return sr_session_stop();
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	G_LOCK(dropped);
+	if (packets)
+		*packets = session->dropped_packets;
+	if (samples)
+		*samples = session->dropped_samples;
+	G_UNLOCK(dropped);
+
+	return SR_OK;
 }
 
 /**
- * Stop the current session.
+ * Get the statistics of a datafeed callback.
  *
- * The current session is stopped immediately, with all acquisition sessions
- * being stopped and hardware drivers cleaned up.
+ * Statistics are only collected while SR_SESSION_STATS is enabled. Rates
+ * can be derived from the byte and sample counts and the elapsed (wall
+ * clock) or busy (inside the callback) time.
  *
- * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ * @param cb The datafeed callback, as passed to
+ *           sr_session_datafeed_callback_add().
+ * @param stats Will be filled with the callback's statistics, all zero if
+ *              it hasn't been called yet. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists.
  */
-SR_API int sr_session_stop(void)
+SR_API int sr_session_stats_callback_get(sr_datafeed_callback_t cb,
+		struct sr_datafeed_cb_stats *stats)
 {
-	struct sr_dev *dev;
-	GSList *l;
+	struct cb_stats *cs;
 
 	if (!session) {
 		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	sr_info("session: stopping");
-	session->running = FALSE;
-
-	for (l = session->devs; l; l = l->next) {
-		dev = l->data;
-		/* Check for dev != NULL. */
-		if (dev->driver) {
-			if (dev->driver->dev_acquisition_stop)
-				dev->driver->dev_acquisition_stop(dev->driver_index, dev);
-		}
+	if (!cb || !g_slist_find(session->datafeed_callbacks, cb)) {
+		sr_err("session: %s: cb was not registered", __func__);
+		return SR_ERR_ARG;
 	}
 
-	return SR_OK;
-}
-
-/**
- * Debug helper.
- *
- * @param packet The packet to show debugging information for.
- */
-static void datafeed_dump(struct sr_datafeed_packet *packet)
-{
-	struct sr_datafeed_logic *logic;
-	struct sr_datafeed_analog *analog;
+	if (!stats) {
+		sr_err("session: %s: stats was NULL", __func__);
+		return SR_ERR_ARG;
+	}
 
-	switch (packet->type) {
-	case SR_DF_HEADER:
-		sr_dbg("bus: received SR_DF_HEADER");
-		break;
-	case SR_DF_TRIGGER:
-		sr_dbg("bus: received SR_DF_TRIGGER");
-		break;
-	case SR_DF_META_LOGIC:
-		sr_dbg("bus: received SR_DF_META_LOGIC");
-		break;
-	case SR_DF_LOGIC:
-		logic = packet->payload;
-		/* TODO: Check for logic != NULL. */
-		sr_dbg("bus: received SR_DF_LOGIC %" PRIu64 " bytes", logic->length);
-		break;
-	case SR_DF_META_ANALOG:
-		sr_dbg("bus: received SR_DF_META_LOGIC");
-		break;
-	case SR_DF_ANALOG:
-		analog = packet->payload;
-		/* TODO: Check for analog != NULL. */
-		sr_dbg("bus: received SR_DF_ANALOG %d samples", analog->num_samples);
-		break;
-	case SR_DF_END:
-		sr_dbg("bus: received SR_DF_END");
-		break;
-	case SR_DF_FRAME_BEGIN:
-		sr_dbg("bus: received SR_DF_FRAME_BEGIN");
-		break;
-	case SR_DF_FRAME_END:
-		sr_dbg("bus: received SR_DF_FRAME_END");
-		break;
-	default:
-		sr_dbg("bus: received unknown packet type %d", packet->type);
-		break;
+	memset(stats, 0, sizeof(struct sr_datafeed_cb_stats));
+	G_LOCK(stats);
+	if (session->cb_stats && (cs = g_hash_table_lookup(session->cb_stats,
+							   cb))) {
+		*stats = cs->stats;
+		stats->elapsed = cs->last_time - cs->first_time;
 	}
+	G_UNLOCK(stats);
+
+	return SR_OK;
 }
 
 /**
- * Send a packet to whatever is listening on the datafeed bus.
+ * Get the statistics of the packets sent by a driver's devices.
  *
- * Hardware drivers use this to send a data packet to the frontend.
+ * Statistics are only collected while SR_SESSION_STATS is enabled. They
+ * describe the packets as sent by the driver, before coalescing.
  *
- * @param dev TODO.
- * @param packet The datafeed packet to send to the session bus.
+ * @param driver The driver. Must not be NULL.
+ * @param stats Will be filled with the driver's statistics, all zero if
+ *              it hasn't sent any packets. Must not be NULL.
  *
- * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists.
  */
-SR_PRIV int sr_session_send(struct sr_dev *dev,
-			    struct sr_datafeed_packet *packet)
+SR_API int sr_session_stats_driver_get(const struct sr_dev_driver *driver,
+		struct sr_driver_stats *stats)
 {
-	GSList *l;
-	sr_datafeed_callback_t cb;
+	struct driver_stats *ds;
 
-	if (!dev) {
-		sr_err("session: %s: dev was NULL", __func__);
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!driver) {
+		sr_err("session: %s: driver was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	if (!packet) {
-		sr_err("session: %s: packet was NULL", __func__);
+	if (!stats) {
+		sr_err("session: %s: stats was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	for (l = session->datafeed_callbacks; l; l = l->next) {
-		if (sr_log_loglevel_get() >= SR_LOG_DBG)
-			datafeed_dump(packet);
-		cb = l->data;
-		/* TODO: Check for cb != NULL. */
-		cb(dev, packet);
+	memset(stats, 0, sizeof(struct sr_driver_stats));
+	G_LOCK(stats);
+	if (session->driver_stats && (ds = g_hash_table_lookup(
+			session->driver_stats, driver))) {
+		*stats = ds->stats;
+		stats->elapsed = ds->last_time - ds->first_time;
 	}
+	G_UNLOCK(stats);
 
 	return SR_OK;
 }
 
-static int _sr_session_source_add(GPollFD *pollfd, int timeout,
-	sr_receive_data_callback_t cb, void *cb_data, gintptr poll_object)
+/**
+ * Clear all statistics collected in the current session.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_stats_reset(void)
 {
-	struct source *new_sources, *s;
-	GPollFD *new_pollfds;
-
-	if (!cb) {
-		sr_err("session: %s: cb was NULL", __func__);
-		return SR_ERR_ARG;
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
 	}
 
-	/* Note: cb_data can be NULL, that's not a bug. */
+	G_LOCK(stats);
+	if (session->cb_stats)
+		g_hash_table_remove_all(session->cb_stats);
+	if (session->driver_stats)
+		g_hash_table_remove_all(session->driver_stats);
+	G_UNLOCK(stats);
 
-	new_pollfds = g_try_realloc(session->pollfds, sizeof(GPollFD) * (session->num_sources + 1));
-	if (!new_pollfds) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+	return SR_OK;
+}
 
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) *
-	(session->num_sources + 1));
-	if (!new_sources) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+static void stats_free(void)
+{
+	G_LOCK(stats);
+	if (session->cb_stats)
+		g_hash_table_destroy(session->cb_stats);
+	session->cb_stats = NULL;
+	if (session->driver_stats)
+		g_hash_table_destroy(session->driver_stats);
+	session->driver_stats = NULL;
+	G_UNLOCK(stats);
+}
 
-	new_pollfds[session->num_sources] = *pollfd;
-	s = &new_sources[session->num_sources++];
-	s->timeout = timeout;
+/**
+ * Look up, or create, the statistics entry for a key.
+ * Must be called with the statistics locked.
+ *
+ * @param table The session's statistics table, created if NULL.
+ * @param key The callback or driver.
+ * @param size The size of the entry.
+ *
+ * @return The entry, or NULL upon memory allocation errors.
+ */
+static gpointer stats_get(GHashTable **table, gconstpointer key, gsize size)
+{
+	gpointer entry;
+
+	if (!*table)
+		*table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					       NULL, g_free);
+	if (!(entry = g_hash_table_lookup(*table, key))) {
+		if (!(entry = g_try_malloc0(size))) {
+			sr_err("session: %s: stats malloc failed", __func__);
+			return NULL;
+		}
+		g_hash_table_insert(*table, (gpointer)key, entry);
+	}
+
+	return entry;
+}
+
+/* Histogram bucket for a value, see SR_STATS_BUCKETS. */
+static unsigned int stats_bucket(uint64_t value)
+{
+	unsigned int bucket;
+
+	for (bucket = 0; value && bucket < SR_STATS_BUCKETS - 1; bucket++)
+		value >>= 1;
+
+	return bucket;
+}
+
+/**
+ * Account for a datafeed callback call.
+ *
+ * @param cb The callback.
+ * @param bytes The number of data bytes in the packet.
+ * @param samples The number of samples in the packet.
+ * @param sent_time When the packet was sent, 0 if not known.
+ * @param start When the callback was called.
+ */
+static void cb_stats_add(sr_datafeed_callback_t cb, uint64_t bytes,
+			 uint64_t samples, gint64 sent_time, gint64 start)
+{
+	struct cb_stats *cs;
+	struct sr_datafeed_cb_stats *s;
+	uint64_t latency;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+
+	G_LOCK(stats);
+	if (!(cs = stats_get(&session->cb_stats, cb,
+			     sizeof(struct cb_stats)))) {
+		G_UNLOCK(stats);
+		return;
+	}
+	s = &cs->stats;
+	if (s->calls++ == 0)
+		cs->first_time = start;
+	cs->last_time = now;
+	s->bytes += bytes;
+	s->samples += samples;
+	s->busy += now - start;
+
+	if (sent_time > 0) {
+		latency = now > sent_time ? now - sent_time : 0;
+		if (cs->latencies++ == 0 || latency < s->latency_min)
+			s->latency_min = latency;
+		if (latency > s->latency_max)
+			s->latency_max = latency;
+		s->latency_total += latency;
+		s->latency_hist[stats_bucket(latency)]++;
+	}
+	G_UNLOCK(stats);
+}
+
+/**
+ * Account for a packet sent by a device.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The datafeed packet.
+ * @param sent_time When the packet was sent.
+ */
+static void driver_stats_add(struct sr_dev *dev,
+			     const struct sr_datafeed_packet *packet,
+			     gint64 sent_time)
+{
+	struct driver_stats *ds;
+	struct sr_driver_stats *s;
+	const void *data;
+	uint64_t size, samples;
+
+	packet_data(dev, packet, &data, &size);
+
+	G_LOCK(stats);
+	if (!(ds = stats_get(&session->driver_stats, dev->driver,
+			     sizeof(struct driver_stats)))) {
+		G_UNLOCK(stats);
+		return;
+	}
+	s = &ds->stats;
+	if (s->packets++ == 0)
+		ds->first_time = sent_time;
+	ds->last_time = sent_time;
+
+	if (packet_samples(packet, &samples)) {
+		if (s->data_packets++ == 0 || size < s->size_min)
+			s->size_min = size;
+		if (size > s->size_max)
+			s->size_max = size;
+		s->bytes += size;
+		s->samples += samples;
+		s->size_hist[stats_bucket(size)]++;
+	}
+	G_UNLOCK(stats);
+}
+
+#ifdef HAVE_EPOLL
+/* The epoll event data for a source's descriptor or timer. */
+static uint64_t source_key(const struct source *s, gboolean timer)
+{
+	return ((uint64_t)s->serial << 32) | (s->slot << 1) | (timer ? 1 : 0);
+}
+
+/* Set a source's timer to expire in this many us, or disarm it with 0. */
+static void source_timer_set(struct source *s, gint64 usec)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = (usec % 1000000) * 1000;
+	timerfd_settime(s->timerfd, 0, &its, NULL);
+}
+#endif
+
+/*
+ * Check whether an event loop polls a source. Sources not belonging to any
+ * device are polled by the thread of the first device in the session.
+ */
+static gboolean poller_owns(const struct poller *p, const struct source *s)
+{
+	if (!p->dev)
+		return TRUE;
+	if (s->dev)
+		return s->dev == p->dev;
+
+	return session->devs && p->dev == session->devs->data;
+}
+
+/**
+ * Have an event loop poll a source. Must be called with the sources locked.
+ *
+ * Sources without a descriptor (fd -1) are always ready, unless they have a
+ * timeout: then their callback is only called when the timeout expires.
+ *
+ * @param p The event loop.
+ * @param s The source.
+ */
+static void source_register(struct poller *p, struct source *s)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+	int ret;
+#endif
+
+	s->poller = p;
+	s->always_ready = (s->pollfd.fd < 0 && s->timeout <= 0);
+	s->last_call = g_get_monotonic_time();
+	p->num_sources++;
+
+#ifdef HAVE_EPOLL
+	if (p->epfd >= 0 && s->pollfd.fd >= 0) {
+		/* The G_IO_* conditions have the same values as EPOLL*. */
+		ev.events = s->pollfd.events;
+		ev.data.u64 = source_key(s, FALSE);
+		s->epoll_fd = s->pollfd.fd;
+		ret = epoll_ctl(p->epfd, EPOLL_CTL_ADD, s->epoll_fd, &ev);
+		/* epoll takes each fd once, so if another source polls it
+		 * already (e.g. devices sharing a libusb context), register
+		 * a duplicate of it. */
+		if (ret < 0 && errno == EEXIST
+		    && (s->epoll_fd = dup(s->pollfd.fd)) >= 0)
+			ret = epoll_ctl(p->epfd, EPOLL_CTL_ADD, s->epoll_fd, &ev);
+		if (ret < 0) {
+			/* Regular files can't be waited for, but poll()
+			 * considers them always ready. */
+			if (errno == EPERM)
+				s->always_ready = TRUE;
+			else
+				sr_err("session: %s: failed to poll fd %d: %s",
+				       __func__, s->pollfd.fd, strerror(errno));
+			if (s->epoll_fd >= 0 && s->epoll_fd != s->pollfd.fd)
+				close(s->epoll_fd);
+			s->epoll_fd = -1;
+		}
+	}
+
+	if (p->epfd >= 0 && s->timeout > 0 && !s->always_ready) {
+		if (s->timerfd < 0)
+			s->timerfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.u64 = source_key(s, TRUE);
+		if (s->timerfd < 0 || epoll_ctl(p->epfd, EPOLL_CTL_ADD,
+						s->timerfd, &ev) < 0)
+			sr_err("session: %s: failed to set up the timeout: %s",
+			       __func__, strerror(errno));
+		else
+			source_timer_set(s, (gint64)s->timeout * 1000);
+	}
+#endif
+
+	if (s->always_ready)
+		p->num_ready++;
+}
+
+/* Stop polling a source. Must be called with the sources locked. */
+static void source_unregister(struct source *s)
+{
+	struct poller *p;
+
+	if (!(p = s->poller))
+		return;
+
+#ifdef HAVE_EPOLL
+	if (p->epfd >= 0) {
+		/* Fails harmlessly if the driver closed the fd already. */
+		if (s->epoll_fd >= 0) {
+			epoll_ctl(p->epfd, EPOLL_CTL_DEL, s->epoll_fd, NULL);
+			if (s->epoll_fd != s->pollfd.fd)
+				close(s->epoll_fd);
+			s->epoll_fd = -1;
+		}
+		if (s->timerfd >= 0 && s->timeout > 0) {
+			source_timer_set(s, 0);
+			epoll_ctl(p->epfd, EPOLL_CTL_DEL, s->timerfd, NULL);
+		}
+	}
+#endif
+
+	if (s->always_ready)
+		p->num_ready--;
+	p->num_sources--;
+	s->poller = NULL;
+}
+
+/**
+ * Create an event loop, and register the sources it polls.
+ *
+ * Sources added later are registered with it as well, until it is freed.
+ *
+ * @param dev The device whose sources to poll, or NULL for all sources.
+ *
+ * @return The event loop, or NULL upon memory allocation errors.
+ */
+static struct poller *poller_new(struct sr_dev *dev)
+{
+	struct poller *p;
+	struct source *s;
+	unsigned int i;
+
+	if (!(p = g_try_malloc0(sizeof(struct poller)))) {
+		sr_err("session: %s: poller malloc failed", __func__);
+		return NULL;
+	}
+	p->dev = dev;
+
+#ifdef HAVE_EPOLL
+	if ((p->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		sr_warn("session: %s: epoll unavailable (%s), using g_poll()",
+			__func__, strerror(errno));
+#endif
+
+	g_mutex_lock(session->sources_mutex);
+	session->pollers = g_slist_append(session->pollers, p);
+	for (i = 0; i < session->sources_size; i++) {
+		s = session->sources[i];
+		if (s->active && !s->poller && poller_owns(p, s))
+			source_register(p, s);
+	}
+	g_mutex_unlock(session->sources_mutex);
+
+	return p;
+}
+
+static void poller_free(struct poller *p)
+{
+	unsigned int i;
+
+	g_mutex_lock(session->sources_mutex);
+	session->pollers = g_slist_remove(session->pollers, p);
+	for (i = 0; i < session->sources_size; i++) {
+		if (session->sources[i]->poller == p)
+			source_unregister(session->sources[i]);
+	}
+	g_mutex_unlock(session->sources_mutex);
+
+#ifdef HAVE_EPOLL
+	if (p->epfd >= 0)
+		close(p->epfd);
+#endif
+	g_free(p->slots);
+	g_free(p->serials);
+	g_free(p->pollfds);
+	g_free(p);
+}
+
+/**
+ * Copy the sources polled by an event loop, so they can be polled without
+ * holding the lock.
+ *
+ * @param p The event loop.
+ * @param ready_only Only copy the sources which are always ready.
+ * @param wait The longest time (ms) to wait for events, -1 for no limit.
+ *             Lowered to the time left until the first source timeout.
+ *
+ * @return The number of sources copied.
+ */
+static unsigned int poller_snapshot(struct poller *p, gboolean ready_only,
+				    int *wait)
+{
+	struct source *s;
+	unsigned int *new_slots, *new_serials, i, num;
+	GPollFD *new_pollfds;
+	gint64 now, left;
+
+	num = 0;
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(session->sources_mutex);
+
+	if (p->size < p->num_sources) {
+		new_slots = g_try_realloc(p->slots,
+				sizeof(unsigned int) * p->num_sources);
+		if (new_slots)
+			p->slots = new_slots;
+		new_serials = g_try_realloc(p->serials,
+				sizeof(unsigned int) * p->num_sources);
+		if (new_serials)
+			p->serials = new_serials;
+		new_pollfds = g_try_realloc(p->pollfds,
+				sizeof(GPollFD) * p->num_sources);
+		if (new_pollfds)
+			p->pollfds = new_pollfds;
+		if (!new_slots || !new_serials || !new_pollfds) {
+			sr_err("session: %s: sources malloc failed", __func__);
+			goto out;
+		}
+		p->size = p->num_sources;
+	}
+
+	for (i = 0; i < session->sources_size && num < p->size; i++) {
+		s = session->sources[i];
+		if (s->poller != p || (ready_only && !s->always_ready))
+			continue;
+		p->slots[num] = i;
+		p->serials[num] = s->serial;
+		p->pollfds[num] = s->pollfd;
+		p->pollfds[num].revents = 0;
+		num++;
+
+		if (s->always_ready) {
+			*wait = 0;
+		} else if (s->timeout > 0) {
+			left = s->last_call + (gint64)s->timeout * 1000 - now;
+			left = left > 0 ? (left + 999) / 1000 : 0;
+			if (*wait < 0 || left < *wait)
+				*wait = left;
+		}
+	}
+
+out:
+	g_mutex_unlock(session->sources_mutex);
+
+	return num;
+}
+
+/**
+ * Call a source's callback, unless the source was removed meanwhile.
+ *
+ * @param p The event loop which polled the source.
+ * @param slot The source's slot.
+ * @param serial The source's serial number when it was polled.
+ * @param revents The events which occurred.
+ * @param due_only If TRUE, no event occurred: only call the callback if
+ *                 the source is always ready, or its timeout has expired.
+ */
+static void source_dispatch(struct poller *p, unsigned int slot,
+			    unsigned int serial, int revents, gboolean due_only)
+{
+	struct source *s;
+	sr_receive_data_callback_t cb;
+	void *cb_data;
+	gint64 now, left;
+	int fd;
+
+	g_mutex_lock(session->sources_mutex);
+
+	s = slot < session->sources_size ? session->sources[slot] : NULL;
+	if (!s || s->poller != p || s->serial != serial) {
+		g_mutex_unlock(session->sources_mutex);
+		return;
+	}
+
+	if (s->timeout > 0) {
+		now = g_get_monotonic_time();
+		left = s->last_call + (gint64)s->timeout * 1000 - now;
+		if (due_only && !s->always_ready && left > 0) {
+#ifdef HAVE_EPOLL
+			/* An event came in since the timer was set. */
+			if (p->epfd >= 0 && s->timerfd >= 0)
+				source_timer_set(s, left);
+#endif
+			g_mutex_unlock(session->sources_mutex);
+			return;
+		}
+		s->last_call = now;
+#ifdef HAVE_EPOLL
+		/* Events don't touch the timer, it's only set again once it
+		 * expires. That also clears its expiration count. */
+		if (due_only && p->epfd >= 0 && s->timerfd >= 0)
+			source_timer_set(s, (gint64)s->timeout * 1000);
+#endif
+	} else if (due_only && !s->always_ready) {
+		g_mutex_unlock(session->sources_mutex);
+		return;
+	}
+
+	cb = s->cb;
+	cb_data = s->cb_data;
+	fd = s->pollfd.fd;
+
+	g_mutex_unlock(session->sources_mutex);
+
+	/* Only this source goes, not others polling the same object. */
+	if (!cb(fd, revents, cb_data))
+		sources_remove_slot(slot, serial);
+}
+
+/**
+ * Wait for events, and call the callbacks of the sources they occurred on.
+ *
+ * epoll is used where available. Then each source's timeout is a separate
+ * timer, and the cost of an iteration doesn't depend on the number of
+ * sources. Otherwise all sources are passed to g_poll().
+ *
+ * @param p The event loop.
+ * @param max_wait The longest time (ms) to wait, -1 for no limit.
+ *
+ * @return TRUE if the event loop has sources left to poll, FALSE if it has
+ *         none, or upon errors.
+ */
+static gboolean poller_iterate(struct poller *p, int max_wait)
+{
+	unsigned int num, i;
+	int wait, ret;
+#ifdef HAVE_EPOLL
+	uint64_t key;
+
+	if (p->epfd >= 0) {
+		g_mutex_lock(session->sources_mutex);
+		num = p->num_sources;
+		wait = p->num_ready > 0 ? 0 : max_wait;
+		g_mutex_unlock(session->sources_mutex);
+		if (num == 0)
+			return FALSE;
+
+		ret = epoll_wait(p->epfd, p->events, POLLER_EVENTS, wait);
+		if (ret < 0 && errno != EINTR) {
+			sr_err("session: %s: epoll_wait failed: %s", __func__,
+			       strerror(errno));
+			return FALSE;
+		}
+		for (i = 0; ret > 0 && i < (unsigned int)ret; i++) {
+			key = p->events[i].data.u64;
+			if (key & 1)
+				source_dispatch(p, (key & 0xffffffff) >> 1,
+						key >> 32, 0, TRUE);
+			else
+				source_dispatch(p, (key & 0xffffffff) >> 1,
+						key >> 32, p->events[i].events,
+						FALSE);
+		}
+
+		/* Sources without anything to wait for. */
+		if (wait == 0) {
+			num = poller_snapshot(p, TRUE, &wait);
+			for (i = 0; i < num; i++)
+				source_dispatch(p, p->slots[i], p->serials[i],
+						0, TRUE);
+		}
+
+		return TRUE;
+	}
+#endif
+
+	wait = max_wait;
+	if (!(num = poller_snapshot(p, FALSE, &wait)))
+		return FALSE;
+
+	ret = g_poll(p->pollfds, num, wait);
+	if (ret < 0 && errno != EINTR) {
+		sr_err("session: %s: g_poll failed: %s", __func__,
+		       strerror(errno));
+		return FALSE;
+	}
+	for (i = 0; i < num; i++)
+		source_dispatch(p, p->slots[i], p->serials[i],
+				p->pollfds[i].revents,
+				p->pollfds[i].revents == 0);
+
+	return TRUE;
+}
+
+/**
+ * Poll all sources of the session until it is stopped, or no sources are
+ * left.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ */
+static int sr_session_run_poll(void)
+{
+	struct poller *p;
+
+	if (!(p = poller_new(NULL)))
+		return SR_ERR_MALLOC;
+
+	while (session->running && poller_iterate(p, -1))
+		coalescers_flush(NULL, TRUE);
+
+	poller_free(p);
+
+	return SR_OK;
+}
+
+static void session_dev_stop(struct sr_dev *dev)
+{
+	/* Check for dev != NULL. */
+	if (dev->driver) {
+		if (dev->driver->dev_acquisition_stop)
+			dev->driver->dev_acquisition_stop(dev->driver_index, dev);
+	}
+}
+
+/**
+ * Poll the sources of one device until the session is stopped, or the
+ * device has no sources left.
+ */
+static gpointer acquisition_thread(gpointer data)
+{
+	struct acquisition *acq;
+	struct poller *p;
+
+	acq = data;
+
+	g_static_private_set(&current_dev, acq->dev, NULL);
+
+	/* Wake up regularly to notice sr_session_stop(). */
+	if ((p = poller_new(acq->dev))) {
+		while (g_atomic_int_get(&session->running)
+		       && poller_iterate(p, ACQUISITION_POLL_INTERVAL))
+			coalescers_flush(acq->dev, TRUE);
+	}
+
+	if (!g_atomic_int_get(&session->running)) {
+		session_dev_stop(acq->dev);
+		acq->stopped = TRUE;
+	}
+	coalescers_flush(acq->dev, FALSE);
+
+	if (p)
+		poller_free(p);
+
+	return NULL;
+}
+
+/**
+ * Run the current session with one acquisition thread per device.
+ *
+ * Returns once all acquisition threads have finished, and the consumer
+ * threads have handed all queued packets to the datafeed callbacks.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR if a thread could not be created.
+ */
+static int session_run_threaded(void)
+{
+	struct acquisition *acq;
+	GSList *acquisitions, *l;
+	GError *error;
+	int ret;
+
+	ret = SR_OK;
+	acquisitions = NULL;
+	g_atomic_int_set(&session->acquiring, TRUE);
+
+	for (l = session->devs; l; l = l->next) {
+		if (!(acq = g_try_malloc0(sizeof(struct acquisition)))) {
+			sr_err("session: %s: acq malloc failed", __func__);
+			ret = SR_ERR_MALLOC;
+			break;
+		}
+		acq->dev = l->data;
+		error = NULL;
+		if (!(acq->thread = g_thread_create(acquisition_thread, acq,
+						    TRUE, &error))) {
+			sr_err("session: %s: failed to create acquisition "
+			       "thread: %s", __func__, error->message);
+			g_error_free(error);
+			g_free(acq);
+			ret = SR_ERR;
+			break;
+		}
+		acquisitions = g_slist_append(acquisitions, acq);
+	}
+
+	/* Have the threads which did start stop their devices. */
+	if (ret != SR_OK)
+		g_atomic_int_set(&session->running, FALSE);
+
+	for (l = acquisitions; l; l = l->next) {
+		acq = l->data;
+		g_thread_join(acq->thread);
+	}
+
+	consumers_stop();
+	g_atomic_int_set(&session->acquiring, FALSE);
+
+	/*
+	 * A device whose sources ran out before the session was stopped
+	 * (e.g. by a datafeed callback) still needs to be stopped.
+	 */
+	if (!g_atomic_int_get(&session->running)) {
+		for (l = acquisitions; l; l = l->next) {
+			acq = l->data;
+			if (!acq->stopped)
+				session_dev_stop(acq->dev);
+		}
+	}
+	g_slist_free_full(acquisitions, g_free);
+
+	return ret;
+}
+
+/**
+ * Start a session.
+ *
+ * There can only be one session at a time.
+ *
+ * @return SR_OK upon success, SR_ERR upon errors.
+ */
+SR_API int sr_session_start(void)
+{
+	struct sr_dev *dev;
+	GSList *l;
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL; a session must be "
+		       "created first, before starting it.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!session->devs) {
+		/* TODO: Actually the case? */
+		sr_err("session: %s: session->devs was NULL; a session "
+		       "cannot be started without devices.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	/* TODO: Check driver_index validity? */
+
+	sr_info("session: starting");
+
+	/* Drivers send the header from dev_acquisition_start() already. */
+	if (session->threaded && (ret = consumers_start()) != SR_OK)
+		return ret;
+
+	for (l = session->devs; l; l = l->next) {
+		dev = l->data;
+		/* TODO: Check for dev != NULL. */
+		g_static_private_set(&current_dev, dev, NULL);
+		ret = dev->driver->dev_acquisition_start(dev->driver_index, dev);
+		g_static_private_set(&current_dev, NULL, NULL);
+		if (ret != SR_OK) {
+			sr_err("session: %s: could not start an acquisition "
+			       "(%d)", __func__, ret);
+			break;
+		}
+	}
+
+	/* TODO: What if there are multiple devices? Which return code? */
+
+	return ret;
+}
+
+/**
+ * Run the session.
+ *
+ * TODO: Various error checks etc.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG upon errors.
+ */
+SR_API int sr_session_run(void)
+{
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL; a session must be "
+		       "created first, before running it.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!session->devs) {
+		/* TODO: Actually the case? */
+		sr_err("session: %s: session->devs was NULL; a session "
+		       "cannot be run without devices.", __func__);
+		return SR_ERR_BUG;
+	}
+
+	sr_info("session: running");
+	g_atomic_int_set(&session->running, TRUE);
+
+	if (session->threaded)
+		return session_run_threaded();
+
+	ret = sr_session_run_poll();
+	coalescers_flush(NULL, FALSE);
+
+	return ret;
+}
+
+/**
+ * Halt the current session.
+ *
+ * This function is deprecated and should not be used in new code, use
+ * sr_session_stop() instead. The behaviour of this function is identical to
+ * sr_session_stop().
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_halt(void)
+{
+	return sr_session_stop();
+}
+
+/**
+ * Stop the current session.
+ *
+ * The current session is stopped immediately, with all acquisition sessions
+ * being stopped and hardware drivers cleaned up.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_stop(void)
+{
+	struct sr_dev *dev;
+	GSList *l;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	sr_info("session: stopping");
+	g_atomic_int_set(&session->running, FALSE);
+
+	/* In threaded mode, each acquisition thread stops its own device. */
+	if (g_atomic_int_get(&session->acquiring))
+		return SR_OK;
+
+	for (l = session->devs; l; l = l->next) {
+		dev = l->data;
+		session_dev_stop(dev);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Debug helper.
+ *
+ * @param packet The packet to show debugging information for.
+ */
+static void datafeed_dump(struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_analog *analog;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_dbg("bus: received SR_DF_HEADER");
+		break;
+	case SR_DF_TRIGGER:
+		sr_dbg("bus: received SR_DF_TRIGGER");
+		break;
+	case SR_DF_META_LOGIC:
+		sr_dbg("bus: received SR_DF_META_LOGIC");
+		break;
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		/* TODO: Check for logic != NULL. */
+		sr_dbg("bus: received SR_DF_LOGIC %" PRIu64 " bytes", logic->length);
+		break;
+	case SR_DF_META_ANALOG:
+		sr_dbg("bus: received SR_DF_META_LOGIC");
+		break;
+	case SR_DF_ANALOG:
+		analog = packet->payload;
+		/* TODO: Check for analog != NULL. */
+		sr_dbg("bus: received SR_DF_ANALOG %d samples", analog->num_samples);
+		break;
+	case SR_DF_END:
+		sr_dbg("bus: received SR_DF_END");
+		break;
+	case SR_DF_FRAME_BEGIN:
+		sr_dbg("bus: received SR_DF_FRAME_BEGIN");
+		break;
+	case SR_DF_FRAME_END:
+		sr_dbg("bus: received SR_DF_FRAME_END");
+		break;
+	case SR_DF_OVERRUN:
+		sr_dbg("bus: received SR_DF_OVERRUN");
+		break;
+	default:
+		sr_dbg("bus: received unknown packet type %d", packet->type);
+		break;
+	}
+}
+
+/**
+ * Hand a packet to all datafeed callbacks of the current session.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The datafeed packet.
+ * @param sent_time When the packet was sent, 0 if not known.
+ */
+static void datafeed_dispatch(struct sr_dev *dev,
+			      struct sr_datafeed_packet *packet,
+			      gint64 sent_time)
+{
+	GSList *l;
+	sr_datafeed_callback_t cb;
+	const void *data;
+	uint64_t bytes, samples;
+	gint64 start;
+
+	bytes = samples = 0;
+	if (session->stats && packet_samples(packet, &samples))
+		packet_data(dev, packet, &data, &bytes);
+
+	for (l = session->datafeed_callbacks; l; l = l->next) {
+		if (sr_log_loglevel_get() >= SR_LOG_DBG)
+			datafeed_dump(packet);
+		cb = l->data;
+		/* TODO: Check for cb != NULL. */
+		if (!session->stats) {
+			cb(dev, packet);
+			continue;
+		}
+		start = g_get_monotonic_time();
+		cb(dev, packet);
+		cb_stats_add(cb, bytes, samples, sent_time, start);
+	}
+}
+
+/* Point the payload at the packet's data buffer again. */
+static void ref_packet_reset(struct ref_packet *rp)
+{
+	void *data;
+
+	data = rp + 1;
+	if (rp->packet.type == SR_DF_LOGIC) {
+		rp->payload.logic.length = rp->size;
+		rp->payload.logic.data = data;
+	} else if (rp->packet.type == SR_DF_ANALOG) {
+		rp->payload.analog.data = data;
+	}
+}
+
+/**
+ * Create a new reference-counted datafeed packet.
+ *
+ * SR_DF_LOGIC and SR_DF_ANALOG packets come with a data buffer of the
+ * requested size, which the payload's data pointer points to. A driver
+ * can fill the buffer directly (e.g. have USB transfers land in it), set
+ * the payload fields and send the packet. The data pointer may be moved
+ * to anywhere inside the buffer.
+ *
+ * Datafeed callbacks which want to keep a packet beyond the callback call
+ * sr_datafeed_packet_acquire(). For packets created by this function, that
+ * only takes another reference instead of copying the data.
+ *
+ * The new packet holds one reference, which the caller drops with
+ * sr_datafeed_packet_release() once it's done with the packet.
+ *
+ * @param type The packet type (SR_DF_*).
+ * @param size The data buffer size in bytes. Must be 0 for packet types
+ *             other than SR_DF_LOGIC and SR_DF_ANALOG.
+ * @param packet Will be set to the new packet. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_datafeed_packet_new(int type, uint64_t size,
+				  struct sr_datafeed_packet **packet)
+{
+	struct ref_packet *rp;
+
+	if (!packet) {
+		sr_err("session: %s: packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (size > 0 && type != SR_DF_LOGIC && type != SR_DF_ANALOG) {
+		sr_err("session: %s: packet type %d has no data", __func__,
+		       type);
+		return SR_ERR_ARG;
+	}
+
+	if (size > G_MAXSIZE - sizeof(struct ref_packet)) {
+		sr_err("session: %s: size %" PRIu64 " too large", __func__,
+		       size);
+		return SR_ERR_ARG;
+	}
+
+	if (!(rp = g_try_malloc0(sizeof(struct ref_packet) + size))) {
+		sr_err("session: %s: rp malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	rp->packet.type = type;
+	rp->refcount = 1;
+	rp->size = size;
+
+	switch (type) {
+	case SR_DF_HEADER:
+	case SR_DF_META_LOGIC:
+	case SR_DF_LOGIC:
+	case SR_DF_META_ANALOG:
+	case SR_DF_ANALOG:
+	case SR_DF_OVERRUN:
+		rp->packet.payload = &rp->payload;
+		break;
+	default:
+		/* The other packet types carry no payload. */
+		rp->packet.payload = NULL;
+		break;
+	}
+	ref_packet_reset(rp);
+
+	G_LOCK(ref_packets);
+	if (!ref_packets)
+		ref_packets = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(ref_packets, rp, rp);
+	G_UNLOCK(ref_packets);
+
+	*packet = &rp->packet;
+
+	return SR_OK;
+}
+
+/**
+ * Find the sample data of a packet.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The packet.
+ * @param data Will be set to the data, or NULL if the packet has none.
+ * @param size Will be set to the size of the data in bytes.
+ */
+static void packet_data(const struct sr_dev *dev,
+			const struct sr_datafeed_packet *packet,
+			const void **data, uint64_t *size)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_analog *analog;
+	struct sr_probe *probe;
+	const GSList *l;
+	int num_probes;
+
+	*data = NULL;
+	*size = 0;
+	if (packet->payload && packet->type == SR_DF_LOGIC) {
+		logic = packet->payload;
+		*data = logic->data;
+		*size = logic->length;
+	} else if (packet->payload && packet->type == SR_DF_ANALOG) {
+		/* Analog data holds one float per enabled probe and sample. */
+		num_probes = 0;
+		for (l = dev->probes; l; l = l->next) {
+			probe = l->data;
+			if (probe->enabled)
+				num_probes++;
+		}
+		analog = packet->payload;
+		*data = analog->data;
+		*size = (uint64_t)analog->num_samples * num_probes
+			* sizeof(float);
+	}
+}
+
+/**
+ * Copy a packet which wasn't created by sr_datafeed_packet_new().
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The packet to copy.
+ *
+ * @return The copy, holding one reference, or NULL upon errors.
+ */
+static struct sr_datafeed_packet *packet_copy(const struct sr_dev *dev,
+		const struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet *copy;
+	struct ref_packet *rp;
+	const void *data;
+	uint64_t size;
+	gsize payload_size;
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		payload_size = sizeof(struct sr_datafeed_header);
+		break;
+	case SR_DF_META_LOGIC:
+		payload_size = sizeof(struct sr_datafeed_meta_logic);
+		break;
+	case SR_DF_LOGIC:
+		payload_size = sizeof(struct sr_datafeed_logic);
+		break;
+	case SR_DF_META_ANALOG:
+		payload_size = sizeof(struct sr_datafeed_meta_analog);
+		break;
+	case SR_DF_ANALOG:
+		payload_size = sizeof(struct sr_datafeed_analog);
+		break;
+	case SR_DF_OVERRUN:
+		payload_size = sizeof(struct sr_datafeed_overrun);
+		break;
+	default:
+		payload_size = 0;
+		break;
+	}
+
+	packet_data(dev, packet, &data, &size);
+
+	if (sr_datafeed_packet_new(packet->type, size, &copy) != SR_OK)
+		return NULL;
+	rp = (struct ref_packet *)copy;
+
+	if (packet->payload && payload_size > 0) {
+		memcpy(copy->payload, packet->payload, payload_size);
+		ref_packet_reset(rp);
+		if (size > 0)
+			memcpy(rp + 1, data, size);
+	} else {
+		copy->payload = NULL;
+	}
+
+	return copy;
+}
+
+/**
+ * Keep a datafeed packet beyond the datafeed callback it was passed to.
+ *
+ * Packets created by sr_datafeed_packet_new() just get another reference.
+ * Any other packet, e.g. one on the sender's stack, is copied into a new
+ * reference-counted packet.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The packet to keep. Must not be NULL.
+ *
+ * @return The packet to use from now on, which has to be released with
+ *         sr_datafeed_packet_release(), or NULL upon errors.
+ */
+SR_API struct sr_datafeed_packet *sr_datafeed_packet_acquire(
+		const struct sr_dev *dev, struct sr_datafeed_packet *packet)
+{
+	struct ref_packet *rp;
+
+	if (!dev || !packet) {
+		sr_err("session: %s: dev or packet was NULL", __func__);
+		return NULL;
+	}
+
+	G_LOCK(ref_packets);
+	rp = ref_packets ? g_hash_table_lookup(ref_packets, packet) : NULL;
+	if (rp)
+		rp->refcount++;
+	G_UNLOCK(ref_packets);
+
+	if (rp)
+		return packet;
+
+	return packet_copy(dev, packet);
+}
+
+/**
+ * Drop a reference to a packet.
+ *
+ * The packet is freed once the last reference is gone.
+ *
+ * @param packet The packet, as returned by sr_datafeed_packet_new() or
+ *               sr_datafeed_packet_acquire().
+ *
+ * @return SR_OK upon success, SR_ERR_ARG if the packet is not
+ *         reference-counted.
+ */
+SR_API int sr_datafeed_packet_release(struct sr_datafeed_packet *packet)
+{
+	struct ref_packet *rp;
+	int refcount;
+
+	refcount = -1;
+	G_LOCK(ref_packets);
+	rp = ref_packets ? g_hash_table_lookup(ref_packets, packet) : NULL;
+	if (rp && (refcount = --rp->refcount) == 0)
+		g_hash_table_remove(ref_packets, rp);
+	G_UNLOCK(ref_packets);
+
+	if (!rp) {
+		sr_err("session: %s: packet was not reference-counted",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (refcount == 0)
+		g_free(rp);
+
+	return SR_OK;
+}
+
+/**
+ * Prepare a packet for being filled with new data.
+ *
+ * If nobody else holds a reference to the packet, its payload is reset
+ * so the data pointer and length cover the whole data buffer again.
+ * Otherwise the packet is released and replaced by a new one of the same
+ * type and size. The contents of the data buffer are not preserved.
+ *
+ * This allows drivers to keep refilling the same buffer as long as the
+ * datafeed callbacks don't keep it.
+ *
+ * @param packet Pointer to the packet, as returned by
+ *               sr_datafeed_packet_new(). Can be changed by this function,
+ *               and is set to NULL if no new packet could be allocated.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_datafeed_packet_reuse(struct sr_datafeed_packet **packet)
+{
+	struct ref_packet *rp;
+	uint64_t size;
+	int refcount, type;
+
+	if (!packet) {
+		sr_err("session: %s: packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	G_LOCK(ref_packets);
+	rp = ref_packets ? g_hash_table_lookup(ref_packets, *packet) : NULL;
+	refcount = rp ? rp->refcount : 0;
+	G_UNLOCK(ref_packets);
+
+	if (!rp) {
+		sr_err("session: %s: packet was not reference-counted",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Only the caller's reference left, nobody can take another one. */
+	if (refcount == 1) {
+		ref_packet_reset(rp);
+		return SR_OK;
+	}
+
+	type = rp->packet.type;
+	size = rp->size;
+	sr_datafeed_packet_release(*packet);
+	*packet = NULL;
+
+	return sr_datafeed_packet_new(type, size, packet);
+}
+
+static gpointer consumer_thread(gpointer data)
+{
+	struct consumer *consumer;
+	struct queued_packet *qp;
+
+	consumer = data;
+
+	g_mutex_lock(consumer->mutex);
+	while (TRUE) {
+		while (g_queue_is_empty(consumer->packets) && !consumer->done)
+			g_cond_wait(consumer->not_empty, consumer->mutex);
+		/* The queue is drained before the thread quits. */
+		if (!(qp = g_queue_pop_head(consumer->packets)))
+			break;
+		g_cond_signal(consumer->not_full);
+		g_mutex_unlock(consumer->mutex);
+
+		datafeed_dispatch(qp->dev, qp->packet, qp->sent_time);
+		sr_datafeed_packet_release(qp->packet);
+		g_free(qp);
+
+		g_mutex_lock(consumer->mutex);
+	}
+	g_mutex_unlock(consumer->mutex);
+
+	return NULL;
+}
+
+static void consumer_free(struct consumer *consumer)
+{
+	struct queued_packet *qp;
+
+	while ((qp = g_queue_pop_head(consumer->packets))) {
+		sr_datafeed_packet_release(qp->packet);
+		g_free(qp);
+	}
+	g_queue_free(consumer->packets);
+	g_cond_free(consumer->not_full);
+	g_cond_free(consumer->not_empty);
+	g_mutex_free(consumer->mutex);
+	g_free(consumer);
+}
+
+/**
+ * Wait for the consumer threads to drain their queues, and stop them.
+ *
+ * Packets sent afterwards are handed to the datafeed callbacks directly.
+ */
+static void consumers_stop(void)
+{
+	GPtrArray *consumers;
+	struct consumer *consumer;
+	unsigned int i;
+
+	if (!(consumers = session->consumers))
+		return;
+	session->consumers = NULL;
+
+	for (i = 0; i < consumers->len; i++) {
+		consumer = g_ptr_array_index(consumers, i);
+		g_mutex_lock(consumer->mutex);
+		consumer->done = TRUE;
+		g_cond_signal(consumer->not_empty);
+		g_mutex_unlock(consumer->mutex);
+		g_thread_join(consumer->thread);
+		if (consumer->dropped_packets > 0)
+			sr_warn("session: consumer %u dropped %" PRIu64
+				" packets (%" PRIu64 " samples)", i,
+				consumer->dropped_packets,
+				consumer->dropped_samples);
+		consumer_free(consumer);
+	}
+	g_ptr_array_free(consumers, TRUE);
+}
+
+/**
+ * Create the consumer threads for a threaded session.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR if a thread could not be created.
+ */
+static int consumers_start(void)
+{
+	struct consumer *consumer;
+	GError *error;
+	int i;
+
+	if (!(session->consumers = g_ptr_array_new())) {
+		sr_err("session: %s: consumers malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (i = 0; i < session->num_consumers; i++) {
+		if (!(consumer = g_try_malloc0(sizeof(struct consumer)))) {
+			sr_err("session: %s: consumer malloc failed", __func__);
+			consumers_stop();
+			return SR_ERR_MALLOC;
+		}
+		consumer->mutex = g_mutex_new();
+		consumer->not_empty = g_cond_new();
+		consumer->not_full = g_cond_new();
+		consumer->packets = g_queue_new();
+		consumer->max_length = session->queue_length;
+
+		error = NULL;
+		if (!(consumer->thread = g_thread_create(consumer_thread,
+						consumer, TRUE, &error))) {
+			sr_err("session: %s: failed to create consumer thread: "
+			       "%s", __func__, error->message);
+			g_error_free(error);
+			consumer_free(consumer);
+			consumers_stop();
+			return SR_ERR;
+		}
+		g_ptr_array_add(session->consumers, consumer);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get the number of samples in a data packet.
+ *
+ * @param packet The packet.
+ * @param samples Will be set to the number of samples.
+ *
+ * @return TRUE for SR_DF_LOGIC and SR_DF_ANALOG packets, which can be
+ *         dropped when a queue is full, FALSE for all others.
+ */
+static gboolean packet_samples(const struct sr_datafeed_packet *packet,
+			       uint64_t *samples)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_analog *analog;
+
+	*samples = 0;
+	if (!packet->payload)
+		return FALSE;
+
+	if (packet->type == SR_DF_LOGIC) {
+		logic = packet->payload;
+		if (logic->unitsize > 0)
+			*samples = logic->length / logic->unitsize;
+		return TRUE;
+	} else if (packet->type == SR_DF_ANALOG) {
+		analog = packet->payload;
+		*samples = analog->num_samples;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Account for a data packet dropped from, or not added to, a queue.
+ *
+ * The drop is reported to the datafeed callbacks by an SR_DF_OVERRUN
+ * packet in the place of the dropped one. If the packet queued right
+ * before that place is such a report for the same device already, the
+ * drop is added to it instead. Must be called with the queue locked.
+ *
+ * @param consumer The consumer whose queue was full.
+ * @param dev The device which sent the dropped packet.
+ * @param link The queue link holding the dropped packet, which the caller
+ *             still has to free, or NULL if it was not queued at all.
+ * @param samples The number of samples in the dropped packet.
+ */
+static void consumer_dropped(struct consumer *consumer, struct sr_dev *dev,
+			     GList *link, uint64_t samples)
+{
+	struct queued_packet *qp;
+	struct sr_datafeed_overrun *overrun;
+	GList *prev;
+
+	consumer->dropped_packets++;
+	consumer->dropped_samples += samples;
+
+	G_LOCK(dropped);
+	session->dropped_packets++;
+	session->dropped_samples += samples;
+	G_UNLOCK(dropped);
+
+	prev = link ? link->prev : consumer->packets->tail;
+	qp = prev ? prev->data : NULL;
+	if (qp && qp->dev == dev && qp->packet->type == SR_DF_OVERRUN) {
+		/* Nothing is queued between that report and the drop. */
+		if (link)
+			g_queue_delete_link(consumer->packets, link);
+	} else if (!(qp = g_try_malloc(sizeof(struct queued_packet)))) {
+		sr_err("session: %s: qp malloc failed", __func__);
+		if (link)
+			g_queue_delete_link(consumer->packets, link);
+		return;
+	} else {
+		qp->dev = dev;
+		qp->sent_time = 0;
+		if (sr_datafeed_packet_new(SR_DF_OVERRUN, 0,
+					   &qp->packet) != SR_OK) {
+			g_free(qp);
+			if (link)
+				g_queue_delete_link(consumer->packets, link);
+			return;
+		}
+		if (link) {
+			link->data = qp;
+		} else {
+			/* Reports go in even though the queue is full. */
+			g_queue_push_tail(consumer->packets, qp);
+			g_cond_signal(consumer->not_empty);
+		}
+	}
+
+	overrun = qp->packet->payload;
+	overrun->packets++;
+	overrun->samples += samples;
+}
+
+/**
+ * Drop the oldest data packet from a queue, to make room for a new one.
+ * Must be called with the queue locked.
+ *
+ * @param consumer The consumer whose queue is full.
+ *
+ * @return TRUE if a packet was dropped, FALSE if the queue only holds
+ *         packets which can't be dropped.
+ */
+static gboolean consumer_drop_oldest(struct consumer *consumer)
+{
+	struct queued_packet *qp;
+	GList *l;
+	uint64_t samples;
+
+	for (l = consumer->packets->head; l; l = l->next) {
+		qp = l->data;
+		if (packet_samples(qp->packet, &samples))
+			break;
+	}
+	if (!l)
+		return FALSE;
+
+	consumer_dropped(consumer, qp->dev, l, samples);
+	sr_datafeed_packet_release(qp->packet);
+	g_free(qp);
+
+	return TRUE;
+}
+
+/**
+ * Queue a packet for the consumer thread serving the sending device.
+ *
+ * All packets of a device go to the same consumer, so they are seen by
+ * the datafeed callbacks in the order they were sent. What happens when
+ * that consumer's queue is full depends on the session's queue policy:
+ * the sender waits (SR_QUEUE_BLOCK), or a data packet is dropped, either
+ * the oldest queued one (SR_QUEUE_DROP_OLDEST) or the one being sent
+ * (SR_QUEUE_DROP_NEWEST). Packets other than SR_DF_LOGIC and SR_DF_ANALOG
+ * are never dropped; with the dropping policies they are queued even if
+ * the queue is full.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The datafeed packet.
+ * @param sent_time When the packet was sent, 0 if not known.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ */
+static int consumer_push(struct sr_dev *dev,
+			 struct sr_datafeed_packet *packet, gint64 sent_time)
+{
+	struct consumer *consumer;
+	struct queued_packet *qp;
+	uint64_t samples;
+	gboolean droppable;
+	int i;
+
+	if ((i = g_slist_index(session->devs, dev)) < 0)
+		i = 0;
+	consumer = g_ptr_array_index(session->consumers,
+				     i % session->consumers->len);
+	droppable = packet_samples(packet, &samples);
+
+	g_mutex_lock(consumer->mutex);
+	while (g_queue_get_length(consumer->packets) >= consumer->max_length) {
+		if (session->queue_policy == SR_QUEUE_BLOCK) {
+			g_cond_wait(consumer->not_full, consumer->mutex);
+		} else if (!droppable) {
+			break;
+		} else if (session->queue_policy == SR_QUEUE_DROP_NEWEST) {
+			consumer_dropped(consumer, dev, NULL, samples);
+			g_mutex_unlock(consumer->mutex);
+			return SR_OK;
+		} else if (!consumer_drop_oldest(consumer)) {
+			break;
+		}
+	}
+
+	if (!(qp = g_try_malloc(sizeof(struct queued_packet)))) {
+		sr_err("session: %s: qp malloc failed", __func__);
+		g_mutex_unlock(consumer->mutex);
+		return SR_ERR_MALLOC;
+	}
+	qp->dev = dev;
+	qp->sent_time = sent_time;
+	if (!(qp->packet = sr_datafeed_packet_acquire(dev, packet))) {
+		g_free(qp);
+		g_mutex_unlock(consumer->mutex);
+		return SR_ERR_MALLOC;
+	}
+	g_queue_push_tail(consumer->packets, qp);
+	g_cond_signal(consumer->not_empty);
+	g_mutex_unlock(consumer->mutex);
+
+	return SR_OK;
+}
+
+/* Hand a packet to the datafeed callbacks, or queue it for them. */
+static int session_send(struct sr_dev *dev, struct sr_datafeed_packet *packet,
+			gint64 sent_time)
+{
+	/* In threaded mode, a consumer thread runs the callbacks. */
+	if (session->consumers)
+		return consumer_push(dev, packet, sent_time);
+
+	datafeed_dispatch(dev, packet, sent_time);
+
+	return SR_OK;
+}
+
+/* Send the data collected by a coalescer, if any. */
+static int coalescer_flush(struct sr_dev *dev, struct coalescer *c)
+{
+	struct sr_datafeed_logic *logic;
+	int ret;
+
+	if (c->length == 0)
+		return SR_OK;
+
+	logic = c->packet->payload;
+	logic->length = c->length;
+	logic->unitsize = c->unitsize;
+	c->length = 0;
+	ret = session_send(dev, c->packet, c->first_time);
+
+	/* Refill the same buffer, unless a consumer still holds it. */
+	if (sr_datafeed_packet_reuse(&c->packet) != SR_OK && ret == SR_OK)
+		ret = SR_ERR_MALLOC;
+
+	return ret;
+}
+
+static void coalescer_free(gpointer data)
+{
+	struct coalescer *c;
+
+	c = data;
+	if (c->packet)
+		sr_datafeed_packet_release(c->packet);
+	g_free(c);
+}
+
+static void coalescers_free(void)
+{
+	G_LOCK(coalescers);
+	if (session->coalescers)
+		g_hash_table_destroy(session->coalescers);
+	session->coalescers = NULL;
+	G_UNLOCK(coalescers);
+}
+
+static struct coalescer *coalescer_get(struct sr_dev *dev)
+{
+	struct coalescer *c;
+
+	G_LOCK(coalescers);
+	if (!session->coalescers)
+		session->coalescers = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, coalescer_free);
+	if (!(c = g_hash_table_lookup(session->coalescers, dev))) {
+		if ((c = g_try_malloc0(sizeof(struct coalescer))))
+			g_hash_table_insert(session->coalescers, dev, c);
+	}
+	G_UNLOCK(coalescers);
+
+	if (!c)
+		sr_err("session: %s: coalescer malloc failed", __func__);
+
+	return c;
+}
+
+/**
+ * Send the data held back for coalescing.
+ *
+ * @param dev The device whose data to send, or NULL for all devices.
+ * @param expired_only Only send data which has been held back longer than
+ *                     the configured latency.
+ */
+static void coalescers_flush(struct sr_dev *dev, gboolean expired_only)
+{
+	struct coalescer *c;
+	GList *devs, *l;
+	gint64 deadline;
+
+	if (session->coalesce_size == 0)
+		return;
+
+	if (expired_only && session->coalesce_latency == 0)
+		return;
+	deadline = g_get_monotonic_time()
+		   - (gint64)session->coalesce_latency * 1000;
+
+	devs = NULL;
+	G_LOCK(coalescers);
+	if (session->coalescers && !dev)
+		devs = g_hash_table_get_keys(session->coalescers);
+	G_UNLOCK(coalescers);
+	if (dev)
+		devs = g_list_prepend(devs, dev);
+
+	/* Coalescers aren't freed before the session is, and only the
+	 * device's own thread touches its coalescer. */
+	for (l = devs; l; l = l->next) {
+		G_LOCK(coalescers);
+		c = NULL;
+		if (session->coalescers)
+			c = g_hash_table_lookup(session->coalescers, l->data);
+		G_UNLOCK(coalescers);
+		if (!c || (expired_only && (c->length == 0
+		    || c->first_time > deadline)))
+			continue;
+		coalescer_flush(l->data, c);
+	}
+	g_list_free(devs);
+}
+
+/**
+ * Merge small SR_DF_LOGIC packets before sending them on.
+ *
+ * Any other packet first flushes the data collected so far.
+ *
+ * @param dev The device which sent the packet.
+ * @param packet The datafeed packet.
+ * @param sent_time When the packet was sent, 0 if not known.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ */
+static int coalesce(struct sr_dev *dev, struct sr_datafeed_packet *packet,
+		    gint64 sent_time)
+{
+	struct coalescer *c;
+	struct sr_datafeed_logic *logic, *buf;
+	int ret;
+
+	if (!(c = coalescer_get(dev)))
+		return session_send(dev, packet, sent_time);
+
+	if (packet->type != SR_DF_LOGIC) {
+		if ((ret = coalescer_flush(dev, c)) != SR_OK)
+			return ret;
+		return session_send(dev, packet, sent_time);
+	}
+
+	logic = packet->payload;
+	if (c->length > 0 && (logic->unitsize != c->unitsize
+	    || c->length + logic->length > (uint64_t)session->coalesce_size)) {
+		if ((ret = coalescer_flush(dev, c)) != SR_OK)
+			return ret;
+	}
+
+	/* Big enough on its own, pass it on without copying. */
+	if (logic->length >= (uint64_t)session->coalesce_size)
+		return session_send(dev, packet, sent_time);
+
+	if (!c->packet && (ret = sr_datafeed_packet_new(SR_DF_LOGIC,
+			session->coalesce_size, &c->packet)) != SR_OK)
+		return ret;
+
+	if (c->length == 0) {
+		c->unitsize = logic->unitsize;
+		c->first_time = sent_time ? sent_time : g_get_monotonic_time();
+	}
+	buf = c->packet->payload;
+	memcpy((uint8_t *)buf->data + c->length, logic->data, logic->length);
+	c->length += logic->length;
+
+	if (c->length == (uint64_t)session->coalesce_size)
+		return coalescer_flush(dev, c);
+
+	if (session->coalesce_latency > 0 && g_get_monotonic_time()
+	    - c->first_time >= (gint64)session->coalesce_latency * 1000)
+		return coalescer_flush(dev, c);
+
+	return SR_OK;
+}
+
+/* Pass on what the software triggers inserted by the session let through. */
+static int trigger_forward(struct sr_dev *dev,
+			   struct sr_datafeed_packet *packet)
+{
+	gint64 sent_time;
+
+	sent_time = session->stats ? g_get_monotonic_time() : 0;
+
+	if (session->coalesce_size > 0)
+		return coalesce(dev, packet, sent_time);
+
+	return session_send(dev, packet, sent_time);
+}
+
+static void trigger_free(gpointer data)
+{
+	sr_trigger_destroy(data);
+}
+
+static void triggers_free(void)
+{
+	G_LOCK(triggers);
+	if (session->triggers)
+		g_hash_table_destroy(session->triggers);
+	session->triggers = NULL;
+	G_UNLOCK(triggers);
+}
+
+/**
+ * Match the trigger settings of a device's probes in software.
+ *
+ * Everything the device sends then passes through a software trigger (see
+ * sr_trigger_send()) before coalescing and the datafeed callbacks. This
+ * works with any device, also those whose drivers don't support triggers.
+ * The probes' trigger settings shouldn't be passed to the driver as well.
+ *
+ * @param dev The device. The trigger settings of its probes are read now,
+ *            later changes need another call.
+ * @param pre_trigger Number of samples before the trigger to send along.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments or trigger
+ *         settings, SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG
+ *         if no session exists.
+ */
+SR_API int sr_session_trigger_set(struct sr_dev *dev, uint64_t pre_trigger)
+{
+	struct sr_trigger *trig;
+	int ret;
+
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!dev) {
+		sr_err("session: %s: dev was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if ((ret = sr_trigger_new(dev->probes, pre_trigger, trigger_forward,
+				  &trig)) != SR_OK)
+		return ret;
+
+	G_LOCK(triggers);
+	if (!session->triggers)
+		session->triggers = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, trigger_free);
+	g_hash_table_insert(session->triggers, dev, trig);
+	G_UNLOCK(triggers);
+
+	return SR_OK;
+}
+
+/**
+ * Send a packet to whatever is listening on the datafeed bus.
+ *
+ * Hardware drivers use this to send a data packet to the frontend.
+ *
+ * The packet only has to stay valid until this function returns. Packets
+ * created with sr_datafeed_packet_new() can be kept by the datafeed
+ * callbacks (or queued for a consumer thread) without copying the data.
+ *
+ * @param dev TODO.
+ * @param packet The datafeed packet to send to the session bus.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_PRIV int sr_session_send(struct sr_dev *dev,
+			    struct sr_datafeed_packet *packet)
+{
+	struct sr_trigger *trig;
+	gint64 sent_time;
+
+	if (!dev) {
+		sr_err("session: %s: dev was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!packet) {
+		sr_err("session: %s: packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	sent_time = 0;
+	if (session->stats) {
+		sent_time = g_get_monotonic_time();
+		driver_stats_add(dev, packet, sent_time);
+	}
+
+	/* Only the device's own thread uses its trigger. */
+	if (session->triggers) {
+		G_LOCK(triggers);
+		trig = g_hash_table_lookup(session->triggers, dev);
+		G_UNLOCK(triggers);
+		if (trig)
+			return sr_trigger_send(trig, dev, packet);
+	}
+
+	if (session->coalesce_size > 0)
+		return coalesce(dev, packet, sent_time);
+
+	return session_send(dev, packet, sent_time);
+}
+
+/* Return a source's slot to the free list. Must be called with the sources
+ * locked. */
+static void source_release(struct source *s)
+{
+	struct source *prev;
+
+	prev = g_hash_table_lookup(session->source_table,
+				   (gpointer)s->poll_object);
+	if (prev == s) {
+		if (s->same_next)
+			g_hash_table_insert(session->source_table,
+				(gpointer)s->poll_object, s->same_next);
+		else
+			g_hash_table_remove(session->source_table,
+					    (gpointer)s->poll_object);
+	} else {
+		while (prev && prev->same_next != s)
+			prev = prev->same_next;
+		if (prev)
+			prev->same_next = s->same_next;
+	}
+	s->same_next = NULL;
+
+	source_unregister(s);
+	s->active = FALSE;
+	s->next = session->free_sources;
+	session->free_sources = s;
+	session->num_sources--;
+}
+
+/**
+ * Grow the source table, putting the new slots on the free list.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ */
+static int sources_grow(void)
+{
+	struct source **new_sources, *s;
+	unsigned int size, i;
+
+	size = session->sources_size ? session->sources_size * 2 : 8;
+	if (!(new_sources = g_try_realloc(session->sources,
+					  sizeof(struct source *) * size))) {
+		sr_err("session: %s: new_sources malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	session->sources = new_sources;
+
+	for (i = session->sources_size; i < size; i++) {
+		if (!(s = g_try_malloc0(sizeof(struct source))))
+			break;
+		s->slot = i;
+#ifdef HAVE_EPOLL
+		s->timerfd = -1;
+		s->epoll_fd = -1;
+#endif
+		s->next = session->free_sources;
+		session->free_sources = s;
+		session->sources[i] = s;
+	}
+	session->sources_size = i;
+
+	if (!session->free_sources) {
+		sr_err("session: %s: source malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	return SR_OK;
+}
+
+static int sources_add(GPollFD *pollfd, int timeout,
+	sr_receive_data_callback_t cb, void *cb_data, gintptr poll_object)
+{
+	struct source *s, *last;
+	struct poller *p;
+	GSList *l;
+	int ret;
+
+	if (!session->source_table)
+		session->source_table = g_hash_table_new(g_direct_hash,
+							 g_direct_equal);
+
+	if (!session->free_sources && (ret = sources_grow()) != SR_OK)
+		return ret;
+
+	s = session->free_sources;
+	session->free_sources = s->next;
+	s->next = NULL;
+	s->serial++;
+	s->active = TRUE;
+	s->timeout = timeout;
 	s->cb = cb;
 	s->cb_data = cb_data;
 	s->poll_object = poll_object;
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
+	s->dev = g_static_private_get(&current_dev);
+	s->pollfd = *pollfd;
+	s->pollfd.revents = 0;
+	session->num_sources++;
+
+	/*
+	 * Several sources may poll the same object, e.g. devices sharing a
+	 * libusb context or drivers using fd -1. They are kept in the order
+	 * they were added, removing the object removes the oldest one.
+	 */
+	if ((last = g_hash_table_lookup(session->source_table,
+					(gpointer)poll_object))) {
+		while (last->same_next)
+			last = last->same_next;
+		last->same_next = s;
+	} else {
+		g_hash_table_insert(session->source_table,
+				    (gpointer)poll_object, s);
+	}
 
-	if (timeout != session->source_timeout && timeout > 0
-	    && (session->source_timeout == -1 || timeout < session->source_timeout))
-		session->source_timeout = timeout;
+	for (l = session->pollers; l; l = l->next) {
+		p = l->data;
+		if (poller_owns(p, s)) {
+			source_register(p, s);
+			break;
+		}
+	}
 
 	return SR_OK;
 }
 
+static int _sr_session_source_add(GPollFD *pollfd, int timeout,
+	sr_receive_data_callback_t cb, void *cb_data, gintptr poll_object)
+{
+	int ret;
+
+	if (!cb) {
+		sr_err("session: %s: cb was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Note: cb_data can be NULL, that's not a bug. */
+
+	g_mutex_lock(session->sources_mutex);
+	ret = sources_add(pollfd, timeout, cb, cb_data, poll_object);
+	g_mutex_unlock(session->sources_mutex);
+
+	return ret;
+}
+
 /**
  * Add a event source for a file descriptor.
  *
@@ -565,52 +2758,67 @@ SR_API int sr_session_source_add_channel(GIOChannel *channel, int events,
 	return _sr_session_source_add(&p, timeout, cb, cb_data, (gintptr)channel);
 }
 
-
-static int _sr_session_source_remove(gintptr poll_object)
+static int sources_remove(gintptr poll_object)
 {
-	struct source *new_sources;
-	GPollFD *new_pollfds;
-	unsigned int old;
+	struct source *s;
 
-	if (!session->sources || !session->num_sources) {
+	if (!session->num_sources) {
 		sr_err("session: %s: sources was NULL", __func__);
 		return SR_ERR_BUG;
 	}
 
-	for (old = 0; old < session->num_sources; old++) {
-		if (session->sources[old].poll_object == poll_object)
-			break;
-	}
-
 	/* fd not found, nothing to do */
-	if (old == session->num_sources)
+	if (!(s = g_hash_table_lookup(session->source_table,
+				      (gpointer)poll_object)))
 		return SR_OK;
 
-	session->num_sources -= 1;
+	source_release(s);
 
-	if (old != session->num_sources) {
-		memmove(&session->pollfds[old], &session->pollfds[old+1],
-			(session->num_sources - old) * sizeof(GPollFD));
-		memmove(&session->sources[old], &session->sources[old+1],
-			(session->num_sources - old) * sizeof(struct source));
-	}
+	return SR_OK;
+}
 
-	new_pollfds = g_try_realloc(session->pollfds, sizeof(GPollFD) * session->num_sources);
-	if (!new_pollfds && session->num_sources > 0) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
+/* Remove a source by its slot, unless it was removed meanwhile. */
+static void sources_remove_slot(unsigned int slot, unsigned int serial)
+{
+	struct source *s;
 
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) * session->num_sources);
-	if (!new_sources && session->num_sources > 0) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
+	g_mutex_lock(session->sources_mutex);
+	s = slot < session->sources_size ? session->sources[slot] : NULL;
+	if (s && s->active && s->serial == serial)
+		source_release(s);
+	g_mutex_unlock(session->sources_mutex);
+}
+
+/* Free the source table, once no event loop is running any more. */
+static void sources_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < session->sources_size; i++) {
+#ifdef HAVE_EPOLL
+		if (session->sources[i]->timerfd >= 0)
+			close(session->sources[i]->timerfd);
+#endif
+		g_free(session->sources[i]);
 	}
+	g_free(session->sources);
+	session->sources = NULL;
+	session->sources_size = session->num_sources = 0;
+	session->free_sources = NULL;
+	if (session->source_table)
+		g_hash_table_destroy(session->source_table);
+	session->source_table = NULL;
+}
 
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
+static int _sr_session_source_remove(gintptr poll_object)
+{
+	int ret;
 
-	return SR_OK;
+	g_mutex_lock(session->sources_mutex);
+	ret = sources_remove(poll_object);
+	g_mutex_unlock(session->sources_mutex);
+
+	return ret;
 }
 
 /*
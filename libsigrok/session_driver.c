@@ -29,21 +29,97 @@
 /* size of payloads sent across the session bus */
 #define CHUNKSIZE (512 * 1024)
 
+/* Number of chunks decompressed ahead of the one being sent. */
+#define READ_AHEAD_CHUNKS 4
+
+/* How often (ms) data is sent in real-time replay mode. */
+#define REALTIME_INTERVAL 10
+
+extern struct sr_session *session;
+
 struct session_vdev {
 	char *capturefile;
+	/* Version 2 session files only: the block index of the capture. */
+	char *indexfile;
 	struct zip *archive;
 	struct zip_file *capfile;
-	int bytes_read;
+	uint64_t bytes_read;
 	uint64_t samplerate;
 	int unitsize;
 	int num_probes;
+	/* SR_REPLAY_* */
+	uint64_t replay;
+	void *session_dev_id;
+
+	/* The range of samples to replay; no limit if limit_samples is 0. */
+	uint64_t start_sample;
+	uint64_t limit_samples;
+	/* Bytes the read-ahead thread may still read. */
+	uint64_t to_read;
+
+	/* From the block index, in version 2 session files. */
+	uint64_t block_samples;
+	uint64_t num_blocks;
+	/*
+	 * Version 2 only: the blocks (from 0) holding the replayed range.
+	 * Each is claimed by one of the readers, and queued in order.
+	 */
+	uint64_t claim_block;
+	uint64_t queue_block;
+	uint64_t end_block;
+	/* Trigger positions in the replayed range, in bytes from its start. */
+	uint64_t *triggers;
+	uint64_t num_triggers;
+	uint64_t next_trigger;
+
+	/*
+	 * Polled by the session: the read end of the wakeup pipe in
+	 * max-speed mode, no descriptor (just a timer) in real-time mode.
+	 */
+	GPollFD pollfd;
+	/* Written to by the read-ahead thread when a chunk is ready. */
+	int wakeup[2];
+
+	/* The read-ahead threads, and what they share with the session. */
+	struct replay_reader *readers;
+	int num_readers;
+	GMutex *mutex;
+	GCond *cond;
+	/* struct sr_datafeed_packet* read ahead, and empty ones to reuse. */
+	GQueue *filled;
+	GQueue *empty;
+	gboolean eof;
+	gboolean stop;
+	/* Bytes of the first filled packet sent already. */
+	uint64_t offset;
+	/* When the replay started (us), for real-time mode. */
+	gint64 start_time;
+};
+
+/*
+ * A read-ahead thread. A version 1 capture is read by a single one, the
+ * blocks of a version 2 capture are decompressed by SR_SESSION_FILE_THREADS
+ * of them, each with its own handle on the session file.
+ */
+struct replay_reader {
+	struct session_vdev *vdev;
+	struct zip *archive;
+	GThread *thread;
 };
 
 static char *sessionfile = NULL;
 static GSList *dev_insts = NULL;
+/*
+ * The number of capture files still being replayed. Frontends stop the
+ * session on the first SR_DF_END, so only the last one to finish sends it.
+ */
+static volatile gint num_replaying = 0;
 static const int hwcaps[] = {
 	SR_HWCAP_CAPTUREFILE,
 	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_REPLAY,
+	SR_HWCAP_CAPTURE_START,
+	SR_HWCAP_LIMIT_SAMPLES,
 	0,
 };
 
@@ -72,70 +148,545 @@ static struct session_vdev *get_vdev_by_index(int dev_index)
 	return vdev;
 }
 
+/* Tell the session a chunk is ready, or the end was reached. */
+static void replay_wakeup(struct session_vdev *vdev)
+{
+	char c;
+
+	c = 0;
+	if (vdev->wakeup[1] >= 0 && write(vdev->wakeup[1], &c, 1) < 0)
+		sr_dbg("session driver: %s: wakeup pipe full", __func__);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
 /**
- * TODO.
+ * Read the block index of a version 2 capture, see SESSION_INDEX_MAGIC,
+ * and keep the triggers within the range to replay.
+ */
+static int index_load(struct session_vdev *vdev)
+{
+	struct zip_stat zs;
+	struct zip_file *zf;
+	uint8_t *index;
+	uint64_t record_size, total_samples, num_triggers, trigger, i;
+	int ret;
+
+	if (zip_stat(vdev->archive, vdev->indexfile, 0, &zs) == -1
+	    || zs.size < SESSION_INDEX_HEADER_SIZE) {
+		sr_err("session driver: Failed to check index file '%s' in "
+		       "session file '%s'.", vdev->indexfile, sessionfile);
+		return SR_ERR;
+	}
+
+	if (!(index = g_try_malloc(zs.size))) {
+		sr_err("session driver: %s: index malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	ret = SR_ERR;
+	zf = NULL;
+	if (!(zf = zip_fopen(vdev->archive, vdev->indexfile, 0))
+	    || zip_fread(zf, index, zs.size) != (zip_int64_t)zs.size) {
+		sr_err("session driver: Failed to read index file '%s'.",
+		       vdev->indexfile);
+		goto out;
+	}
+
+	record_size = get_le32(index + 12);
+	vdev->block_samples = get_le64(index + 16);
+	vdev->num_blocks = get_le64(index + 24);
+	total_samples = get_le64(index + 32);
+	num_triggers = get_le64(index + 40);
+	if (memcmp(index, SESSION_INDEX_MAGIC, 4)
+	    || (int)get_le32(index + 8) != vdev->unitsize
+	    || !vdev->block_samples
+	    || zs.size < SESSION_INDEX_HEADER_SIZE
+			+ vdev->num_blocks * record_size
+			+ num_triggers * sizeof(uint64_t)) {
+		sr_err("session driver: Invalid index file '%s'.",
+		       vdev->indexfile);
+		goto out;
+	}
+
+	/* Nothing to read past the end of the capture. */
+	if (vdev->start_sample >= total_samples)
+		vdev->to_read = 0;
+	else
+		vdev->to_read = MIN(vdev->to_read, (total_samples
+				- vdev->start_sample) * vdev->unitsize);
+
+	if (num_triggers && !(vdev->triggers = g_try_malloc(num_triggers
+						* sizeof(uint64_t)))) {
+		sr_err("session driver: %s: triggers malloc failed", __func__);
+		ret = SR_ERR_MALLOC;
+		goto out;
+	}
+	vdev->num_triggers = 0;
+	for (i = 0; i < num_triggers; i++) {
+		trigger = get_le64(index + SESSION_INDEX_HEADER_SIZE
+				   + vdev->num_blocks * record_size + i * 8);
+		if (trigger < vdev->start_sample)
+			continue;
+		trigger = (trigger - vdev->start_sample) * vdev->unitsize;
+		if (trigger <= vdev->to_read)
+			vdev->triggers[vdev->num_triggers++] = trigger;
+	}
+	ret = SR_OK;
+
+out:
+	if (zf)
+		zip_fclose(zf);
+	g_free(index);
+
+	return ret;
+}
+
+/**
+ * Move to the first sample to replay in a version 1 capture. Everything
+ * before it is read and dropped.
+ */
+static int capture_seek(struct session_vdev *vdev)
+{
+	uint8_t *buf;
+	uint64_t skip;
+	zip_int64_t ret;
+
+	if (!(skip = vdev->start_sample * vdev->unitsize))
+		return SR_OK;
+
+	if (!(buf = g_try_malloc(CHUNKSIZE))) {
+		sr_err("session driver: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	while (skip > 0) {
+		ret = zip_fread(vdev->capfile, buf, MIN(skip, CHUNKSIZE));
+		if (ret <= 0)
+			break;
+		skip -= ret;
+	}
+	g_free(buf);
+
+	return SR_OK;
+}
+
+/**
+ * Decompress a version 1 capture file into a pool of packets, a few chunks
+ * ahead of the one being sent.
+ *
+ * @param data The reader.
+ */
+static gpointer read_ahead(gpointer data)
+{
+	struct session_vdev *vdev;
+	struct sr_datafeed_packet *packet;
+	struct sr_datafeed_logic *logic;
+	int ret;
+
+	vdev = ((struct replay_reader *)data)->vdev;
+
+	ret = capture_seek(vdev);
+
+	g_mutex_lock(vdev->mutex);
+	if (ret != SR_OK) {
+		vdev->eof = TRUE;
+		replay_wakeup(vdev);
+	}
+	while (!vdev->stop && !vdev->eof) {
+		if (g_queue_get_length(vdev->filled) >= READ_AHEAD_CHUNKS) {
+			g_cond_wait(vdev->cond, vdev->mutex);
+			continue;
+		}
+		packet = g_queue_pop_head(vdev->empty);
+		g_mutex_unlock(vdev->mutex);
+
+		ret = -1;
+		if (packet || sr_datafeed_packet_new(SR_DF_LOGIC, CHUNKSIZE,
+						     &packet) == SR_OK) {
+			logic = packet->payload;
+			ret = vdev->to_read ? zip_fread(vdev->capfile,
+					logic->data,
+					MIN(vdev->to_read, CHUNKSIZE)) : 0;
+		}
+
+		g_mutex_lock(vdev->mutex);
+		if (ret <= 0) {
+			/* done with this capture file */
+			if (packet)
+				g_queue_push_tail(vdev->empty, packet);
+			vdev->eof = TRUE;
+			g_cond_broadcast(vdev->cond);
+			replay_wakeup(vdev);
+			break;
+		}
+		logic->length = ret;
+		logic->unitsize = vdev->unitsize;
+		vdev->to_read -= ret;
+		g_queue_push_tail(vdev->filled, packet);
+		g_cond_broadcast(vdev->cond);
+		replay_wakeup(vdev);
+	}
+	g_mutex_unlock(vdev->mutex);
+
+	return NULL;
+}
+
+/**
+ * Decompress the part of a version 2 block which is to be replayed.
  *
- * @param fd TODO.
- * @param revents TODO.
- * @param cb_data TODO.
+ * @param reader The reader.
+ * @param block The block number, from 0.
+ * @param packets Queue to append the filled packets to.
  *
- * @return TODO.
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR upon other errors, which include a block
+ *         holding fewer samples than the index says.
+ */
+static int block_read(struct replay_reader *reader, uint64_t block,
+		      GQueue *packets)
+{
+	struct session_vdev *vdev;
+	struct sr_datafeed_packet *packet;
+	struct sr_datafeed_logic *logic;
+	struct zip_file *zf;
+	uint64_t pos, first, end, skip;
+	zip_int64_t len;
+	char *name;
+	int ret;
+
+	vdev = reader->vdev;
+	first = vdev->start_sample * vdev->unitsize;
+	pos = block * vdev->block_samples * vdev->unitsize;
+	end = MIN(first + vdev->to_read, pos + vdev->block_samples
+		  * vdev->unitsize);
+
+	name = g_strdup_printf("%s-%" PRIu64, vdev->capturefile, block + 1);
+	if (!(zf = zip_fopen(reader->archive, name, 0))) {
+		sr_err("session driver: Failed to open capture block '%s'.",
+		       name);
+		g_free(name);
+		return SR_ERR;
+	}
+
+	ret = SR_OK;
+	while (pos < end) {
+		g_mutex_lock(vdev->mutex);
+		packet = g_queue_pop_head(vdev->empty);
+		g_mutex_unlock(vdev->mutex);
+		if (!packet && (ret = sr_datafeed_packet_new(SR_DF_LOGIC,
+					CHUNKSIZE, &packet)) != SR_OK)
+			break;
+		logic = packet->payload;
+
+		len = zip_fread(zf, logic->data, MIN(end - pos, CHUNKSIZE));
+		if (len <= 0) {
+			g_mutex_lock(vdev->mutex);
+			g_queue_push_tail(vdev->empty, packet);
+			g_mutex_unlock(vdev->mutex);
+			/* A short block would shift all samples after it. */
+			sr_err("session driver: Failed to read capture "
+			       "block '%s'.", name);
+			ret = SR_ERR;
+			break;
+		}
+
+		/* Only the first block has samples before the range. */
+		skip = pos < first ? MIN(first - pos, (uint64_t)len) : 0;
+		pos += len;
+		if (skip == (uint64_t)len) {
+			g_mutex_lock(vdev->mutex);
+			g_queue_push_tail(vdev->empty, packet);
+			g_mutex_unlock(vdev->mutex);
+			continue;
+		}
+		if (skip)
+			memmove(logic->data, (uint8_t *)logic->data + skip,
+				len - skip);
+		logic->length = len - skip;
+		logic->unitsize = vdev->unitsize;
+		g_queue_push_tail(packets, packet);
+	}
+	zip_fclose(zf);
+	g_free(name);
+
+	return ret;
+}
+
+/**
+ * Decompress blocks of a version 2 capture, for as long as there are any
+ * left to claim. The readers decompress their blocks in parallel, but queue
+ * them one after the other, in order.
+ *
+ * @param data The reader.
+ */
+static gpointer read_blocks(gpointer data)
+{
+	struct replay_reader *reader;
+	struct session_vdev *vdev;
+	struct sr_datafeed_packet *packet;
+	GQueue packets;
+	uint64_t block;
+	int ret;
+
+	reader = data;
+	vdev = reader->vdev;
+	g_queue_init(&packets);
+
+	g_mutex_lock(vdev->mutex);
+	while (!vdev->stop && vdev->claim_block < vdev->end_block) {
+		if (g_queue_get_length(vdev->filled) >= READ_AHEAD_CHUNKS) {
+			g_cond_wait(vdev->cond, vdev->mutex);
+			continue;
+		}
+		block = vdev->claim_block++;
+		g_mutex_unlock(vdev->mutex);
+
+		ret = block_read(reader, block, &packets);
+
+		g_mutex_lock(vdev->mutex);
+		/* The replay ends with the last block read completely. */
+		if (ret != SR_OK)
+			vdev->end_block = MIN(vdev->end_block, block);
+		while (!vdev->stop && vdev->queue_block != block
+		       && block < vdev->end_block)
+			g_cond_wait(vdev->cond, vdev->mutex);
+
+		if (!vdev->stop && block < vdev->end_block) {
+			while ((packet = g_queue_pop_head(&packets)))
+				g_queue_push_tail(vdev->filled, packet);
+			vdev->queue_block++;
+		} else {
+			while ((packet = g_queue_pop_head(&packets)))
+				g_queue_push_tail(vdev->empty, packet);
+		}
+		if (vdev->queue_block >= vdev->end_block)
+			vdev->eof = TRUE;
+		g_cond_broadcast(vdev->cond);
+		replay_wakeup(vdev);
+	}
+	/* Also when there was nothing to replay at all. */
+	replay_wakeup(vdev);
+	g_mutex_unlock(vdev->mutex);
+
+	return NULL;
+}
+
+/* Free everything a replay has set up, except its session source. */
+static void replay_stop(struct session_vdev *vdev)
+{
+	struct sr_datafeed_packet *packet;
+	int i;
+
+	if (vdev->readers) {
+		g_mutex_lock(vdev->mutex);
+		vdev->stop = TRUE;
+		g_cond_broadcast(vdev->cond);
+		g_mutex_unlock(vdev->mutex);
+		for (i = 0; i < vdev->num_readers; i++) {
+			if (vdev->readers[i].thread)
+				g_thread_join(vdev->readers[i].thread);
+			if (vdev->readers[i].archive)
+				zip_close(vdev->readers[i].archive);
+		}
+		g_free(vdev->readers);
+		vdev->readers = NULL;
+		vdev->num_readers = 0;
+	}
+
+	if (vdev->filled) {
+		while ((packet = g_queue_pop_head(vdev->filled)))
+			sr_datafeed_packet_release(packet);
+		g_queue_free(vdev->filled);
+		vdev->filled = NULL;
+	}
+	if (vdev->empty) {
+		while ((packet = g_queue_pop_head(vdev->empty)))
+			sr_datafeed_packet_release(packet);
+		g_queue_free(vdev->empty);
+		vdev->empty = NULL;
+	}
+	if (vdev->cond) {
+		g_cond_free(vdev->cond);
+		vdev->cond = NULL;
+	}
+	if (vdev->mutex) {
+		g_mutex_free(vdev->mutex);
+		vdev->mutex = NULL;
+	}
+
+	if (vdev->wakeup[0] >= 0) {
+		close(vdev->wakeup[0]);
+		close(vdev->wakeup[1]);
+		vdev->wakeup[0] = vdev->wakeup[1] = -1;
+	}
+
+	if (vdev->capfile) {
+		zip_fclose(vdev->capfile);
+		vdev->capfile = NULL;
+	}
+	g_free(vdev->triggers);
+	vdev->triggers = NULL;
+	vdev->num_triggers = 0;
+	if (vdev->archive) {
+		zip_close(vdev->archive);
+		vdev->archive = NULL;
+	}
+}
+
+/**
+ * Number of bytes to send now, so the replay keeps up with the recorded
+ * samplerate.
+ */
+static uint64_t realtime_budget(struct session_vdev *vdev)
+{
+	gint64 elapsed;
+	uint64_t due;
+
+	if (!vdev->start_time)
+		vdev->start_time = g_get_monotonic_time();
+	elapsed = g_get_monotonic_time() - vdev->start_time;
+
+	/* Split up to avoid overflowing with long replays. */
+	due = (elapsed / 1000000) * vdev->samplerate
+	      + (elapsed % 1000000) * vdev->samplerate / 1000000;
+	due *= vdev->unitsize;
+
+	return due > vdev->bytes_read ? due - vdev->bytes_read : 0;
+}
+
+static void send_trigger(struct session_vdev *vdev)
+{
+	struct sr_datafeed_packet packet;
+
+	packet.type = SR_DF_TRIGGER;
+	packet.payload = NULL;
+	sr_session_send(vdev->session_dev_id, &packet);
+	vdev->next_trigger++;
+}
+
+/* A capture file is done, end the feed if it was the last one. */
+static void replay_end(struct session_vdev *vdev)
+{
+	struct sr_datafeed_packet packet;
+
+	if (!g_atomic_int_dec_and_test(&num_replaying))
+		return;
+
+	packet.type = SR_DF_END;
+	packet.payload = NULL;
+	sr_session_send(vdev->session_dev_id, &packet);
+}
+
+/**
+ * Send the chunks read ahead: all of them in max-speed mode, as much as is
+ * due in real-time mode.
+ *
+ * @param fd The wakeup pipe, or -1.
+ * @param revents Unused.
+ * @param cb_data The device instance.
+ *
+ * @return FALSE once the whole capture file was sent, TRUE otherwise.
  */
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct session_vdev *vdev;
-	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	GSList *l;
-	void *buf;
-	int ret, got_data;
+	struct sr_datafeed_packet *packet, part;
+	struct sr_datafeed_logic *logic, part_logic;
+	uint64_t budget, len, trigger;
+	char buf[64];
+	gboolean done;
 
 	/* Avoid compiler warnings. */
-	(void)fd;
 	(void)revents;
 
+	sdi = cb_data;
+	vdev = sdi->priv;
+
 	sr_dbg("session_driver: feed chunk");
 
-	got_data = FALSE;
-	for (l = dev_insts; l; l = l->next) {
-		sdi = l->data;
-		vdev = sdi->priv;
-		if (!vdev)
-			/* already done with this instance */
-			continue;
+	/* Clear the wakeups, the queue is checked anyway. */
+	if (fd >= 0)
+		while (read(fd, buf, sizeof(buf)) > 0);
+
+	if (vdev->replay == SR_REPLAY_REALTIME)
+		budget = realtime_budget(vdev);
+	else
+		budget = G_MAXUINT64;
+
+	g_mutex_lock(vdev->mutex);
 
-		if (!(buf = g_try_malloc(CHUNKSIZE))) {
-			sr_err("session driver: %s: buf malloc failed",
-			       __func__);
-			return FALSE; /* TODO: SR_ERR_MALLOC */
+	/* Without a wakeup pipe, wait here instead of spinning. */
+	if (fd < 0 && vdev->replay != SR_REPLAY_REALTIME) {
+		while (g_queue_is_empty(vdev->filled) && !vdev->eof)
+			g_cond_wait(vdev->cond, vdev->mutex);
+	}
+
+	while (budget > 0 && (packet = g_queue_peek_head(vdev->filled))) {
+		logic = packet->payload;
+		len = MIN(logic->length - vdev->offset, budget);
+		g_mutex_unlock(vdev->mutex);
+
+		/* Send the recorded triggers where they happened. */
+		if (vdev->next_trigger < vdev->num_triggers) {
+			trigger = vdev->triggers[vdev->next_trigger];
+			if (trigger == vdev->bytes_read) {
+				send_trigger(vdev);
+				g_mutex_lock(vdev->mutex);
+				continue;
+			}
+			len = MIN(len, trigger - vdev->bytes_read);
 		}
 
-		ret = zip_fread(vdev->capfile, buf, CHUNKSIZE);
-		if (ret > 0) {
-			got_data = TRUE;
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = ret;
-			logic.unitsize = vdev->unitsize;
-			logic.data = buf;
-			vdev->bytes_read += ret;
-			sr_session_send(cb_data, &packet);
+		if (vdev->offset == 0 && len == logic->length) {
+			/* Whole chunk, the frontend may keep it. */
+			sr_session_send(vdev->session_dev_id, packet);
 		} else {
-			/* done with this capture file */
-			zip_fclose(vdev->capfile);
-			g_free(vdev->capturefile);
-			g_free(vdev);
-			sdi->priv = NULL;
+			part_logic = *logic;
+			part_logic.length = len;
+			part_logic.data = (uint8_t *)logic->data + vdev->offset;
+			part.type = SR_DF_LOGIC;
+			part.payload = &part_logic;
+			sr_session_send(vdev->session_dev_id, &part);
 		}
-	}
 
-	if (!got_data) {
-		packet.type = SR_DF_END;
-		sr_session_send(cb_data, &packet);
+		g_mutex_lock(vdev->mutex);
+		vdev->offset += len;
+		vdev->bytes_read += len;
+		budget -= len;
+		if (vdev->offset < logic->length)
+			continue;
+		g_queue_pop_head(vdev->filled);
+		vdev->offset = 0;
+		/* Refill the same buffer, unless the frontend holds it. */
+		if (sr_datafeed_packet_reuse(&packet) == SR_OK)
+			g_queue_push_tail(vdev->empty, packet);
+		g_cond_broadcast(vdev->cond);
 	}
+	done = vdev->eof && g_queue_is_empty(vdev->filled);
+
+	g_mutex_unlock(vdev->mutex);
 
-	return TRUE;
+	if (!done)
+		return TRUE;
+
+	/* A trigger right after the last sample. */
+	while (vdev->next_trigger < vdev->num_triggers
+	       && vdev->triggers[vdev->next_trigger] <= vdev->bytes_read)
+		send_trigger(vdev);
+
+	replay_stop(vdev);
+	replay_end(vdev);
+
+	return FALSE;
 }
 
 /* driver callbacks */
@@ -160,14 +711,22 @@ static int hw_init(const char *devinfo)
  */
 static int hw_cleanup(void)
 {
+	struct sr_dev_inst *sdi;
+	struct session_vdev *vdev;
 	GSList *l;
 
-	for (l = dev_insts; l; l = l->next)
-		sr_dev_inst_free(l->data);
+	for (l = dev_insts; l; l = l->next) {
+		sdi = l->data;
+		if ((vdev = sdi->priv)) {
+			replay_stop(vdev);
+			g_free(vdev->capturefile);
+			g_free(vdev->indexfile);
+		}
+		sr_dev_inst_free(sdi);
+	}
 	g_slist_free(dev_insts);
 	dev_insts = NULL;
-
-	sr_session_source_remove(-1);
+	num_replaying = 0;
 
 	g_free(sessionfile);
 
@@ -177,16 +736,20 @@ static int hw_cleanup(void)
 static int hw_dev_open(int dev_index)
 {
 	struct sr_dev_inst *sdi;
+	struct session_vdev *vdev;
 
 	sdi = sr_dev_inst_new(dev_index, SR_ST_INITIALIZING,
 			      NULL, NULL, NULL);
 	if (!sdi)
 		return SR_ERR;
 
-	if (!(sdi->priv = g_try_malloc0(sizeof(struct session_vdev)))) {
+	if (!(vdev = g_try_malloc0(sizeof(struct session_vdev)))) {
 		sr_err("session driver: %s: sdi->priv malloc failed", __func__);
 		return SR_ERR_MALLOC;
 	}
+	vdev->replay = SR_REPLAY_MAX_SPEED;
+	vdev->wakeup[0] = vdev->wakeup[1] = -1;
+	sdi->priv = vdev;
 
 	dev_insts = g_slist_append(dev_insts, sdi);
 
@@ -251,14 +814,36 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 		sr_info("session driver: setting capturefile to %s",
 		        vdev->capturefile);
 		break;
+	case SR_HWCAP_CAPTURE_INDEXFILE:
+		g_free(vdev->indexfile);
+		vdev->indexfile = g_strdup(value);
+		break;
 	case SR_HWCAP_CAPTURE_UNITSIZE:
 		tmp_u64 = value;
 		vdev->unitsize = *tmp_u64;
 		break;
+	case SR_HWCAP_CAPTURE_START:
+		tmp_u64 = value;
+		vdev->start_sample = *tmp_u64;
+		break;
+	case SR_HWCAP_LIMIT_SAMPLES:
+		tmp_u64 = value;
+		vdev->limit_samples = *tmp_u64;
+		break;
 	case SR_HWCAP_CAPTURE_NUM_PROBES:
 		tmp_u64 = value;
 		vdev->num_probes = *tmp_u64;
 		break;
+	case SR_HWCAP_CAPTURE_REPLAY:
+		tmp_u64 = value;
+		if (*tmp_u64 != SR_REPLAY_MAX_SPEED
+		    && *tmp_u64 != SR_REPLAY_REALTIME) {
+			sr_err("session driver: %s: invalid replay mode %"
+			       PRIu64, __func__, *tmp_u64);
+			return SR_ERR_ARG;
+		}
+		vdev->replay = *tmp_u64;
+		break;
 	default:
 		sr_err("session driver: %s: unknown capability %d requested",
 		       __func__, hwcap);
@@ -268,17 +853,98 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return SR_OK;
 }
 
+/* Set up the wakeup pipe, if possible; max-speed replay spins without. */
+static void replay_pipe_open(struct session_vdev *vdev)
+{
+#ifndef _WIN32
+	if (pipe(vdev->wakeup) < 0) {
+		sr_warn("session driver: %s: pipe failed", __func__);
+		vdev->wakeup[0] = vdev->wakeup[1] = -1;
+		return;
+	}
+	fcntl(vdev->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(vdev->wakeup[1], F_SETFL, O_NONBLOCK);
+#else
+	(void)vdev;
+#endif
+}
+
+/**
+ * Start the read-ahead threads: one for a version 1 capture, as many as
+ * the session's SR_SESSION_FILE_THREADS for the blocks of a version 2
+ * capture, but no more than there are blocks to replay.
+ */
+static int readers_start(struct session_vdev *vdev)
+{
+	struct replay_reader *reader;
+	uint64_t first, end;
+	int num, ret, i;
+
+	num = 1;
+	if (vdev->indexfile) {
+		first = vdev->start_sample;
+		end = first + vdev->to_read / vdev->unitsize;
+		vdev->claim_block = first / vdev->block_samples;
+		vdev->end_block = MIN(vdev->num_blocks, end ? (end - 1)
+				/ vdev->block_samples + 1 : 0);
+		if (!vdev->to_read || vdev->claim_block >= vdev->end_block)
+			vdev->end_block = vdev->claim_block;
+		vdev->queue_block = vdev->claim_block;
+		vdev->eof = vdev->queue_block >= vdev->end_block;
+		if (session && session->file_threads > 1)
+			num = session->file_threads;
+		num = MIN((uint64_t)num, MAX(vdev->end_block
+				- vdev->claim_block, 1));
+	}
+
+	if (!(vdev->readers = g_try_malloc0(num * sizeof(*vdev->readers)))) {
+		sr_err("session driver: %s: readers malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	vdev->num_readers = num;
+
+	/* A zip archive handle can't be shared between threads. */
+	for (i = 0; i < num && vdev->indexfile; i++) {
+		reader = &vdev->readers[i];
+		reader->vdev = vdev;
+		if (!(reader->archive = zip_open(sessionfile, 0, &ret))) {
+			sr_err("session driver: Failed to open session file "
+			       "'%s': zip error %d\n", sessionfile, ret);
+			return SR_ERR;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		reader = &vdev->readers[i];
+		reader->vdev = vdev;
+		reader->thread = g_thread_create(vdev->indexfile ? read_blocks
+				: read_ahead, reader, TRUE, NULL);
+		if (!reader->thread) {
+			sr_err("session driver: %s: failed to start read-ahead "
+			       "thread", __func__);
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
 	struct zip_stat zs;
+	struct sr_dev_inst *sdi;
 	struct session_vdev *vdev;
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_packet *packet;
 	struct sr_datafeed_meta_logic meta;
-	int ret;
+	int ret, timeout;
 
-	if (!(vdev = get_vdev_by_index(dev_index)))
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
+		sr_err("session driver: %s: device instance with device "
+		       "index %d was not found", __func__, dev_index);
 		return SR_ERR;
+	}
+	vdev = sdi->priv;
 
 	sr_info("session_driver: opening archive %s file %s", sessionfile,
 		vdev->capturefile);
@@ -289,28 +955,78 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
-	if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
+	vdev->to_read = G_MAXUINT64;
+	if (vdev->limit_samples)
+		vdev->to_read = vdev->limit_samples * vdev->unitsize;
+	vdev->next_trigger = 0;
+
+	if (vdev->indexfile) {
+		/* The blocks are opened by the readers. */
+		if ((ret = index_load(vdev)) != SR_OK) {
+			replay_stop(vdev);
+			return ret;
+		}
+	} else if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
 		sr_err("session driver: Failed to check capture file '%s' in "
 		       "session file '%s'.", vdev->capturefile, sessionfile);
+		replay_stop(vdev);
 		return SR_ERR;
-	}
-
-	if (!(vdev->capfile = zip_fopen(vdev->archive, vdev->capturefile, 0))) {
+	} else if (!(vdev->capfile = zip_fopen(vdev->archive,
+					       vdev->capturefile, 0))) {
 		sr_err("session driver: Failed to open capture file '%s' in "
 		       "session file '%s'.", vdev->capturefile, sessionfile);
+		replay_stop(vdev);
 		return SR_ERR;
 	}
 
-	/* freewheeling source */
-	sr_session_source_add(-1, 0, 0, receive_data, cb_data);
+	if (vdev->replay == SR_REPLAY_REALTIME && !vdev->samplerate) {
+		sr_warn("session driver: %s: no samplerate in '%s', replaying "
+			"at maximum speed", __func__, vdev->capturefile);
+		vdev->replay = SR_REPLAY_MAX_SPEED;
+	}
+
+	vdev->session_dev_id = cb_data;
+	vdev->bytes_read = 0;
+	vdev->offset = 0;
+	vdev->start_time = 0;
+	vdev->eof = FALSE;
+	vdev->stop = FALSE;
+	vdev->mutex = g_mutex_new();
+	vdev->cond = g_cond_new();
+	vdev->filled = g_queue_new();
+	vdev->empty = g_queue_new();
+
+	/*
+	 * In max-speed mode the source fires whenever the read-ahead thread
+	 * has a chunk ready, in real-time mode on a timer. Either way the
+	 * session no longer spins on a freewheeling source.
+	 */
+	if (vdev->replay == SR_REPLAY_REALTIME) {
+		vdev->pollfd.fd = -1;
+		timeout = REALTIME_INTERVAL;
+	} else {
+		replay_pipe_open(vdev);
+		vdev->pollfd.fd = vdev->wakeup[0];
+		timeout = -1;
+	}
+	vdev->pollfd.events = G_IO_IN;
+	vdev->pollfd.revents = 0;
+
+	if ((ret = readers_start(vdev)) != SR_OK) {
+		replay_stop(vdev);
+		return ret;
+	}
 
 	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
 		sr_err("session driver: %s: packet malloc failed", __func__);
+		replay_stop(vdev);
 		return SR_ERR_MALLOC;
 	}
 
 	if (!(header = g_try_malloc(sizeof(struct sr_datafeed_header)))) {
 		sr_err("session driver: %s: header malloc failed", __func__);
+		g_free(packet);
+		replay_stop(vdev);
 		return SR_ERR_MALLOC;
 	}
 
@@ -331,6 +1047,36 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	g_free(header);
 	g_free(packet);
 
+	/* One source per capture file, removed when it's all sent. */
+	g_atomic_int_inc(&num_replaying);
+	if ((ret = sr_session_source_add_pollfd(&vdev->pollfd, timeout,
+						receive_data, sdi)) != SR_OK) {
+		replay_stop(vdev);
+		replay_end(vdev);
+		return ret;
+	}
+
+	return SR_OK;
+}
+
+static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
+{
+	struct session_vdev *vdev;
+
+	/* Avoid compiler warnings. */
+	(void)cb_data;
+
+	if (!(vdev = get_vdev_by_index(dev_index)))
+		return SR_ERR;
+
+	/* Already sent everything, and removed its source. */
+	if (!vdev->readers && !vdev->capfile)
+		return SR_OK;
+
+	sr_session_source_remove_pollfd(&vdev->pollfd);
+	replay_stop(vdev);
+	replay_end(vdev);
+
 	return SR_OK;
 }
 
@@ -347,5 +1093,5 @@ SR_PRIV struct sr_dev_driver session_driver = {
 	.hwcap_get_all = hw_hwcap_get_all,
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
-	.dev_acquisition_stop = NULL,
+	.dev_acquisition_stop = hw_dev_acquisition_stop,
 };
@@ -20,7 +20,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <zip.h>
+#include <zlib.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include "config.h"
@@ -30,6 +32,952 @@
 extern struct sr_session *session;
 extern SR_PRIV struct sr_dev_driver session_driver;
 
+/* Samples in each compressed "logic-N-B" block of a session file. */
+#define BLOCK_SAMPLES (1024 * 1024)
+
+/* ZIP record signatures and fields used by the session writer. */
+#define ZIP_LOCAL_SIG		0x04034b50
+#define ZIP_CENTRAL_SIG		0x02014b50
+#define ZIP_EOCD_SIG		0x06054b50
+#define ZIP_EOCD64_SIG		0x06064b50
+#define ZIP_LOCATOR64_SIG	0x07064b50
+#define ZIP_METHOD_STORE	0
+#define ZIP_METHOD_DEFLATE	8
+#define ZIP_VERSION		20
+#define ZIP_VERSION_ZIP64	45
+#define ZIP_MAX32		0xffffffffULL
+
+/* One member of the archive, as it goes into the central directory. */
+struct writer_entry {
+	char name[32];
+	int method;
+	uint32_t crc;
+	uint64_t comp_size;
+	uint64_t size;
+	uint64_t offset;
+};
+
+/* Summary of the samples in a block, see SESSION_INDEX_RECORD_SIZE. */
+struct block_summary {
+	uint64_t min;
+	uint64_t max;
+	uint64_t changed;
+};
+
+/* The capture of one device: its blocks, and what goes into its index. */
+struct writer_member {
+	struct sr_dev *dev;
+	/* The N in "logic-N". */
+	int index;
+	int unitsize;
+	uint64_t num_samples;
+	/* Blocks handed out for compression so far. */
+	uint64_t num_blocks;
+	/* Block being filled. */
+	uint8_t *block;
+	uint64_t block_len;
+	/* Last sample of the previous block. */
+	uint64_t last;
+	gboolean have_last;
+	/* struct block_summary per block written */
+	GArray *summaries;
+	/* Sample numbers (uint64_t) of the triggers. */
+	GArray *triggers;
+};
+
+/*
+ * A block of samples, compressed and summarized by a compression thread,
+ * or right away with a single thread.
+ */
+struct writer_job {
+	struct writer_member *m;
+	struct writer_entry *entry;
+	uint8_t *in;
+	uint64_t in_len;
+	uint8_t *out;
+	uint64_t out_len;
+	/* Last sample of the previous block, if have_prev. */
+	uint64_t prev;
+	gboolean have_prev;
+	struct block_summary summary;
+	uint32_t crc;
+	int ret;
+	gboolean done;
+};
+
+struct sr_session_writer {
+	FILE *fp;
+	/* Current write position in the archive. */
+	uint64_t pos;
+	uint16_t dostime;
+	uint16_t dosdate;
+	/* List of struct writer_entry, most recently written first. */
+	GSList *entries;
+	/* List of struct writer_member, one per device. */
+	GSList *members;
+	gboolean failed;
+	/* A deflate level, or SR_FILE_LEVEL_*. */
+	int level;
+	/* Deflate stream, only used with a single compression thread. */
+	z_stream zs;
+
+	/* Compression threads, only used with more than one. */
+	int num_threads;
+	GThread **threads;
+	/* Protects everything below. */
+	GMutex *mutex;
+	/* Signalled when a job is queued, or the threads should quit. */
+	GCond *job_cond;
+	/* Signalled when a job is done. */
+	GCond *done_cond;
+	/* Jobs not yet picked up by a compression thread. */
+	GQueue *pending;
+	/* All jobs not yet written, in the order they must be written. */
+	GQueue *inflight;
+	gboolean quit;
+};
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+static int writer_write(struct sr_session_writer *writer, const void *data,
+			size_t len)
+{
+	if (writer->failed)
+		return SR_ERR;
+
+	if (len && fwrite(data, 1, len, writer->fp) != len) {
+		sr_err("session file: write failed");
+		writer->failed = TRUE;
+		return SR_ERR;
+	}
+	writer->pos += len;
+
+	return SR_OK;
+}
+
+/** Write a member whose size and CRC are known: its header, then data. */
+static int write_member(struct sr_session_writer *writer,
+			struct writer_entry *entry, const void *data)
+{
+	uint8_t hdr[30 + sizeof(entry->name)];
+	size_t namelen;
+
+	namelen = strlen(entry->name);
+	entry->offset = writer->pos;
+	writer->entries = g_slist_prepend(writer->entries, entry);
+
+	put_le32(hdr, ZIP_LOCAL_SIG);
+	put_le16(hdr + 4, ZIP_VERSION);
+	put_le16(hdr + 6, 0);
+	put_le16(hdr + 8, entry->method);
+	put_le16(hdr + 10, writer->dostime);
+	put_le16(hdr + 12, writer->dosdate);
+	put_le32(hdr + 14, entry->crc);
+	put_le32(hdr + 18, entry->comp_size);
+	put_le32(hdr + 22, entry->size);
+	put_le16(hdr + 26, namelen);
+	put_le16(hdr + 28, 0);
+	memcpy(hdr + 30, entry->name, namelen);
+
+	if (writer_write(writer, hdr, 30 + namelen) != SR_OK)
+		return SR_ERR;
+
+	return writer_write(writer, data, entry->comp_size);
+}
+
+/** Add a member whose contents are all known up front, uncompressed. */
+static int write_stored(struct sr_session_writer *writer, const char *name,
+			const void *data, size_t len)
+{
+	struct writer_entry *entry;
+
+	if (!(entry = g_try_malloc0(sizeof(struct writer_entry)))) {
+		sr_err("session file: %s: entry malloc failed", __func__);
+		writer->failed = TRUE;
+		return SR_ERR_MALLOC;
+	}
+	g_strlcpy(entry->name, name, sizeof(entry->name));
+	entry->method = ZIP_METHOD_STORE;
+	entry->crc = crc32(0, data, len);
+	entry->comp_size = entry->size = len;
+
+	return write_member(writer, entry, data);
+}
+
+static int write_central_directory(struct sr_session_writer *writer)
+{
+	struct writer_entry *entry;
+	GSList *l;
+	uint8_t hdr[46 + sizeof(entry->name) + 28], *extra;
+	uint64_t cd_offset, cd_size, num_entries;
+	size_t namelen, extralen;
+	gboolean zip64;
+
+	writer->entries = g_slist_reverse(writer->entries);
+
+	cd_offset = writer->pos;
+	num_entries = 0;
+	for (l = writer->entries; l; l = l->next) {
+		entry = l->data;
+		namelen = strlen(entry->name);
+		extra = hdr + 46 + namelen;
+		extralen = 4;
+		if (entry->size >= ZIP_MAX32) {
+			put_le64(hdr + 46 + namelen + extralen, entry->size);
+			extralen += 8;
+		}
+		if (entry->comp_size >= ZIP_MAX32) {
+			put_le64(hdr + 46 + namelen + extralen, entry->comp_size);
+			extralen += 8;
+		}
+		if (entry->offset >= ZIP_MAX32) {
+			put_le64(hdr + 46 + namelen + extralen, entry->offset);
+			extralen += 8;
+		}
+		zip64 = extralen > 4;
+		if (zip64) {
+			put_le16(extra, 0x0001);
+			put_le16(extra + 2, extralen - 4);
+		} else {
+			extralen = 0;
+		}
+
+		put_le32(hdr, ZIP_CENTRAL_SIG);
+		/* Made by: unix. */
+		put_le16(hdr + 4, (3 << 8) | ZIP_VERSION_ZIP64);
+		put_le16(hdr + 6, zip64 ? ZIP_VERSION_ZIP64 : ZIP_VERSION);
+		put_le16(hdr + 8, 0);
+		put_le16(hdr + 10, entry->method);
+		put_le16(hdr + 12, writer->dostime);
+		put_le16(hdr + 14, writer->dosdate);
+		put_le32(hdr + 16, entry->crc);
+		put_le32(hdr + 20, MIN(entry->comp_size, ZIP_MAX32));
+		put_le32(hdr + 24, MIN(entry->size, ZIP_MAX32));
+		put_le16(hdr + 28, namelen);
+		put_le16(hdr + 30, extralen);
+		/* Comment length, disk number, internal attributes. */
+		put_le16(hdr + 32, 0);
+		put_le16(hdr + 34, 0);
+		put_le16(hdr + 36, 0);
+		/* External attributes: a regular file, mode 0644. */
+		put_le32(hdr + 38, 0100644U << 16);
+		put_le32(hdr + 42, MIN(entry->offset, ZIP_MAX32));
+		memcpy(hdr + 46, entry->name, namelen);
+		if (writer_write(writer, hdr, 46 + namelen + extralen) != SR_OK)
+			return SR_ERR;
+		num_entries++;
+	}
+	cd_size = writer->pos - cd_offset;
+
+	if (cd_offset >= ZIP_MAX32 || num_entries >= 0xffff) {
+		/* zip64 end of central directory record, and its locator. */
+		put_le32(hdr, ZIP_EOCD64_SIG);
+		put_le64(hdr + 4, 44);
+		put_le16(hdr + 12, (3 << 8) | ZIP_VERSION_ZIP64);
+		put_le16(hdr + 14, ZIP_VERSION_ZIP64);
+		put_le32(hdr + 16, 0);
+		put_le32(hdr + 20, 0);
+		put_le64(hdr + 24, num_entries);
+		put_le64(hdr + 32, num_entries);
+		put_le64(hdr + 40, cd_size);
+		put_le64(hdr + 48, cd_offset);
+		put_le32(hdr + 56, ZIP_LOCATOR64_SIG);
+		put_le32(hdr + 60, 0);
+		put_le64(hdr + 64, cd_offset + cd_size);
+		put_le32(hdr + 72, 1);
+		if (writer_write(writer, hdr, 76) != SR_OK)
+			return SR_ERR;
+	}
+
+	put_le32(hdr, ZIP_EOCD_SIG);
+	put_le16(hdr + 4, 0);
+	put_le16(hdr + 6, 0);
+	put_le16(hdr + 8, MIN(num_entries, 0xffff));
+	put_le16(hdr + 10, MIN(num_entries, 0xffff));
+	put_le32(hdr + 12, cd_size);
+	put_le32(hdr + 16, MIN(cd_offset, ZIP_MAX32));
+	put_le16(hdr + 20, 0);
+
+	return writer_write(writer, hdr, 22);
+}
+
+static void job_free(struct writer_job *job)
+{
+	g_free(job->entry);
+	g_free(job->in);
+	g_free(job->out);
+	g_free(job);
+}
+
+static void job_summarize(struct writer_job *job, int unitsize)
+{
+	const uint8_t *p;
+	uint64_t sample, prev, min, max, changed;
+	int i;
+
+	min = G_MAXUINT64;
+	max = changed = 0;
+	prev = job->have_prev ? job->prev : 0;
+	for (p = job->in; p < job->in + job->in_len; p += unitsize) {
+		sample = 0;
+		for (i = 0; i < unitsize; i++)
+			sample |= (uint64_t)p[i] << (8 * i);
+		if (p == job->in && !job->have_prev)
+			prev = sample;
+		min &= sample;
+		max |= sample;
+		changed |= sample ^ prev;
+		prev = sample;
+	}
+
+	job->summary.min = job->in_len ? min : 0;
+	job->summary.max = max;
+	job->summary.changed = changed;
+}
+
+/**
+ * Compress and summarize a block. With SR_FILE_LEVEL_STORE, zs is unused
+ * and the block is stored as it is.
+ */
+static void job_process(struct writer_job *job, int level, z_stream *zs)
+{
+	uint64_t bound;
+
+	job_summarize(job, job->m->unitsize);
+	job->crc = crc32(crc32(0, NULL, 0), job->in, job->in_len);
+	job->entry->size = job->in_len;
+
+	if (level == SR_FILE_LEVEL_STORE) {
+		job->out = job->in;
+		job->out_len = job->in_len;
+		job->in = NULL;
+		job->ret = SR_OK;
+		return;
+	}
+
+	bound = deflateBound(zs, job->in_len);
+	if (!(job->out = g_try_malloc(bound))) {
+		sr_err("session file: %s: output malloc failed", __func__);
+		job->ret = SR_ERR_MALLOC;
+		return;
+	}
+
+	zs->next_in = job->in;
+	zs->avail_in = job->in_len;
+	zs->next_out = job->out;
+	zs->avail_out = bound;
+	if (deflateReset(zs) != Z_OK || deflate(zs, Z_FINISH) != Z_STREAM_END) {
+		sr_err("session file: %s: deflate failed", __func__);
+		job->ret = SR_ERR;
+		return;
+	}
+	job->out_len = bound - zs->avail_out;
+
+	g_free(job->in);
+	job->in = NULL;
+	job->ret = SR_OK;
+}
+
+static gpointer compress_thread(gpointer data)
+{
+	struct sr_session_writer *writer;
+	struct writer_job *job;
+	z_stream zs;
+	gboolean zs_ok;
+
+	writer = data;
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs_ok = deflateInit2(&zs, writer->level, Z_DEFLATED, -MAX_WBITS, 8,
+			     Z_DEFAULT_STRATEGY) == Z_OK;
+
+	g_mutex_lock(writer->mutex);
+	while (TRUE) {
+		while (!writer->quit && g_queue_is_empty(writer->pending))
+			g_cond_wait(writer->job_cond, writer->mutex);
+		if (writer->quit)
+			break;
+		job = g_queue_pop_head(writer->pending);
+		g_mutex_unlock(writer->mutex);
+
+		if (zs_ok) {
+			job_process(job, writer->level, &zs);
+		} else {
+			sr_err("session file: %s: deflateInit2 failed",
+			       __func__);
+			job->ret = SR_ERR;
+		}
+
+		g_mutex_lock(writer->mutex);
+		job->done = TRUE;
+		g_cond_broadcast(writer->done_cond);
+	}
+	g_mutex_unlock(writer->mutex);
+
+	if (zs_ok)
+		deflateEnd(&zs);
+
+	return NULL;
+}
+
+/** Write a processed block to the archive, and keep its summary. */
+static int job_write(struct sr_session_writer *writer, struct writer_job *job)
+{
+	int ret;
+
+	if ((ret = job->ret) != SR_OK) {
+		writer->failed = TRUE;
+	} else {
+		job->entry->crc = job->crc;
+		job->entry->comp_size = job->out_len;
+		ret = write_member(writer, job->entry, job->out);
+		/* Now owned by the entry list. */
+		job->entry = NULL;
+		g_array_append_val(job->m->summaries, job->summary);
+	}
+	job_free(job);
+
+	return ret;
+}
+
+/**
+ * Write out the finished jobs at the head of the queue, and keep waiting
+ * for the jobs in order until no more than max_inflight are left.
+ */
+static int jobs_drain(struct sr_session_writer *writer,
+		      unsigned int max_inflight)
+{
+	struct writer_job *job;
+
+	if (!writer->threads)
+		return writer->failed ? SR_ERR : SR_OK;
+
+	g_mutex_lock(writer->mutex);
+	while ((job = g_queue_peek_head(writer->inflight))
+	       && (job->done
+		   || g_queue_get_length(writer->inflight) > max_inflight)) {
+		while (!job->done)
+			g_cond_wait(writer->done_cond, writer->mutex);
+		g_queue_pop_head(writer->inflight);
+		g_mutex_unlock(writer->mutex);
+		job_write(writer, job);
+		g_mutex_lock(writer->mutex);
+	}
+	g_mutex_unlock(writer->mutex);
+
+	return writer->failed ? SR_ERR : SR_OK;
+}
+
+/**
+ * Hand the member's current block to the compression threads, or compress
+ * and write it right away with a single thread.
+ */
+static int job_submit(struct sr_session_writer *writer,
+		      struct writer_member *m)
+{
+	struct writer_job *job;
+	const uint8_t *p;
+	int i;
+
+	if (!(job = g_try_malloc0(sizeof(struct writer_job)))
+	    || !(job->entry = g_try_malloc0(sizeof(struct writer_entry)))) {
+		sr_err("session file: %s: job malloc failed", __func__);
+		g_free(job);
+		writer->failed = TRUE;
+		return SR_ERR_MALLOC;
+	}
+	job->m = m;
+	job->in = m->block;
+	job->in_len = m->block_len;
+	job->prev = m->last;
+	job->have_prev = m->have_last;
+	snprintf(job->entry->name, sizeof(job->entry->name), "logic-%d-%"
+		 PRIu64, m->index, ++m->num_blocks);
+	job->entry->method = writer->level == SR_FILE_LEVEL_STORE
+			     ? ZIP_METHOD_STORE : ZIP_METHOD_DEFLATE;
+
+	/* The next block's changes are relative to this block's end. */
+	p = m->block + m->block_len - m->unitsize;
+	m->last = 0;
+	for (i = 0; i < m->unitsize; i++)
+		m->last |= (uint64_t)p[i] << (8 * i);
+	m->have_last = TRUE;
+	m->block = NULL;
+	m->block_len = 0;
+
+	if (!writer->threads) {
+		job_process(job, writer->level, &writer->zs);
+		return job_write(writer, job);
+	}
+
+	g_mutex_lock(writer->mutex);
+	g_queue_push_tail(writer->pending, job);
+	g_queue_push_tail(writer->inflight, job);
+	g_cond_signal(writer->job_cond);
+	g_mutex_unlock(writer->mutex);
+
+	/* Keep every thread busy, but don't queue up the whole capture. */
+	return jobs_drain(writer, 2 * writer->num_threads);
+}
+
+static int threads_start(struct sr_session_writer *writer)
+{
+	int i;
+
+	if (!(writer->threads = g_try_malloc0(writer->num_threads
+					      * sizeof(GThread *)))) {
+		sr_err("session file: %s: threads malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	writer->mutex = g_mutex_new();
+	writer->job_cond = g_cond_new();
+	writer->done_cond = g_cond_new();
+	writer->pending = g_queue_new();
+	writer->inflight = g_queue_new();
+
+	for (i = 0; i < writer->num_threads; i++) {
+		if (!(writer->threads[i] = g_thread_create(compress_thread,
+						writer, TRUE, NULL))) {
+			sr_err("session file: %s: failed to start compression "
+			       "thread", __func__);
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
+/** Stop the compression threads, and drop any jobs which are left. */
+static void threads_stop(struct sr_session_writer *writer)
+{
+	struct writer_job *job;
+	int i;
+
+	if (!writer->threads)
+		return;
+
+	g_mutex_lock(writer->mutex);
+	writer->quit = TRUE;
+	g_cond_broadcast(writer->job_cond);
+	g_mutex_unlock(writer->mutex);
+	for (i = 0; i < writer->num_threads && writer->threads[i]; i++)
+		g_thread_join(writer->threads[i]);
+
+	while ((job = g_queue_pop_head(writer->inflight)))
+		job_free(job);
+	g_queue_free(writer->pending);
+	g_queue_free(writer->inflight);
+	g_cond_free(writer->job_cond);
+	g_cond_free(writer->done_cond);
+	g_mutex_free(writer->mutex);
+	g_free(writer->threads);
+	writer->threads = NULL;
+}
+
+static void member_free(struct writer_member *m)
+{
+	g_free(m->block);
+	if (m->summaries)
+		g_array_free(m->summaries, TRUE);
+	if (m->triggers)
+		g_array_free(m->triggers, TRUE);
+	g_free(m);
+}
+
+static struct writer_member *member_get(struct sr_session_writer *writer,
+					struct sr_dev *dev)
+{
+	struct writer_member *m;
+	GSList *l;
+
+	for (l = writer->members; l; l = l->next) {
+		m = l->data;
+		if (m->dev == dev)
+			return m;
+	}
+
+	if (!(m = g_try_malloc0(sizeof(struct writer_member)))) {
+		sr_err("session file: %s: member malloc failed", __func__);
+		return NULL;
+	}
+	m->dev = dev;
+	m->index = g_slist_index(session->devs, dev) + 1;
+	m->summaries = g_array_new(FALSE, FALSE, sizeof(struct block_summary));
+	m->triggers = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	writer->members = g_slist_append(writer->members, m);
+
+	return m;
+}
+
+/** Write the "index-N" member of a device. */
+static int write_index(struct sr_session_writer *writer,
+		       struct writer_member *m)
+{
+	struct block_summary *summary;
+	uint8_t *index, *p;
+	uint64_t len, i;
+	char name[32];
+	int ret;
+
+	len = SESSION_INDEX_HEADER_SIZE
+	      + m->summaries->len * SESSION_INDEX_RECORD_SIZE
+	      + m->triggers->len * sizeof(uint64_t);
+	if (!(index = g_try_malloc0(len))) {
+		sr_err("session file: %s: index malloc failed", __func__);
+		writer->failed = TRUE;
+		return SR_ERR_MALLOC;
+	}
+
+	memcpy(index, SESSION_INDEX_MAGIC, 4);
+	put_le32(index + 4, SESSION_INDEX_SUMMARY);
+	put_le32(index + 8, m->unitsize);
+	put_le32(index + 12, SESSION_INDEX_RECORD_SIZE);
+	put_le64(index + 16, BLOCK_SAMPLES);
+	put_le64(index + 24, m->summaries->len);
+	put_le64(index + 32, m->num_samples);
+	put_le64(index + 40, m->triggers->len);
+	p = index + SESSION_INDEX_HEADER_SIZE;
+	for (i = 0; i < m->summaries->len; i++) {
+		summary = &g_array_index(m->summaries, struct block_summary, i);
+		put_le64(p, summary->min);
+		put_le64(p + 8, summary->max);
+		put_le64(p + 16, summary->changed);
+		p += SESSION_INDEX_RECORD_SIZE;
+	}
+	for (i = 0; i < m->triggers->len; i++, p += 8)
+		put_le64(p, g_array_index(m->triggers, uint64_t, i));
+
+	snprintf(name, sizeof(name), "index-%d", m->index);
+	ret = write_stored(writer, name, index, len);
+	g_free(index);
+
+	return ret;
+}
+
+/** Free the writer, and everything it still holds. */
+static void writer_free(struct sr_session_writer *writer)
+{
+	GSList *l;
+
+	threads_stop(writer);
+	if (writer->zs.state)
+		deflateEnd(&writer->zs);
+	for (l = writer->members; l; l = l->next)
+		member_free(l->data);
+	g_slist_free(writer->members);
+	g_slist_free_full(writer->entries, g_free);
+	g_free(writer);
+}
+
+/**
+ * Create a writer which records a session file while the session is
+ * running.
+ *
+ * Samples passed to sr_session_writer_append() are compressed in blocks of
+ * a fixed number of samples, each of which goes into its own "logic-N-B"
+ * member of the archive, so nothing needs to be kept in memory. The block
+ * index of each device, and the metadata, are written when the writer is
+ * finished. This is version 2 of the session file format; a capture can be
+ * replayed starting at any sample, without decompressing what comes before.
+ *
+ * The compression is taken from the session's SR_SESSION_FILE_LEVEL and
+ * SR_SESSION_FILE_THREADS settings, see sr_session_config_set().
+ *
+ * @param filename The name of the session file to create. An existing file
+ *                 with this name is overwritten. Must not be NULL.
+ * @param writer Pointer to a variable which will hold the new writer.
+ *               Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, SR_ERR_BUG if no
+ *         session exists, or SR_ERR upon other errors.
+ */
+SR_API int sr_session_writer_new(const char *filename,
+				 struct sr_session_writer **writer)
+{
+	struct sr_session_writer *w;
+	struct tm *tm;
+	time_t now;
+	int ret;
+	char version[1];
+
+	if (!filename) {
+		sr_err("session file: %s: filename was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!writer) {
+		sr_err("session file: %s: writer was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!session) {
+		sr_err("session file: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (!(w = g_try_malloc0(sizeof(struct sr_session_writer)))) {
+		sr_err("session file: %s: writer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	w->level = session->file_level;
+	w->num_threads = session->file_threads;
+	if (w->level != SR_FILE_LEVEL_STORE) {
+		if (w->num_threads > 1) {
+			if ((ret = threads_start(w)) != SR_OK) {
+				threads_stop(w);
+				g_free(w);
+				return ret;
+			}
+		} else if (deflateInit2(&w->zs, w->level, Z_DEFLATED,
+				-MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			sr_err("session file: %s: deflateInit2 failed",
+			       __func__);
+			g_free(w);
+			return SR_ERR;
+		}
+	}
+
+	if (!(w->fp = g_fopen(filename, "wb"))) {
+		sr_err("session file: failed to create %s", filename);
+		writer_free(w);
+		return SR_ERR;
+	}
+
+	now = time(NULL);
+	tm = localtime(&now);
+	w->dostime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+	w->dosdate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5)
+		     | tm->tm_mday;
+
+	/* "version" */
+	version[0] = '2';
+	if (write_stored(w, "version", version, 1) != SR_OK) {
+		fclose(w->fp);
+		writer_free(w);
+		return SR_ERR;
+	}
+
+	*writer = w;
+
+	return SR_OK;
+}
+
+/**
+ * Append samples to the capture of a device in the session file.
+ *
+ * @param writer The writer to append to. Must not be NULL.
+ * @param dev The device the samples came from. Must be part of the
+ *            current session.
+ * @param data The samples. May only be NULL if length is 0.
+ * @param length The number of bytes in data, a multiple of unitsize.
+ * @param unitsize The size of one sample, in bytes (1 to 8). Must be the
+ *                 same for all samples of a device.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_writer_append(struct sr_session_writer *writer,
+		struct sr_dev *dev, const void *data, uint64_t length,
+		int unitsize)
+{
+	struct writer_member *m;
+	uint64_t chunk;
+
+	if (!writer || !dev || (!data && length) || unitsize < 1
+	    || unitsize > 8 || length % unitsize) {
+		sr_err("session file: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (writer->failed)
+		return SR_ERR;
+
+	if (!(m = member_get(writer, dev)))
+		return SR_ERR_MALLOC;
+
+	if (!m->unitsize)
+		m->unitsize = unitsize;
+	if (m->unitsize != unitsize) {
+		sr_err("session file: %s: unitsize changed from %d to %d",
+		       __func__, m->unitsize, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	/* Cut the samples into blocks. */
+	while (length > 0) {
+		if (!m->block && !(m->block = g_try_malloc(BLOCK_SAMPLES
+							   * unitsize))) {
+			sr_err("session file: %s: block malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		chunk = MIN(length, BLOCK_SAMPLES * unitsize - m->block_len);
+		memcpy(m->block + m->block_len, data, chunk);
+		m->block_len += chunk;
+		m->num_samples += chunk / unitsize;
+		if (m->block_len == (uint64_t)BLOCK_SAMPLES * unitsize
+		    && job_submit(writer, m) != SR_OK)
+			return SR_ERR;
+		data = (const uint8_t *)data + chunk;
+		length -= chunk;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Record a trigger position in the capture of a device: the trigger
+ * happened right before the next sample to be appended.
+ *
+ * @param writer The writer to record the trigger in. Must not be NULL.
+ * @param dev The device which triggered. Must be part of the current
+ *            session.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_API int sr_session_writer_trigger(struct sr_session_writer *writer,
+				     struct sr_dev *dev)
+{
+	struct writer_member *m;
+
+	if (!writer || !dev) {
+		sr_err("session file: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(m = member_get(writer, dev)))
+		return SR_ERR_MALLOC;
+
+	g_array_append_val(m->triggers, m->num_samples);
+
+	return SR_OK;
+}
+
+/**
+ * Finish the session file: complete all captures, write their block
+ * indexes and the metadata of the devices in the current session, and
+ * close the file.
+ *
+ * The writer is freed, even if an error occurred.
+ *
+ * @param writer The writer to finish. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_writer_finish(struct sr_session_writer *writer)
+{
+	GSList *l, *p;
+	GString *meta;
+	struct writer_member *m;
+	struct sr_dev *dev;
+	struct sr_probe *probe;
+	int devcnt, probecnt, ret;
+	uint64_t samplerate;
+	char *s;
+
+	if (!writer) {
+		sr_err("session file: %s: writer was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	for (l = writer->members; l; l = l->next) {
+		m = l->data;
+		/* Only triggers, no samples: record an empty capture. */
+		if (!m->unitsize)
+			m->unitsize = 1;
+		if (m->block_len)
+			job_submit(writer, m);
+	}
+	jobs_drain(writer, 0);
+	for (l = writer->members; l; l = l->next)
+		write_index(writer, l->data);
+
+	meta = g_string_new("[global]\n");
+	g_string_append_printf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
+	/* TODO: save protocol decoders used */
+
+	devcnt = 1;
+	for (l = session->devs; l; l = l->next) {
+		dev = l->data;
+		g_string_append_printf(meta, "[device %d]\n", devcnt);
+		if (dev->driver)
+			g_string_append_printf(meta, "driver = %s\n",
+					       dev->driver->name);
+
+		for (p = writer->members, m = NULL; p; p = p->next)
+			if (((struct writer_member *)p->data)->dev == dev)
+				m = p->data;
+		if (m) {
+			g_string_append_printf(meta, "capturefile = logic-%d\n",
+					       m->index);
+			g_string_append_printf(meta, "indexfile = index-%d\n",
+					       m->index);
+			g_string_append_printf(meta, "unitsize = %d\n",
+					       m->unitsize);
+			g_string_append_printf(meta, "total probes = %d\n",
+					       g_slist_length(dev->probes));
+			if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
+				samplerate = *((uint64_t *) dev->driver->dev_info_get(
+						dev->driver_index, SR_DI_CUR_SAMPLERATE));
+				s = sr_samplerate_string(samplerate);
+				g_string_append_printf(meta, "samplerate = %s\n", s);
+				g_free(s);
+			}
+			probecnt = 1;
+			for (p = dev->probes; p; p = p->next) {
+				probe = p->data;
+				if (probe->enabled) {
+					if (probe->name)
+						g_string_append_printf(meta,
+							"probe%d = %s\n",
+							probecnt, probe->name);
+					if (probe->trigger)
+						g_string_append_printf(meta,
+							" trigger%d = %s\n",
+							probecnt, probe->trigger);
+					probecnt++;
+				}
+			}
+		}
+		devcnt++;
+	}
+
+	if (write_stored(writer, "metadata", meta->str, meta->len) == SR_OK)
+		write_central_directory(writer);
+	g_string_free(meta, TRUE);
+
+	ret = writer->failed ? SR_ERR : SR_OK;
+	if (fclose(writer->fp) != 0 && ret == SR_OK) {
+		sr_err("session file: failed to close session file");
+		ret = SR_ERR;
+	}
+	writer_free(writer);
+
+	return ret;
+}
+
 /**
  * Load the session from the specified filename.
  *
@@ -70,7 +1018,7 @@ SR_API int sr_session_load(const char *filename)
 		return SR_ERR;
 	}
 	ret = zip_fread(zf, &c, 1);
-	if (ret != 1 || c != '1') {
+	if (ret != 1 || (c != '1' && c != '2')) {
 		sr_dbg("session file: Not a valid sigrok session file.");
 		return SR_ERR;
 	}
@@ -121,6 +1069,9 @@ SR_API int sr_session_load(const char *filename)
 					sr_session_dev_add(dev);
 					dev->driver->dev_config_set(devcnt, SR_HWCAP_CAPTUREFILE, val);
 					g_ptr_array_add(capturefiles, val);
+				} else if (!strcmp(keys[j], "indexfile")) {
+					/* version 2: the capture is in blocks */
+					dev->driver->dev_config_set(devcnt, SR_HWCAP_CAPTURE_INDEXFILE, val);
 				} else if (!strcmp(keys[j], "samplerate")) {
 					sr_parse_sizestring(val, &tmp_u64);
 					dev->driver->dev_config_set(devcnt, SR_HWCAP_SAMPLERATE, &tmp_u64);
@@ -146,10 +1097,14 @@ SR_API int sr_session_load(const char *filename)
 				}
 			}
 			g_strfreev(keys);
+			if (!dev)
+				continue;
 			for (p = enabled_probes; p < total_probes; p++) {
 				probe = g_slist_nth_data(dev->probes, p);
 				probe->enabled = FALSE;
 			}
+			/* Each capture file is replayed by its own device. */
+			devcnt++;
 		}
 	}
 	g_strfreev(sections);
@@ -161,6 +1116,10 @@ SR_API int sr_session_load(const char *filename)
 /**
  * Save the current session to the specified file.
  *
+ * This writes the contents of the datastores of all devices in the session.
+ * To record a session file while acquiring, without keeping the samples
+ * in a datastore, use sr_session_writer_new() instead.
+ *
  * @param filename The name of the file where to save the current session.
  *                 Must not be NULL.
  *
@@ -169,119 +1128,46 @@ SR_API int sr_session_load(const char *filename)
  */
 int sr_session_save(const char *filename)
 {
-	GSList *l, *p, *d;
-	FILE *meta;
+	GSList *l;
 	struct sr_dev *dev;
-	struct sr_probe *probe;
 	struct sr_datastore *ds;
-	struct zip *zipfile;
-	struct zip_source *versrc, *metasrc, *logicsrc;
-	int bufcnt, devcnt, tmpfile, ret, probecnt;
-	uint64_t samplerate;
-	char version[1], rawname[16], metafile[32], *buf, *s;
+	struct sr_datastore_iter iter;
+	struct sr_session_writer *writer;
+	const void *span;
+	uint64_t span_units;
+	int ret;
 
 	if (!filename) {
 		sr_err("session file: %s: filename was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	/* Quietly delete it first, libzip wants replace ops otherwise. */
-	unlink(filename);
-	if (!(zipfile = zip_open(filename, ZIP_CREATE, &ret)))
-		return SR_ERR;
-
-	/* "version" */
-	version[0] = '1';
-	if (!(versrc = zip_source_buffer(zipfile, version, 1, 0)))
-		return SR_ERR;
-	if (zip_add(zipfile, "version", versrc) == -1) {
-		sr_info("session file: error saving version into zipfile: %s",
-			zip_strerror(zipfile));
-		return SR_ERR;
-	}
+	if ((ret = sr_session_writer_new(filename, &writer)) != SR_OK)
+		return ret;
 
-	/* init "metadata" */
-	strcpy(metafile, "sigrok-meta-XXXXXX");
-	if ((tmpfile = g_mkstemp(metafile)) == -1)
-		return SR_ERR;
-	close(tmpfile);
-	meta = g_fopen(metafile, "wb");
-	fprintf(meta, "[global]\n");
-	fprintf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
-	/* TODO: save protocol decoders used */
-
-	/* all datastores in all devices */
-	devcnt = 1;
+	/* Stream all datastores in all devices, span by span. */
 	for (l = session->devs; l; l = l->next) {
 		dev = l->data;
-		/* metadata */
-		fprintf(meta, "[device %d]\n", devcnt);
-		if (dev->driver)
-			fprintf(meta, "driver = %s\n", dev->driver->name);
-
-		ds = dev->datastore;
-		if (ds) {
-			/* metadata */
-			fprintf(meta, "capturefile = logic-%d\n", devcnt);
-			fprintf(meta, "unitsize = %d\n", ds->ds_unitsize);
-			fprintf(meta, "total probes = %d\n", g_slist_length(dev->probes));
-			if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
-				samplerate = *((uint64_t *) dev->driver->dev_info_get(
-						dev->driver_index, SR_DI_CUR_SAMPLERATE));
-				s = sr_samplerate_string(samplerate);
-				fprintf(meta, "samplerate = %s\n", s);
-				g_free(s);
-			}
-			probecnt = 1;
-			for (p = dev->probes; p; p = p->next) {
-				probe = p->data;
-				if (probe->enabled) {
-					if (probe->name)
-						fprintf(meta, "probe%d = %s\n", probecnt, probe->name);
-					if (probe->trigger)
-						fprintf(meta, " trigger%d = %s\n", probecnt, probe->trigger);
-					probecnt++;
-				}
-			}
-
-			/* dump datastore into logic-n */
-			buf = g_try_malloc(ds->num_units * ds->ds_unitsize +
-				   DATASTORE_CHUNKSIZE);
-			if (!buf) {
-				sr_err("session file: %s: buf malloc failed",
-				       __func__);
-				return SR_ERR_MALLOC;
-			}
-
-			bufcnt = 0;
-			for (d = ds->chunklist; d; d = d->next) {
-				memcpy(buf + bufcnt, d->data,
-				       DATASTORE_CHUNKSIZE);
-				bufcnt += DATASTORE_CHUNKSIZE;
-			}
-			if (!(logicsrc = zip_source_buffer(zipfile, buf,
-				       ds->num_units * ds->ds_unitsize, TRUE)))
-				return SR_ERR;
-			snprintf(rawname, 15, "logic-%d", devcnt);
-			if (zip_add(zipfile, rawname, logicsrc) == -1)
-				return SR_ERR;
+		if (!(ds = dev->datastore))
+			continue;
+		ret = sr_session_writer_append(writer, dev, NULL, 0,
+					       ds->ds_unitsize);
+		if (ret == SR_OK)
+			ret = sr_datastore_iter_init(&iter, ds, 0,
+						     ds->num_units);
+		while (ret == SR_OK) {
+			ret = sr_datastore_iter_next(&iter, &span, &span_units);
+			if (ret != SR_OK || span_units == 0)
+				break;
+			ret = sr_session_writer_append(writer, dev, span,
+					span_units * ds->ds_unitsize,
+					ds->ds_unitsize);
+		}
+		if (ret != SR_OK) {
+			sr_session_writer_finish(writer);
+			return SR_ERR;
 		}
-		devcnt++;
-	}
-	fclose(meta);
-
-	if (!(metasrc = zip_source_file(zipfile, metafile, 0, -1)))
-		return SR_ERR;
-	if (zip_add(zipfile, "metadata", metasrc) == -1)
-		return SR_ERR;
-
-	if ((ret = zip_close(zipfile)) == -1) {
-		sr_info("session file: error saving zipfile: %s",
-			zip_strerror(zipfile));
-		return SR_ERR;
 	}
 
-	unlink(metafile);
-
-	return SR_OK;
+	return sr_session_writer_finish(writer);
 }
@@ -0,0 +1,641 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2010-2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Create a software trigger from the trigger settings of a device's probes.
+ *
+ * The probe trigger strings are those set by sr_dev_trigger_set(), e.g.
+ * from sr_parse_triggerstring(). Character n of a probe's string is its
+ * condition in stage n: '0' or '1' for a level, 'r' for a rising edge,
+ * 'f' for a falling edge, 'c' for any change. Disabled probes are ignored.
+ * If no probe has a trigger set, the trigger fires right away.
+ *
+ * It is the caller's responsibility to free the trigger via
+ * sr_trigger_destroy(), if no longer needed.
+ *
+ * @param probes List of struct sr_probe*, usually the device's probes.
+ * @param pre_trigger Number of samples before the trigger to send along,
+ *                    usually the capture ratio applied to the sample limit.
+ * @param send Where sr_trigger_send() passes the packets on to, e.g.
+ *             sr_session_send(). Can be NULL if only sr_trigger_scan()
+ *             is used.
+ * @param trig Pointer to a variable which will hold the new trigger.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments or trigger settings.
+ */
+SR_API int sr_trigger_new(GSList *probes, uint64_t pre_trigger,
+			  sr_trigger_send_callback_t send,
+			  struct sr_trigger **trig)
+{
+	struct sr_trigger_stage *stage;
+	struct sr_probe *probe;
+	GSList *l;
+	uint64_t probe_bit;
+	int num_stages;
+	const char *tc;
+
+	if (!trig) {
+		sr_err("trigger: %s: trig was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!(*trig = g_try_malloc0(sizeof(struct sr_trigger)))) {
+		sr_err("trigger: %s: trig malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (l = probes; l; l = l->next) {
+		probe = l->data;
+		if (!probe->enabled || !probe->trigger)
+			continue;
+
+		if (probe->index < 1 || probe->index > SR_MAX_NUM_PROBES) {
+			sr_err("trigger: %s: invalid probe index %d",
+			       __func__, probe->index);
+			goto error;
+		}
+		probe_bit = (uint64_t)1 << (probe->index - 1);
+
+		num_stages = 0;
+		for (tc = probe->trigger; *tc; tc++) {
+			if (num_stages == SR_MAX_TRIGGER_STAGES) {
+				sr_err("trigger: %s: more than %d stages",
+				       __func__, SR_MAX_TRIGGER_STAGES);
+				goto error;
+			}
+			stage = &(*trig)->stages[num_stages++];
+			switch (*tc) {
+			case '0':
+				stage->mask |= probe_bit;
+				break;
+			case '1':
+				stage->mask |= probe_bit;
+				stage->value |= probe_bit;
+				break;
+			case 'r':
+				stage->rising |= probe_bit;
+				break;
+			case 'f':
+				stage->falling |= probe_bit;
+				break;
+			case 'c':
+				stage->change |= probe_bit;
+				break;
+			default:
+				sr_err("trigger: %s: invalid trigger type '%c' "
+				       "for probe %d", __func__, *tc,
+				       probe->index);
+				goto error;
+			}
+		}
+		(*trig)->num_stages = MAX((*trig)->num_stages, num_stages);
+	}
+
+	(*trig)->pre_trigger = pre_trigger;
+	(*trig)->send = send;
+	sr_trigger_reset(*trig);
+
+	return SR_OK;
+
+error:
+	g_free(*trig);
+	*trig = NULL;
+	return SR_ERR_ARG;
+}
+
+/**
+ * Destroy a software trigger.
+ *
+ * @param trig The trigger to destroy.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_destroy(struct sr_trigger *trig)
+{
+	if (!trig) {
+		sr_err("trigger: %s: trig was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(trig->ring);
+	g_free(trig);
+
+	return SR_OK;
+}
+
+/**
+ * Set the number of samples sent along from before the trigger.
+ *
+ * Samples kept from before the call are dropped.
+ *
+ * @param trig The trigger.
+ * @param pre_trigger Number of samples.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_pre_trigger_set(struct sr_trigger *trig,
+				      uint64_t pre_trigger)
+{
+	if (!trig) {
+		sr_err("trigger: %s: trig was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(trig->ring);
+	trig->ring = NULL;
+	trig->ring_start = 0;
+	trig->ring_length = 0;
+	trig->pre_trigger = pre_trigger;
+
+	return SR_OK;
+}
+
+/**
+ * Re-arm a software trigger for a new acquisition.
+ *
+ * sr_trigger_send() does this when it gets an SR_DF_HEADER packet.
+ *
+ * @param trig The trigger.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_reset(struct sr_trigger *trig)
+{
+	if (!trig) {
+		sr_err("trigger: %s: trig was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	trig->fired = (trig->num_stages == 0);
+	trig->matched = 0;
+	trig->prev = 0;
+	trig->have_prev = FALSE;
+	trig->ring_start = 0;
+	trig->ring_length = 0;
+	trig->num_sent = 0;
+
+	return SR_OK;
+}
+
+/* Get the value of a sample, with bit n being probe n + 1. */
+static inline uint64_t sample_value(const uint8_t *sample, int unitsize)
+{
+	uint64_t value;
+	int i;
+
+	value = 0;
+	for (i = 0; i < unitsize; i++)
+		value |= (uint64_t)sample[i] << (i * 8);
+
+	return value;
+}
+
+/* Check whether a sample matches a stage, given the sample before it. */
+static inline gboolean stage_match(const struct sr_trigger_stage *stage,
+				   uint64_t sample, uint64_t prev)
+{
+	return (sample & stage->mask) == stage->value
+	       && (sample & ~prev & stage->rising) == stage->rising
+	       && (~sample & prev & stage->falling) == stage->falling
+	       && ((sample ^ prev) & stage->change) == stage->change;
+}
+
+static inline gboolean stage_has_edges(const struct sr_trigger_stage *stage)
+{
+	return (stage->rising | stage->falling | stage->change) != 0;
+}
+
+#ifdef __SSE2__
+/* Fill a vector with copies of the low 'unitsize' bytes of a value. */
+static __m128i vector_fill(uint64_t value, int unitsize)
+{
+	uint8_t buf[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		buf[i] = value >> ((i % unitsize) * 8);
+
+	return _mm_loadu_si128((const __m128i *)buf);
+}
+
+/**
+ * Find the first sample matching a stage, 16 bytes of samples at a time.
+ *
+ * @param stage The stage.
+ * @param data The samples.
+ * @param start Index of the first sample to check. Must be at least 1.
+ * @param num_samples Number of samples in 'data'.
+ * @param unitsize The unit size, 1, 2 or 4.
+ *
+ * @return Index of the first matching sample, or of the first sample which
+ *         wasn't checked because less than 16 bytes were left.
+ */
+static uint64_t stage_scan_sse2(const struct sr_trigger_stage *stage,
+				const uint8_t *data, uint64_t start,
+				uint64_t num_samples, int unitsize)
+{
+	__m128i mask, value, rising, falling, change, zero, s, p, d;
+	uint64_t i, step;
+	unsigned int m, lanes;
+	gboolean edges;
+	int j;
+
+	mask = vector_fill(stage->mask, unitsize);
+	value = vector_fill(stage->value, unitsize);
+	rising = vector_fill(stage->rising, unitsize);
+	falling = vector_fill(stage->falling, unitsize);
+	change = vector_fill(stage->change, unitsize);
+	zero = _mm_setzero_si128();
+	edges = stage_has_edges(stage);
+
+	/* The first byte of every sample in a vector. */
+	lanes = 0;
+	for (j = 0; j < 16; j += unitsize)
+		lanes |= 1 << j;
+
+	step = 16 / unitsize;
+	for (i = start; i + step <= num_samples; i += step) {
+		/* Bits which differ from what the stage wants. */
+		s = _mm_loadu_si128((const __m128i *)(data + i * unitsize));
+		d = _mm_xor_si128(_mm_and_si128(s, mask), value);
+		if (edges) {
+			p = _mm_loadu_si128((const __m128i *)
+					    (data + (i - 1) * unitsize));
+			d = _mm_or_si128(d, _mm_xor_si128(_mm_and_si128(
+				_mm_andnot_si128(p, s), rising), rising));
+			d = _mm_or_si128(d, _mm_xor_si128(_mm_and_si128(
+				_mm_andnot_si128(s, p), falling), falling));
+			d = _mm_or_si128(d, _mm_xor_si128(_mm_and_si128(
+				_mm_xor_si128(s, p), change), change));
+		}
+
+		/* A sample matches if none of its bytes differ. */
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(d, zero));
+		for (j = 1; j < unitsize; j *= 2)
+			m &= m >> j;
+		m &= lanes;
+		if (m)
+			return i + __builtin_ctz(m) / unitsize;
+	}
+
+	return i;
+}
+#endif
+
+/**
+ * Find the first sample matching the first stage.
+ *
+ * @param trig The trigger.
+ * @param data The samples.
+ * @param start Index of the first sample to check. Must be at least 1, as
+ *              edges are checked against the sample before.
+ * @param num_samples Number of samples in 'data'.
+ * @param unitsize The unit size.
+ *
+ * @return Index of the first matching sample, or num_samples if none does.
+ */
+static uint64_t first_stage_scan(const struct sr_trigger *trig,
+				 const uint8_t *data, uint64_t start,
+				 uint64_t num_samples, int unitsize)
+{
+	const struct sr_trigger_stage *stage;
+	uint64_t i, sample, prev;
+	int size;
+
+	stage = &trig->stages[0];
+	size = MIN(unitsize, 8);
+	i = start;
+
+#ifdef __SSE2__
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4)
+		i = stage_scan_sse2(stage, data, i, num_samples, unitsize);
+#endif
+
+	for (; i < num_samples; i++) {
+		sample = sample_value(data + i * unitsize, size);
+		prev = sample_value(data + (i - 1) * unitsize, size);
+		if (stage_match(stage, sample, prev))
+			break;
+	}
+
+	return i;
+}
+
+/**
+ * Look for the trigger condition in a block of samples.
+ *
+ * The matching state is carried over from the previous block, so the
+ * stages can match across blocks. Each sample shifts the set of partial
+ * matches along by one stage, dropping those the sample doesn't continue.
+ * While there are no partial matches, only the first stage needs to be
+ * checked, which is done on whole runs of samples by first_stage_scan().
+ *
+ * @return Index of the sample the trigger fired on, or num_samples.
+ */
+static uint64_t trigger_scan(struct sr_trigger *trig, const uint8_t *data,
+			     uint64_t num_samples, int unitsize)
+{
+	uint64_t i, sample, prev, want, matched, last;
+	int size, k;
+
+	size = MIN(unitsize, 8);
+	last = (uint64_t)1 << (trig->num_stages - 1);
+
+	for (i = 0; i < num_samples; i++) {
+		if (trig->matched == 0 && i > 0) {
+			i = first_stage_scan(trig, data, i, num_samples,
+					     unitsize);
+			if (i == num_samples)
+				break;
+		}
+
+		sample = sample_value(data + i * unitsize, size);
+		if (i > 0)
+			prev = sample_value(data + (i - 1) * unitsize, size);
+		else
+			prev = trig->prev;
+
+		/* Stages which would continue a match, or start one. */
+		want = (trig->matched << 1) | 1;
+		matched = 0;
+		for (k = 0; k < trig->num_stages; k++) {
+			if (!(want & ((uint64_t)1 << k)))
+				continue;
+			/* No edges on the very first sample. */
+			if (i == 0 && !trig->have_prev
+			    && stage_has_edges(&trig->stages[k]))
+				continue;
+			if (stage_match(&trig->stages[k], sample, prev))
+				matched |= (uint64_t)1 << k;
+		}
+		trig->matched = matched;
+
+		if (matched & last) {
+			trig->fired = TRUE;
+			break;
+		}
+	}
+
+	if (num_samples > 0) {
+		trig->prev = sample_value(data + (num_samples - 1) * unitsize,
+					  size);
+		trig->have_prev = TRUE;
+	}
+
+	return i;
+}
+
+/**
+ * Look for the trigger condition in a block of samples.
+ *
+ * Blocks must be passed in the order the samples were acquired in, the
+ * trigger can match across blocks. This is the scan sr_trigger_send() uses,
+ * for drivers which handle the data around the trigger themselves.
+ *
+ * @param trig The trigger. Once it fired (see trig->fired), it must be
+ *             re-armed with sr_trigger_reset() before scanning again.
+ * @param data The samples.
+ * @param length Length of 'data' in bytes.
+ * @param unitsize The unit size of the samples.
+ * @param offset Pointer to a variable which will hold the index of the
+ *               sample the trigger fired on, or the number of samples in
+ *               'data' if it didn't fire. Stays 0 if the trigger had fired
+ *               before.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_trigger_scan(struct sr_trigger *trig, const void *data,
+			   uint64_t length, int unitsize, uint64_t *offset)
+{
+	if (!trig || !data || !offset) {
+		sr_err("trigger: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize <= 0) {
+		sr_err("trigger: %s: unitsize was %d, but it must be >= 1",
+		       __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	*offset = 0;
+	if (trig->fired)
+		return SR_OK;
+
+	/* Samples of different sizes can't be matched against each other. */
+	if (unitsize != trig->unitsize) {
+		g_free(trig->ring);
+		trig->ring = NULL;
+		trig->ring_start = 0;
+		trig->ring_length = 0;
+		trig->matched = 0;
+		trig->have_prev = FALSE;
+		trig->unitsize = unitsize;
+	}
+
+	*offset = trigger_scan(trig, data, length / unitsize, unitsize);
+
+	return SR_OK;
+}
+
+/* Keep the last samples before the trigger in the ring buffer. */
+static void ring_put(struct sr_trigger *trig, const uint8_t *data,
+		     uint64_t num_samples)
+{
+	uint64_t pos, n;
+	int unitsize;
+
+	if (!trig->ring || num_samples == 0)
+		return;
+
+	unitsize = trig->unitsize;
+	if (num_samples >= trig->pre_trigger) {
+		data += (num_samples - trig->pre_trigger) * unitsize;
+		num_samples = trig->pre_trigger;
+		trig->ring_start = 0;
+		trig->ring_length = 0;
+	}
+
+	pos = (trig->ring_start + trig->ring_length) % trig->pre_trigger;
+	n = MIN(num_samples, trig->pre_trigger - pos);
+	memcpy(trig->ring + pos * unitsize, data, n * unitsize);
+	memcpy(trig->ring, data + n * unitsize, (num_samples - n) * unitsize);
+
+	trig->ring_length += num_samples;
+	if (trig->ring_length > trig->pre_trigger) {
+		trig->ring_start = (trig->ring_start + trig->ring_length
+				    - trig->pre_trigger) % trig->pre_trigger;
+		trig->ring_length = trig->pre_trigger;
+	}
+}
+
+/* Send the samples kept in the ring buffer, oldest first. */
+static int ring_flush(struct sr_trigger *trig, struct sr_dev *dev)
+{
+	struct sr_datafeed_packet *packet;
+	struct sr_datafeed_logic *logic;
+	uint64_t n;
+	int unitsize, ret;
+
+	if (trig->ring_length == 0)
+		return SR_OK;
+
+	unitsize = trig->unitsize;
+	if ((ret = sr_datafeed_packet_new(SR_DF_LOGIC,
+			trig->ring_length * unitsize, &packet)) != SR_OK)
+		return ret;
+
+	logic = packet->payload;
+	n = MIN(trig->ring_length, trig->pre_trigger - trig->ring_start);
+	memcpy(logic->data, trig->ring + trig->ring_start * unitsize,
+	       n * unitsize);
+	memcpy((uint8_t *)logic->data + n * unitsize, trig->ring,
+	       (trig->ring_length - n) * unitsize);
+	logic->length = trig->ring_length * unitsize;
+	logic->unitsize = unitsize;
+
+	trig->num_sent += trig->ring_length;
+	trig->ring_start = 0;
+	trig->ring_length = 0;
+
+	ret = trig->send(dev, packet);
+	sr_datafeed_packet_release(packet);
+
+	return ret;
+}
+
+/* Handle an SR_DF_LOGIC packet while the trigger hasn't fired yet. */
+static int trigger_logic(struct sr_trigger *trig, struct sr_dev *dev,
+			 struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_packet trigger, rest;
+	struct sr_datafeed_logic *logic, rest_logic;
+	uint64_t offset;
+	int ret;
+
+	logic = packet->payload;
+	if ((ret = sr_trigger_scan(trig, logic->data, logic->length,
+				   logic->unitsize, &offset)) != SR_OK)
+		return ret;
+
+	if (!trig->ring && trig->pre_trigger > 0) {
+		if (!(trig->ring = g_try_malloc(trig->pre_trigger
+						* trig->unitsize))) {
+			sr_err("trigger: %s: ring malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+	}
+	ring_put(trig, logic->data, offset);
+
+	if (!trig->fired)
+		return SR_OK;
+
+	if ((ret = ring_flush(trig, dev)) != SR_OK)
+		return ret;
+
+	trigger.type = SR_DF_TRIGGER;
+	trigger.payload = NULL;
+	if ((ret = trig->send(dev, &trigger)) != SR_OK)
+		return ret;
+
+	trig->num_sent += logic->length / logic->unitsize - offset;
+
+	/* Nothing before the trigger in here, pass it on as it is. */
+	if (offset == 0)
+		return trig->send(dev, packet);
+
+	rest_logic = *logic;
+	rest_logic.length -= offset * logic->unitsize;
+	rest_logic.data = (uint8_t *)logic->data + offset * logic->unitsize;
+	rest.type = SR_DF_LOGIC;
+	rest.payload = &rest_logic;
+
+	return trig->send(dev, &rest);
+}
+
+/**
+ * Pass a datafeed packet through a software trigger.
+ *
+ * Until the trigger fires, SR_DF_LOGIC data is held back, keeping only the
+ * last 'pre_trigger' samples. When it fires, those samples are sent,
+ * followed by SR_DF_TRIGGER and the rest of the data. From then on, and
+ * for all other packet types, packets are passed on as they are, so
+ * reference-counted packets aren't copied.
+ *
+ * An SR_DF_HEADER packet re-arms the trigger. The number of samples
+ * passed on since then, before and after the trigger point, is kept in
+ * the trigger's num_sent, for drivers to check their sample limit.
+ *
+ * @param trig The trigger.
+ * @param dev The device which sent the packet.
+ * @param packet The datafeed packet.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or what the
+ *         trigger's send callback returned.
+ */
+SR_API int sr_trigger_send(struct sr_trigger *trig, struct sr_dev *dev,
+			   struct sr_datafeed_packet *packet)
+{
+	struct sr_datafeed_logic *logic;
+
+	if (!trig || !trig->send) {
+		sr_err("trigger: %s: trig or its send callback was NULL",
+		       __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!packet) {
+		sr_err("trigger: %s: packet was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		sr_trigger_reset(trig);
+		break;
+	case SR_DF_LOGIC:
+		if (!trig->fired)
+			return trigger_logic(trig, dev, packet);
+		logic = packet->payload;
+		if (logic->unitsize > 0)
+			trig->num_sent += logic->length / logic->unitsize;
+		break;
+	case SR_DF_END:
+		if (!trig->fired)
+			sr_info("trigger: Trigger didn't fire, dropping "
+				"%" PRIu64 " samples.", trig->ring_length);
+		trig->ring_start = 0;
+		trig->ring_length = 0;
+		break;
+	}
+
+	return trig->send(dev, packet);
+}
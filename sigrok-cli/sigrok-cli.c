@@ -43,12 +43,15 @@ static uint64_t limit_frames = 0;
 static struct sr_output_format *output_format = NULL;
 static int default_output_format = FALSE;
 static char *output_format_param = NULL;
+static struct sr_session_writer *session_writer = NULL;
 static GHashTable *pd_ann_visible = NULL;
 
 static gboolean opt_version = FALSE;
 static gint opt_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
 static gboolean opt_list_devs = FALSE;
 static gboolean opt_wait_trigger = FALSE;
+static gboolean opt_threaded = FALSE;
+static gboolean opt_stats = FALSE;
 static gchar *opt_input_file = NULL;
 static gchar *opt_output_file = NULL;
 static gchar *opt_dev = NULL;
@@ -63,6 +66,12 @@ static gchar *opt_time = NULL;
 static gchar *opt_samples = NULL;
 static gchar *opt_frames = NULL;
 static gchar *opt_continuous = NULL;
+static gchar *opt_datastore_mem = NULL;
+static gchar *opt_queue_policy = NULL;
+static gchar *opt_replay = NULL;
+static gchar *opt_replay_start = NULL;
+static gchar *opt_compress = NULL;
+static gint opt_compress_threads = 0;
 
 static GOptionEntry optargs[] = {
 	{"version", 'V', 0, G_OPTION_ARG_NONE, &opt_version,
@@ -101,6 +110,22 @@ static GOptionEntry optargs[] = {
 			"Number of frames to acquire", NULL},
 	{"continuous", 0, 0, G_OPTION_ARG_NONE, &opt_continuous,
 			"Sample continuously", NULL},
+	{"datastore-mem", 0, 0, G_OPTION_ARG_STRING, &opt_datastore_mem,
+			"Keep at most this many bytes of samples in memory", NULL},
+	{"threaded", 0, 0, G_OPTION_ARG_NONE, &opt_threaded,
+			"Acquire and process data in separate threads", NULL},
+	{"queue-policy", 0, 0, G_OPTION_ARG_STRING, &opt_queue_policy,
+			"What to do when processing falls behind (threaded mode)", NULL},
+	{"stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats,
+			"Show datafeed statistics at the end of the acquisition", NULL},
+	{"replay", 0, 0, G_OPTION_ARG_STRING, &opt_replay,
+			"Session file replay speed (realtime, max)", NULL},
+	{"replay-start", 0, 0, G_OPTION_ARG_STRING, &opt_replay_start,
+			"First sample of a session file to replay", NULL},
+	{"compress", 0, 0, G_OPTION_ARG_STRING, &opt_compress,
+			"Session file compression (store, 1-9, default)", NULL},
+	{"compress-threads", 0, 0, G_OPTION_ARG_INT, &opt_compress_threads,
+			"Number of threads (de)compressing session files", NULL},
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -419,10 +444,175 @@ static void show_pd_detail(void)
 	g_strfreev(pdtokens);
 }
 
+static void datastore_new(struct sr_dev *dev, int unitsize)
+{
+	uint64_t max_resident;
+
+	if (sr_datastore_new(unitsize, 0, &(dev->datastore)) != SR_OK) {
+		printf("Failed to create datastore.\n");
+		exit(1);
+	}
+
+	if (!opt_datastore_mem)
+		return;
+
+	/* Spill the samples to a temporary file beyond this much memory. */
+	if (sr_parse_sizestring(opt_datastore_mem, &max_resident) != SR_OK) {
+		g_critical("Invalid datastore memory size '%s'.",
+			   opt_datastore_mem);
+		exit(1);
+	}
+	if (sr_datastore_backing_file_set(dev->datastore, NULL,
+					  max_resident) != SR_OK) {
+		g_critical("Failed to set up the datastore backing file.");
+		exit(1);
+	}
+}
+
+/*
+ * Session files are written while the samples come in, unless a datastore
+ * was asked for: then everything is kept in the datastore, and saved from
+ * there after the session.
+ */
+static void session_file_new(struct sr_dev *dev, int unitsize)
+{
+	if (opt_datastore_mem) {
+		datastore_new(dev, unitsize);
+		return;
+	}
+
+	if (session_writer)
+		return;
+
+	if (sr_session_writer_new(opt_output_file, &session_writer) != SR_OK) {
+		g_critical("Failed to create session file %s.",
+			   opt_output_file);
+		exit(1);
+	}
+}
+
+static void session_file_save(void)
+{
+	if (session_writer) {
+		if (sr_session_writer_finish(session_writer) != SR_OK)
+			g_critical("Failed to save session.");
+		session_writer = NULL;
+	} else if (sr_session_save(opt_output_file) != SR_OK) {
+		g_critical("Failed to save session.");
+	}
+}
+
+static int set_file_compression(void)
+{
+	char *end;
+	int level;
+
+	if (opt_compress) {
+		if (!strcmp(opt_compress, "store"))
+			level = SR_FILE_LEVEL_STORE;
+		else if (!strcmp(opt_compress, "default"))
+			level = SR_FILE_LEVEL_DEFAULT;
+		else if ((level = strtol(opt_compress, &end, 10)) < 1 || *end)
+			level = -2;
+		if (sr_session_config_set(SR_SESSION_FILE_LEVEL,
+					  &level) != SR_OK) {
+			g_critical("Invalid compression '%s'.", opt_compress);
+			return SR_ERR_ARG;
+		}
+	}
+
+	if (opt_compress_threads) {
+		if (sr_session_config_set(SR_SESSION_FILE_THREADS,
+					  &opt_compress_threads) != SR_OK) {
+			g_critical("Invalid number of compression threads %d.",
+				   opt_compress_threads);
+			return SR_ERR_ARG;
+		}
+	}
+
+	return SR_OK;
+}
+
+static void datafeed_in(struct sr_dev *dev,
+			struct sr_datafeed_packet *packet);
+
+static void show_histogram(const char *title, const uint64_t *hist)
+{
+	int i;
+
+	fprintf(stderr, "    %s:", title);
+	for (i = 0; i < SR_STATS_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == 0)
+			fprintf(stderr, " 0: %" PRIu64, hist[i]);
+		else if (i == 1)
+			fprintf(stderr, " 1: %" PRIu64, hist[i]);
+		else if (i == SR_STATS_BUCKETS - 1)
+			fprintf(stderr, " %" PRIu64 "+: %" PRIu64,
+				(uint64_t)1 << (i - 1), hist[i]);
+		else
+			fprintf(stderr, " %" PRIu64 "-%" PRIu64 ": %" PRIu64,
+				(uint64_t)1 << (i - 1), ((uint64_t)1 << i) - 1,
+				hist[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Per-second rate of a count over a time in microseconds. */
+static double stats_rate(uint64_t count, uint64_t usec)
+{
+	return usec ? count * 1000000.0 / usec : 0;
+}
+
+static void show_stats(const struct sr_dev *dev)
+{
+	struct sr_datafeed_cb_stats cs;
+	struct sr_driver_stats ds;
+
+	if (sr_session_stats_driver_get(dev->driver, &ds) == SR_OK) {
+		fprintf(stderr, "Driver %s:\n", dev->driver->name);
+		fprintf(stderr, "    %" PRIu64 " packets in %.3f ms "
+			"(%.0f packets/s)\n", ds.packets, ds.elapsed / 1000.0,
+			stats_rate(ds.packets, ds.elapsed));
+		if (ds.data_packets) {
+			fprintf(stderr, "    %" PRIu64 " data packets of %" PRIu64
+				"-%" PRIu64 " bytes, %" PRIu64 " on average\n",
+				ds.data_packets, ds.size_min, ds.size_max,
+				ds.bytes / ds.data_packets);
+			fprintf(stderr, "    %.0f bytes/s, %.0f samples/s\n",
+				stats_rate(ds.bytes, ds.elapsed),
+				stats_rate(ds.samples, ds.elapsed));
+			show_histogram("Packet sizes (bytes)", ds.size_hist);
+		}
+	}
+
+	/* The current call isn't accounted for yet. */
+	if (sr_session_stats_callback_get(datafeed_in, &cs) == SR_OK
+	    && cs.calls) {
+		fprintf(stderr, "Datafeed callback:\n");
+		fprintf(stderr, "    %" PRIu64 " calls in %.3f ms, %.3f ms "
+			"busy\n", cs.calls, cs.elapsed / 1000.0,
+			cs.busy / 1000.0);
+		fprintf(stderr, "    %.0f bytes/s, %.0f samples/s "
+			"(%.0f bytes/s while busy)\n",
+			stats_rate(cs.bytes, cs.elapsed),
+			stats_rate(cs.samples, cs.elapsed),
+			stats_rate(cs.bytes, cs.busy));
+		fprintf(stderr, "    Latency %" PRIu64 "/%" PRIu64 "/%" PRIu64
+			" us (min/avg/max)\n", cs.latency_min,
+			cs.latency_total / cs.calls, cs.latency_max);
+		show_histogram("Latency (us)", cs.latency_hist);
+	}
+}
+
 static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 {
 	static struct sr_output *o = NULL;
-	static int logic_probelist[SR_MAX_NUM_PROBES] = { 0 };
+	static int logic_probelist[SR_MAX_NUM_PROBES + 1] = { 0 };
+	static struct sr_filter_plan *filter_plan = NULL;
+	static uint8_t *filter_out = NULL;
+	static uint64_t filter_out_size = 0;
 	static struct sr_probe *analog_probelist[SR_MAX_NUM_PROBES];
 	static uint64_t received_samples = 0;
 	static int unitsize = 0;
@@ -434,10 +624,11 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 	struct sr_datafeed_meta_logic *meta_logic;
 	struct sr_datafeed_analog *analog;
 	struct sr_datafeed_meta_analog *meta_analog;
+	struct sr_datafeed_overrun *overrun;
 	static int num_enabled_analog_probes = 0;
 	int num_enabled_probes, sample_size, ret, i;
 	uint64_t output_len, filter_out_len;
-	uint8_t *output_buf, *filter_out;
+	uint8_t *output_buf;
 
 	/* If the first packet to come in isn't a header, don't even try. */
 	if (packet->type != SR_DF_HEADER && o == NULL)
@@ -484,11 +675,20 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (opt_continuous)
 			g_warning("Device stopped after %" PRIu64 " samples.",
 			       received_samples);
+		if (opt_stats)
+			show_stats(dev);
 		sr_session_stop();
 		if (outfile && outfile != stdout)
 			fclose(outfile);
 		g_free(o);
 		o = NULL;
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
+		g_free(filter_out);
+		filter_out = NULL;
+		filter_out_size = 0;
 		break;
 
 	case SR_DF_TRIGGER:
@@ -497,6 +697,8 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 			o->format->event(o, SR_DF_TRIGGER, &output_buf,
 					 &output_len);
 		triggered = 1;
+		if (session_writer)
+			sr_session_writer_trigger(session_writer, dev);
 		break;
 
 	case SR_DF_META_LOGIC:
@@ -508,21 +710,20 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 			if (probe->enabled)
 				logic_probelist[num_enabled_probes++] = probe->index;
 		}
+		logic_probelist[num_enabled_probes] = 0;
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
 
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* output file is in session format */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
-				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
-					exit(1);
-				}
+				session_file_new(dev, unitsize);
 			} else {
 				/* saving to a file in whatever format was set
 				 * with --format, so all we need is a filehandle */
@@ -548,9 +749,27 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (limit_samples && received_samples >= limit_samples)
 			break;
 
-		ret = sr_filter_probes(sample_size, unitsize, logic_probelist,
-					   logic->data, logic->length,
-					   &filter_out, &filter_out_len);
+		/* The plan depends on the input unit size, so set it up here. */
+		if (filter_plan && filter_plan->in_unitsize != sample_size) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
+		if (!filter_plan && sr_filter_plan_new(sample_size, unitsize,
+				logic_probelist, &filter_plan) != SR_OK)
+			break;
+
+		/* Reuse the output buffer, only growing it when needed. */
+		if (logic->length / sample_size * unitsize > filter_out_size) {
+			g_free(filter_out);
+			filter_out_size = logic->length / sample_size * unitsize;
+			if (!(filter_out = g_try_malloc(filter_out_size))) {
+				g_critical("Filter buffer malloc failed.");
+				exit(1);
+			}
+		}
+
+		ret = sr_filter_plan_run(filter_plan, logic->data, logic->length,
+					 filter_out, &filter_out_len);
 		if (ret != SR_OK)
 			break;
 
@@ -566,6 +785,12 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (dev->datastore)
 			sr_datastore_put(dev->datastore, filter_out,
 					 filter_out_len, sample_size, logic_probelist);
+		else if (session_writer
+			 && sr_session_writer_append(session_writer, dev,
+				filter_out, filter_out_len, unitsize) != SR_OK) {
+			g_critical("Failed to write session file.");
+			sr_session_stop();
+		}
 
 		if (opt_output_file && default_output_format)
 			/* saving to a session file, don't need to do anything else
@@ -588,7 +813,6 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 
 		cleanup:
-		g_free(filter_out);
 		received_samples += logic->length / sample_size;
 		break;
 
@@ -606,15 +830,9 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* output file is in session format */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
-				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
-					exit(1);
-				}
+				session_file_new(dev, unitsize);
 			} else {
 				/* saving to a file in whatever format was set
 				 * with --format, so all we need is a filehandle */
@@ -672,6 +890,12 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 		break;
 
+	case SR_DF_OVERRUN:
+		overrun = packet->payload;
+		g_warning("Processing fell behind, dropped %" PRIu64
+			  " samples.", overrun->samples);
+		break;
+
 	default:
 		g_message("received unknown packet type %d", packet->type);
 	}
@@ -1068,6 +1292,11 @@ static void load_input_file_format(void)
 
 	sr_session_new();
 	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_config_set(SR_SESSION_STATS, &opt_stats);
+	if (set_file_compression() != SR_OK) {
+		sr_session_destroy();
+		return;
+	}
 	if (sr_session_dev_add(in->vdev) != SR_OK) {
 		g_critical("Failed to use device.");
 		sr_session_destroy();
@@ -1075,25 +1304,84 @@ static void load_input_file_format(void)
 	}
 
 	input_format->loadfile(in, opt_input_file);
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	if (opt_output_file && default_output_format)
+		session_file_save();
 	sr_session_destroy();
 
 	if (fmtargs)
 		g_hash_table_destroy(fmtargs);
 }
 
+static int set_replay_mode(void)
+{
+	struct sr_dev *dev;
+	GSList *l;
+	uint64_t mode, start, samples;
+
+	mode = SR_REPLAY_MAX_SPEED;
+	if (opt_replay) {
+		if (!strcmp(opt_replay, "realtime"))
+			mode = SR_REPLAY_REALTIME;
+		else if (strcmp(opt_replay, "max")) {
+			g_critical("Invalid replay mode '%s'.", opt_replay);
+			return SR_ERR_ARG;
+		}
+	}
+
+	start = 0;
+	if (opt_replay_start
+	    && sr_parse_sizestring(opt_replay_start, &start) != SR_OK) {
+		g_critical("Invalid replay start '%s'.", opt_replay_start);
+		return SR_ERR_ARG;
+	}
+
+	samples = 0;
+	if (opt_samples && sr_parse_sizestring(opt_samples, &samples) != SR_OK) {
+		g_critical("Invalid sample limit '%s'.", opt_samples);
+		return SR_ERR_ARG;
+	}
+
+	for (l = sr_dev_list(); l; l = l->next) {
+		dev = l->data;
+		if (!sr_dev_has_hwcap(dev, SR_HWCAP_CAPTURE_REPLAY))
+			continue;
+		if (dev->driver->dev_config_set(dev->driver_index,
+				SR_HWCAP_CAPTURE_REPLAY, &mode) != SR_OK) {
+			g_critical("Failed to set replay mode.");
+			return SR_ERR;
+		}
+		if (start && dev->driver->dev_config_set(dev->driver_index,
+				SR_HWCAP_CAPTURE_START, &start) != SR_OK) {
+			g_critical("Failed to set replay start.");
+			return SR_ERR;
+		}
+		if (samples && dev->driver->dev_config_set(dev->driver_index,
+				SR_HWCAP_LIMIT_SAMPLES, &samples) != SR_OK) {
+			g_critical("Failed to configure sample limit.");
+			return SR_ERR;
+		}
+	}
+
+	return SR_OK;
+}
+
 static void load_input_file(void)
 {
 
 	if (sr_session_load(opt_input_file) == SR_OK) {
 		/* sigrok session file */
+		if (set_replay_mode() != SR_OK
+		    || set_file_compression() != SR_OK) {
+			sr_session_destroy();
+			return;
+		}
 		sr_session_datafeed_callback_add(datafeed_in);
+		sr_session_config_set(SR_SESSION_STATS, &opt_stats);
 		sr_session_start();
 		sr_session_run();
 		sr_session_stop();
+		if (opt_output_file && default_output_format)
+			session_file_save();
 	}
 	else {
 		/* fall back on input modules */
@@ -1203,8 +1491,8 @@ static void run_session(void)
 {
 	struct sr_dev *dev;
 	GHashTable *devargs;
-	int num_devs, max_probes, i;
-	uint64_t time_msec;
+	int num_devs, max_probes, queue_policy, i;
+	uint64_t time_msec, dropped_samples;
 	char **probelist, *devspec;
 
 	devargs = NULL;
@@ -1234,6 +1522,39 @@ static void run_session(void)
 
 	sr_session_new();
 	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_config_set(SR_SESSION_STATS, &opt_stats);
+
+	if (set_file_compression() != SR_OK) {
+		sr_session_destroy();
+		return;
+	}
+
+	if (opt_threaded || opt_queue_policy) {
+		opt_threaded = TRUE;
+		if (sr_session_config_set(SR_SESSION_THREADED,
+					  &opt_threaded) != SR_OK) {
+			g_critical("Failed to enable threaded mode.");
+			sr_session_destroy();
+			return;
+		}
+	}
+
+	if (opt_queue_policy) {
+		if (!strcmp(opt_queue_policy, "block"))
+			queue_policy = SR_QUEUE_BLOCK;
+		else if (!strcmp(opt_queue_policy, "drop-oldest"))
+			queue_policy = SR_QUEUE_DROP_OLDEST;
+		else if (!strcmp(opt_queue_policy, "drop-newest"))
+			queue_policy = SR_QUEUE_DROP_NEWEST;
+		else
+			queue_policy = -1;
+		if (sr_session_config_set(SR_SESSION_QUEUE_POLICY,
+					  &queue_policy) != SR_OK) {
+			g_critical("Invalid queue policy '%s'.", opt_queue_policy);
+			sr_session_destroy();
+			return;
+		}
+	}
 
 	if (sr_session_dev_add(dev) != SR_OK) {
 		g_critical("Failed to use device.");
@@ -1361,10 +1682,13 @@ static void run_session(void)
 	if (opt_continuous)
 		clear_anykey();
 
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	if (sr_session_dropped_get(NULL, &dropped_samples) == SR_OK
+	    && dropped_samples > 0)
+		g_warning("%" PRIu64 " samples were dropped in total.",
+			  dropped_samples);
+
+	if (opt_output_file && default_output_format)
+		session_file_save();
 	sr_session_destroy();
 }
 
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <libsigrok/libsigrok.h>
 #include <gtk/gtk.h>
 
 #include "gtkcellrenderersignal.h"
@@ -25,6 +26,7 @@ enum
 {
 	PROP_0,
 	PROP_DATA,
+	PROP_DATASTORE,
 	PROP_PROBE,
 	PROP_FOREGROUND,
 	PROP_SCALE,
@@ -34,6 +36,7 @@ enum
 struct _GtkCellRendererSignalPrivate
 {
 	GArray *data;
+	struct sr_datastore *datastore;
 	guint32 probe;
 	GdkColor foreground;
 	gdouble scale;
@@ -85,6 +88,13 @@ gtk_cell_renderer_signal_class_init (GtkCellRendererSignalClass *klass)
 						"Binary samples data",
 						G_PARAM_READWRITE));
 
+	g_object_class_install_property(object_class,
+				PROP_DATASTORE,
+				g_param_spec_pointer("datastore",
+						"Datastore",
+						"Samples, if there is no data",
+						G_PARAM_READWRITE));
+
 	g_object_class_install_property (object_class,
 				PROP_PROBE,
 				g_param_spec_int("probe",
@@ -131,6 +141,7 @@ static void gtk_cell_renderer_signal_init(GtkCellRendererSignal *cel)
 	priv = cel->priv;
 
 	priv->data = NULL;
+	priv->datastore = NULL;
 	priv->probe = -1;
 	priv->scale = 1;
 	priv->offset = 0;
@@ -163,6 +174,9 @@ gtk_cell_renderer_signal_get_property(GObject *object,
 	case PROP_DATA:
 		g_value_set_pointer(value, priv->data);
 		break;
+	case PROP_DATASTORE:
+		g_value_set_pointer(value, priv->datastore);
+		break;
 	case PROP_PROBE:
 		g_value_set_int(value, priv->probe);
 		break;
@@ -190,6 +204,9 @@ gtk_cell_renderer_signal_set_property(GObject *object,
 	case PROP_DATA:
 		priv->data = g_value_get_pointer(value);
 		break;
+	case PROP_DATASTORE:
+		priv->datastore = g_value_get_pointer(value);
+		break;
 	case PROP_PROBE:
 		priv->probe = g_value_get_int(value);
 		break;
@@ -229,13 +246,9 @@ gtk_cell_renderer_signal_get_size(GtkCellRenderer *cell,
 }
 
 
-static gboolean sample(GArray *data, gint probe, guint i)
+static gboolean sample(const guint8 *unit, gint probe)
 {
-	int unitsize = g_array_get_element_size(data);
-	g_return_val_if_fail(i < data->len, FALSE);
-	g_return_val_if_fail(probe < unitsize * 8, FALSE);
-
-	return data->data[(i*unitsize) + probe/8] & (1 << (probe & 7));
+	return unit[probe/8] & (1 << (probe & 7));
 }
 
 static void
@@ -249,22 +262,53 @@ gtk_cell_renderer_signal_render(GtkCellRenderer *cell,
 {
 	GtkCellRendererSignal *cel = GTK_CELL_RENDERER_SIGNAL(cell);
 	GtkCellRendererSignalPrivate *priv= cel->priv;
-	guint nsamples = priv->data->len;
+	struct sr_datastore_iter iter;
+	const guint8 *span;
+	guint64 nsamples, num, span_len;
+	int unitsize;
 	gint xpad, ypad;
 	int x, y, w, h;
-	guint si;
+	guint64 si;
 	gdouble o;
 
 	(void)widget;
 	(void)expose_area;
 	(void)flags;
 
+	/* The summary if zoomed out, otherwise the complete data. */
+	if (priv->data) {
+		nsamples = priv->data->len;
+		unitsize = g_array_get_element_size(priv->data);
+	} else if (priv->datastore) {
+		nsamples = priv->datastore->num_units;
+		unitsize = priv->datastore->ds_unitsize;
+	} else {
+		return;
+	}
+	g_return_if_fail(priv->probe < (guint32)unitsize * 8);
+
 	gtk_cell_renderer_get_padding (cell, &xpad, &ypad);
 	x = cell_area->x + xpad;
 	y = cell_area->y + ypad;
 	w = cell_area->width - xpad * 2;
 	h = cell_area->height - ypad * 2;
 
+	si = priv->offset / priv->scale;
+	if (si >= nsamples)
+		return;
+
+	/* Only the samples from the left edge of the cell to the right one
+	 * are read, the datastore hands them out without copying. */
+	num = MIN(nsamples - si, (guint64)(w / priv->scale) + 2);
+	if (priv->data) {
+		span = (const guint8 *)priv->data->data + si * unitsize;
+		span_len = num;
+	} else if (sr_datastore_iter_init(&iter, priv->datastore, si, num)
+			!= SR_OK || sr_datastore_iter_next(&iter,
+			(const void **)&span, &span_len) != SR_OK || !span_len) {
+		return;
+	}
+
 	cairo_t *cr = gdk_cairo_create(GDK_DRAWABLE(window));
 
 	/* Set clipping region to background rectangle.
@@ -279,18 +323,25 @@ gtk_cell_renderer_signal_render(GtkCellRenderer *cell,
 	/*cairo_set_line_width(cr, 1);*/
 	cairo_new_path(cr);
 
-	si = priv->offset / priv->scale;
-	if (si >= nsamples)
-		return;
 	o = x - (priv->offset - si * priv->scale);
 
-	guint32 oldsample = sample(priv->data, priv->probe, si++);
+	guint32 oldsample = sample(span, priv->probe);
+	span += unitsize;
+	span_len--;
+	num--;
 	cairo_move_to(cr, o, y +
 		(oldsample ? 0 : h));
 	o += priv->scale;
 	
-	while ((si < nsamples) && (o - priv->scale < x+w)) {
-		guint32 cursample = sample(priv->data, priv->probe, si);
+	while ((num > 0) && (o - priv->scale < x+w)) {
+		if (!span_len && (sr_datastore_iter_next(&iter,
+				(const void **)&span, &span_len) != SR_OK
+				|| !span_len))
+			break;
+		guint32 cursample = sample(span, priv->probe);
+		span += unitsize;
+		span_len--;
+		num--;
 		if (cursample != oldsample) {
 			cairo_line_to(cr, o - priv->scale/8, y +
 				(oldsample ? 0 : h));
@@ -299,7 +350,6 @@ gtk_cell_renderer_signal_render(GtkCellRenderer *cell,
 			oldsample = cursample;
 		}
 		o += priv->scale;
-		si++;
 	}
 	cairo_line_to(cr, o - priv->scale/8, y +
 		(oldsample ? 0 : h));
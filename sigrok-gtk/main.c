@@ -45,6 +45,8 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 	uint64_t filter_out_len;
 	uint8_t *filter_out;
 	GArray *data;
+	struct sr_datastore *ds;
+	int ret;
 
 	switch (packet->type) {
 	case SR_DF_HEADER:
@@ -78,8 +80,24 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
-		data = g_array_new(FALSE, FALSE, unitsize);
-		g_object_set_data(G_OBJECT(siglist), "sampledata", data);
+		/* Drop the summary of any previous capture. */
+		data = g_object_get_data(G_OBJECT(siglist), "summarydata");
+		if (data) {
+			g_object_set_data(G_OBJECT(siglist), "summarydata", NULL);
+			g_array_free(data, TRUE);
+		}
+		/* The datastore holds the samples, and the summary used for
+		 * zooming out. */
+		g_object_set_data(G_OBJECT(siglist), "sampleds", NULL);
+		if ((ret = sr_datastore_new(unitsize, 0, &ds)) != SR_OK) {
+			g_warning("Failed to create datastore (%d).", ret);
+			break;
+		}
+		if ((ret = sr_datastore_summary_set(ds, TRUE)) != SR_OK)
+			g_warning("Failed to enable the datastore summary "
+				  "(%d), zooming out will be slow.", ret);
+		g_object_set_data_full(G_OBJECT(siglist), "sampleds", ds,
+				(GDestroyNotify)sr_datastore_destroy);
 		break;
 	case SR_DF_LOGIC:
 		logic = packet->payload;
@@ -94,10 +112,10 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 					   &filter_out, &filter_out_len) != SR_OK)
 			break;
 
-		data = g_object_get_data(G_OBJECT(siglist), "sampledata");
-		g_return_if_fail(data != NULL);
-
-		g_array_append_vals(data, filter_out, filter_out_len/unitsize);
+		ds = g_object_get_data(G_OBJECT(siglist), "sampleds");
+		if (ds && sr_datastore_put(ds, filter_out, filter_out_len,
+					unitsize, logic_probelist) != SR_OK)
+			g_warning("Failed to store samples.");
 
 		g_free(filter_out);
 		break;
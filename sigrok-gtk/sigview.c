@@ -35,6 +35,7 @@ static void format_func(GtkTreeViewColumn *tree_column, GtkCellRenderer *cell,
 	int probe;
 	char *colour;
 	GArray *data;
+	struct sr_datastore *ds;
 
 	(void)tree_column;
 	(void)cb_data;
@@ -45,13 +46,13 @@ static void format_func(GtkTreeViewColumn *tree_column, GtkCellRenderer *cell,
 	 */
 	gtk_tree_model_get(siglist, iter, 1, &colour, 2, &probe, -1);
 
-	/* Try get summary data from the list */
+	/* Try get summary data from the list, the renderer reads the
+	 * complete data from the datastore otherwise. */
 	data = g_object_get_data(G_OBJECT(siglist), "summarydata");
-	if (!data)
-		data = g_object_get_data(G_OBJECT(siglist), "sampledata");
+	ds = g_object_get_data(G_OBJECT(siglist), "sampleds");
 
-	g_object_set(G_OBJECT(cell), "data", data, "probe", probe,
-				"foreground", colour, NULL);
+	g_object_set(G_OBJECT(cell), "data", data, "datastore", ds,
+				"probe", probe, "foreground", colour, NULL);
 }
 
 static gboolean do_scroll_event(GtkTreeView *tv, GdkEventScroll *e)
@@ -86,7 +87,7 @@ static gboolean do_motion_event(GtkWidget *tv, GdkEventMotion *e,
 	GObject *siglist;
 	gint x;
 	gint offset;
-	GArray *data;
+	struct sr_datastore *ds;
 	guint nsamples;
 	GtkTreeViewColumn *col;
 	gint width;
@@ -98,9 +99,11 @@ static gboolean do_motion_event(GtkWidget *tv, GdkEventMotion *e,
 	adj = g_object_get_data(G_OBJECT(tv), "hadj");
 
 	siglist = G_OBJECT(gtk_tree_view_get_model(GTK_TREE_VIEW(tv)));
-	data = g_object_get_data(siglist, "sampledata");
+	ds = g_object_get_data(siglist, "sampleds");
 	rscale = g_object_get_data(siglist, "rscale");
-	nsamples = (data->len / g_array_get_element_size(data)) - 1;
+	if (!ds || ds->num_units < 2 || !rscale)
+		return TRUE;
+	nsamples = ds->num_units - 1;
 	col = g_object_get_data(G_OBJECT(tv), "signalcol");
 	width = gtk_tree_view_column_get_width(col);
 
@@ -211,34 +214,52 @@ GtkWidget *sigview_init(void)
 	return sw;
 }
 
-static GArray *summarize(GArray *in, gdouble *scale)
+/* Summarize the complete data to about four samples per pixel.
+ * The datastore's summary pyramid makes this proportional to the number
+ * of samples in the result, rather than in the complete data.
+ */
+static GArray *summarize(struct sr_datastore *ds, gdouble *scale)
 {
 	GArray *ret;
 	int skip = 1 / (*scale * 4);
-	guint64 i, j, k, l;
-	unsigned unitsize = g_array_get_element_size(in);
-	uint8_t s[unitsize];
-	uint8_t smask[unitsize];
-
-	g_return_val_if_fail(skip > 1, NULL);
+	guint64 i, n;
+	unsigned l;
+	guint64 *toggled, *values;
+	guint64 s;
+	unsigned unitsize = ds->ds_unitsize;
+
+	if (skip < 2)
+		return NULL;
+
+	n = ds->num_units / skip;
+	if (n == 0)
+		return NULL;
+
+	toggled = g_malloc(n * sizeof(guint64));
+	values = g_malloc(n * sizeof(guint64));
+	if (sr_datastore_summary_get(ds, 0, n * skip, n,
+				toggled, values) != SR_OK) {
+		g_free(toggled);
+		g_free(values);
+		return NULL;
+	}
 
-	ret = g_array_sized_new(FALSE, FALSE, unitsize, in->len / skip);
-	ret->len = in->len / skip;
+	ret = g_array_sized_new(FALSE, FALSE, unitsize, n);
+	g_array_set_size(ret, n);
 	*scale *= skip;
 
-	memset(s, 0, unitsize);
-	for (i = 0, k = 0; i < (in->len/unitsize); i += skip, k++) {
-		memset(smask, 0xFF, unitsize);
-		for (j = i; j < i+skip; j++) {
-			for (l = 0; l < unitsize; l++) {
-				uint8_t ns = (in->data[(j*unitsize)+l] ^ s[l]) & smask[l];
-				/* ns is now bits we need to toggle */
-				s[l] ^= ns;
-				smask[l] &= ~ns;
-			}
-		}
-		memcpy(&ret->data[k*unitsize], s, unitsize);
+	s = 0;
+	for (i = 0; i < n; i++) {
+		/* Flip the probes which toggled, so every transition
+		 * shows up as an edge. The others show their value.
+		 */
+		s = ((s ^ toggled[i]) & toggled[i]) | (values[i] & ~toggled[i]);
+		for (l = 0; l < unitsize; l++)
+			ret->data[(i*unitsize)+l] = s >> (l * 8);
 	}
+
+	g_free(toggled);
+	g_free(values);
 	return ret;
 }
 
@@ -251,9 +272,9 @@ void sigview_zoom(GtkWidget *sigview, gdouble zoom, gint offset)
 	/* data and scale refer to summary */
 	GArray *data;
 	gdouble scale;
-	/* rdata and rscale refer to complete data */
-	GArray *rdata;
+	/* ds and rscale refer to complete data */
 	gdouble *rscale;
+	struct sr_datastore *ds;
 	gint ofs;
 	gint width;
 	guint nsamples;
@@ -272,7 +293,7 @@ void sigview_zoom(GtkWidget *sigview, gdouble zoom, gint offset)
 	width = gtk_tree_view_column_get_width(col);
 
 	siglist = G_OBJECT(gtk_tree_view_get_model(GTK_TREE_VIEW(sigview)));
-	rdata = g_object_get_data(siglist, "sampledata");
+	ds = g_object_get_data(siglist, "sampleds");
 	rscale = g_object_get_data(siglist, "rscale");
 	if (!rscale) {
 		rscale = g_malloc(sizeof(rscale));
@@ -280,11 +301,9 @@ void sigview_zoom(GtkWidget *sigview, gdouble zoom, gint offset)
 		g_object_set_data(siglist, "rscale", rscale);
 	}
 	data = g_object_get_data(siglist, "summarydata");
-	if (!rdata)
+	if (!ds || ds->num_units < 2)
 		return;
-	if (!data)
-		data = rdata;
-	nsamples = (rdata->len / g_array_get_element_size(rdata)) - 1;
+	nsamples = ds->num_units - 1;
 	if ((fabs(*rscale - (double)width/nsamples) < 1e-12) && (zoom < 1))
 		return;
 
@@ -305,9 +324,12 @@ void sigview_zoom(GtkWidget *sigview, gdouble zoom, gint offset)
 	if (*rscale < (double)width/nsamples) {
 		*rscale = (double)width/nsamples;
 		scale = *rscale;
-		if (data && (data != rdata))
+		/* Back to the complete data. */
+		if (data) {
+			g_object_set_data(siglist, "summarydata", NULL);
 			g_array_free(data, TRUE);
-		data = rdata;
+			data = NULL;
+		}
 	}
 
 	if (ofs > nsamples * *rscale - width)
@@ -316,16 +338,12 @@ void sigview_zoom(GtkWidget *sigview, gdouble zoom, gint offset)
 	gtk_adjustment_configure(adj, ofs, 0, nsamples * *rscale, 
 			width/16, width/2, width);
 
-	if (scale < 0.125) {
-		g_object_set_data(siglist,
-			"summarydata", summarize(data, &scale));
-		if (data && (data != rdata))
-			g_array_free(data, TRUE);
-	} else if ((scale > 1) && (*rscale < 1)) {
+	if ((scale < 0.125) || ((scale > 1) && (*rscale < 1))) {
 		scale = *rscale;
+		/* Without a summary the complete data is drawn. */
 		g_object_set_data(siglist,
-			"summarydata", summarize(rdata, &scale));
-		if (data && (data != rdata))
+			"summarydata", summarize(ds, &scale));
+		if (data)
 			g_array_free(data, TRUE);
 	}
 